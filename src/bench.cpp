@@ -0,0 +1,1347 @@
+#include "main.h"
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cwchar>
+#include <initializer_list>
+#include <locale>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <new>
+#include <sstream>
+
+// Usage: virtfiles_bench [--filter text] [--json file] [--list]
+// Runs benchmark groups whose name contains filter text, prints results
+// and writes them to JSON file in Google Benchmark format, so runs of
+// different versions can be compared by its tools. Inputs are fixed and
+// random access uses fixed seed, so every run does the same work
+
+namespace
+{
+	size_t allocation_count = 0;
+}
+
+// Replacements are kept out of line. Once they are inlined, GCC pairs
+// the free below with a new expression of the caller, as if the default
+// operator new had allocated the memory, and reports a mismatch
+#if defined(_MSC_VER) && !defined(__clang__)
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+// Count heap allocations
+BENCH_NOINLINE void* operator new(size_t size)
+{
+	++allocation_count;
+
+	if (void* p = malloc(size ? size : 1))
+	{
+		return p;
+	}
+
+	throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+BENCH_NOINLINE void* operator new(size_t size, std::align_val_t align)
+{
+	++allocation_count;
+
+	size_t alignment = static_cast<size_t>(align);
+
+	if (void* p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment))
+	{
+		return p;
+	}
+
+	throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* p, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+BENCH_NOINLINE void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+namespace
+{
+	using bench_clock = std::chrono::steady_clock;
+
+	double seconds_since(bench_clock::time_point start)
+	{
+		return std::chrono::duration<double>(bench_clock::now() - start).count();
+	}
+
+	// Measurement of a benchmark case for JSON report
+	struct bench_result
+	{
+		std::string name;
+		size_t iterations;
+		double seconds;
+		std::vector<std::pair<std::string, double>> counters;
+	};
+
+	std::vector<bench_result> results;
+
+	// Name of case from printf format
+	std::string case_name(const char* format, ...)
+	{
+		char name[128];
+		va_list args;
+
+		va_start(args, format);
+		vsnprintf(name, sizeof(name), format, args);
+		va_end(args);
+
+		return name;
+	}
+
+	// Record that iterations of case took seconds in total
+	void report(std::string name, size_t iterations, double seconds,
+		std::initializer_list<std::pair<const char*, double>> counters = {})
+	{
+		bench_result result{ std::move(name), iterations ? iterations : 1, seconds, {} };
+
+		for (const auto& counter : counters)
+		{
+			result.counters.emplace_back(counter.first, counter.second);
+		}
+
+		results.push_back(std::move(result));
+	}
+
+	void write_json_string(FILE* out, const std::string& text)
+	{
+		fputc('"', out);
+
+		for (char ch : text)
+		{
+			if (ch == '"' || ch == '\\')
+			{
+				fputc('\\', out);
+			}
+
+			fputc(ch, out);
+		}
+
+		fputc('"', out);
+	}
+
+	// Write results like Google Benchmark does, time is per iteration.
+	// Cases run on one thread, so CPU time is reported as wall time
+	bool write_json(const char* path, const char* executable)
+	{
+		FILE* out = fopen(path, "w");
+
+		if (!out)
+		{
+			return false;
+		}
+
+		char date[64];
+		time_t now = time(nullptr);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+		fprintf(out, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"executable\": ", date);
+		write_json_string(out, executable);
+		fprintf(out, ",\n    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+
+#ifdef NDEBUG
+		fprintf(out, "    \"library_build_type\": \"release\",\n");
+#else
+		fprintf(out, "    \"library_build_type\": \"debug\",\n");
+#endif
+
+#ifdef __VERSION__
+		fprintf(out, "    \"compiler\": ");
+		write_json_string(out, __VERSION__);
+		fprintf(out, ",\n");
+#endif
+
+		fprintf(out, "    \"virtfiles_threadsafe\": %s,\n",
+#ifdef VIRTFILES_THREADSAFE
+			"true"
+#else
+			"false"
+#endif
+		);
+
+		fprintf(out, "    \"virtfiles_journal\": %s\n  },\n  \"benchmarks\": [",
+#ifdef VIRTFILES_JOURNAL
+			"true"
+#else
+			"false"
+#endif
+		);
+
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const bench_result& result = results[i];
+			double ns = result.seconds * 1e9 / result.iterations;
+
+			fprintf(out, "%s\n    {\n      \"name\": ", i ? "," : "");
+			write_json_string(out, result.name);
+			fprintf(out, ",\n      \"run_name\": ");
+			write_json_string(out, result.name);
+			fprintf(out, ",\n      \"run_type\": \"iteration\",\n      \"repetitions\": 1,\n"
+				"      \"iterations\": %zu,\n      \"real_time\": %.9g,\n      \"cpu_time\": %.9g,\n"
+				"      \"time_unit\": \"ns\"", result.iterations, ns, ns);
+
+			for (const auto& counter : result.counters)
+			{
+				fprintf(out, ",\n      ");
+				write_json_string(out, counter.first);
+				fprintf(out, ": %.9g", counter.second);
+			}
+
+			fprintf(out, "\n    }");
+		}
+
+		fprintf(out, "\n  ]\n}\n");
+
+		return fclose(out) == 0;
+	}
+
+	// Appends count small records to a single file
+	void bench_appends(size_t count)
+	{
+		static const char record[] = "2024-01-01 00:00:00 INFO record\n";
+		constexpr size_t record_size = sizeof(record) - 1;
+
+		virtfiles::file_t file("appends.log");
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			file.appendBytes(record, record_size);
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("appends: %8zu x %zu bytes  %9.3f ms  %7.2f ns/append\n",
+			count, record_size, elapsed * 1e3, elapsed * 1e9 / count);
+
+		report(case_name("appends/%zu", count), count, elapsed,
+			{ { "bytes_per_second", count * record_size / elapsed } });
+	}
+
+	// Creates count files in a single folder
+	void bench_wide_folder(size_t count)
+	{
+		virtfiles::folder_t folder("wide");
+		char name[32];
+
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "file_%zu.txt", i);
+			folder._createFile(name);
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("wide folder:    %8zu files  %9.3f ms  %7.2f ns/file\n",
+			count, elapsed * 1e3, elapsed * 1e9 / count);
+
+		report(case_name("wide_folder/%zu", count), count, elapsed);
+	}
+
+	// Looks up each of count files of a folder by name in other case
+	void bench_folder_lookup(size_t count)
+	{
+		virtfiles::folder_t folder("lookup");
+		std::vector<std::string> names;
+		char name[64];
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "Quarterly_Report_%zu.txt", i);
+			folder._createFile(name);
+
+			for (char* c = name; *c; ++c)
+			{
+				*c = static_cast<char>(toupper(*c));
+			}
+
+			names.emplace_back(name);
+		}
+
+		size_t found = 0;
+		auto start = bench_clock::now();
+
+		for (const std::string& upper : names)
+		{
+			found += folder.get_entry(upper) != nullptr;
+		}
+
+		double lookup_elapsed = seconds_since(start);
+		start = bench_clock::now();
+
+		for (const std::string& upper : names)
+		{
+			found += virtfiles::base_entry::check_name(upper.data(), upper.size());
+		}
+
+		double check_elapsed = seconds_since(start);
+
+		printf("name lookup:    %8zu names  %7.2f ns/lookup  %7.2f ns/check_name  (%zu found)\n",
+			count, lookup_elapsed * 1e9 / count, check_elapsed * 1e9 / count, found);
+
+		report(case_name("name_lookup/%zu", count), count, lookup_elapsed);
+		report(case_name("check_name/%zu", count), count, check_elapsed);
+	}
+
+	// Builds tree of folders with files each in a new file system and destroys it.
+	// Entries are allocated from file system arena or from heap
+	void bench_tree(size_t folders, size_t files, bool arena)
+	{
+		char name[32];
+		size_t start_count = allocation_count;
+		auto start = bench_clock::now();
+
+		auto tree = arena
+			? std::make_unique<virtfiles::filesystem>()
+			: std::make_unique<virtfiles::filesystem>(std::pmr::new_delete_resource());
+
+		for (size_t i = 0; i < folders; ++i)
+		{
+			snprintf(name, sizeof(name), "dir_%zu", i);
+			virtfiles::folder_t& folder = tree->get_root()->_createFolder(name);
+
+			for (size_t j = 0; j < files; ++j)
+			{
+				snprintf(name, sizeof(name), "file_%zu.txt", j);
+				folder._createFile(name);
+			}
+		}
+
+		double build_elapsed = seconds_since(start);
+		size_t allocations = allocation_count - start_count;
+
+		start = bench_clock::now();
+		tree.reset();
+
+		double teardown_elapsed = seconds_since(start);
+		size_t count = folders * files;
+
+		printf("tree (%-5s):   %8zu files  %9.3f ms build  %9.3f ms teardown  %5.2f allocs/file\n",
+			arena ? "arena" : "heap", count, build_elapsed * 1e3, teardown_elapsed * 1e3,
+			double(allocations) / count);
+
+		report(case_name("tree/%s/build", arena ? "arena" : "heap"), count, build_elapsed,
+			{ { "allocs_per_file", double(allocations) / count } });
+		report(case_name("tree/%s/teardown", arena ? "arena" : "heap"), count, teardown_elapsed);
+	}
+
+	// Writes small content to count files and reads all of them back
+	void bench_small_files(size_t count)
+	{
+		virtfiles::filesystem tree;
+		virtfiles::folder_t& folder = tree.get_root()->_createFolder("small");
+		std::vector<virtfiles::file_t*> files;
+		char name[32];
+		char content[64];
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "proc_%zu", i);
+			files.push_back(&folder._createFile(name));
+		}
+
+		size_t start_count = allocation_count;
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			int size = snprintf(content, sizeof(content), "{\"pid\": %zu, \"state\": \"running\"}", i);
+			files[i]->writeBytes(content, static_cast<size_t>(size));
+		}
+
+		double write_elapsed = seconds_since(start);
+		size_t allocations = allocation_count - start_count;
+
+		size_t total = 0;
+		start = bench_clock::now();
+
+		for (virtfiles::file_t* file : files)
+		{
+			total += file->readBytes(0, content, sizeof(content));
+		}
+
+		double read_elapsed = seconds_since(start);
+
+		printf("small files:    %8zu files  %7.2f ns/write  %7.2f ns/read  %5.2f allocs/write  (%zu bytes)\n",
+			count, write_elapsed * 1e9 / count, read_elapsed * 1e9 / count,
+			double(allocations) / count, total);
+
+		report(case_name("small_files/write/%zu", count), count, write_elapsed,
+			{ { "allocs_per_write", double(allocations) / count } });
+		report(case_name("small_files/read/%zu", count), count, read_elapsed);
+	}
+
+	// Publishes count versions of file_size bytes config by copying them over
+	// live file and by renaming temporary file over it, then removes count files
+	void bench_rename(size_t count, size_t file_size)
+	{
+		virtfiles::filesystem tree;
+		virtfiles::folder_t& folder = tree.get_root()->_createFolder("etc");
+		virtfiles::file_t& live = folder._createFile("config");
+		std::string content(file_size, 'x');
+
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			live.writeBytes(content.data(), content.size());
+		}
+
+		double copy_elapsed = seconds_since(start);
+		start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			folder._createFile("config.tmp").writeBytes(content.data(), content.size());
+			folder._move("config.tmp", folder, "config");
+		}
+
+		double rename_elapsed = seconds_since(start);
+		char name[32];
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "%zu", i);
+			folder._createFile(name);
+		}
+
+		start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "%zu", i);
+			folder._remove(name);
+		}
+
+		double remove_elapsed = seconds_since(start);
+
+		printf("publish:        %8zu x %zu B  %9.2f ns/copy  %9.2f ns/rename  %7.2f ns/remove\n",
+			count, file_size, copy_elapsed * 1e9 / count, rename_elapsed * 1e9 / count,
+			remove_elapsed * 1e9 / count);
+
+		report(case_name("publish/copy/%zu", file_size), count, copy_elapsed);
+		report(case_name("publish/rename/%zu", file_size), count, rename_elapsed);
+		report(case_name("publish/remove/%zu", file_size), count, remove_elapsed);
+	}
+
+	// Saves tree of files with size bytes in total to image,
+	// then loads it to new file system and reads a byte of each file
+	void bench_image(size_t size, size_t file_size)
+	{
+		const char* path = "bench_image.vfs";
+		size_t count = size / file_size;
+		char name[64];
+
+		{
+			virtfiles::filesystem tree;
+			std::string content(file_size, 'x');
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				snprintf(name, sizeof(name), "data/%zu/%zu.bin", i / 1000, i);
+				tree.createFile(name, true).writeBytes(content);
+			}
+
+			auto start = bench_clock::now();
+			tree.save_image(path);
+
+			double elapsed = seconds_since(start);
+
+			printf("image save:     %6zu MB  %8zu files  %9.3f ms\n",
+				size >> 20, count, elapsed * 1e3);
+
+			report(case_name("image/save/%zuMB", size >> 20), 1, elapsed,
+				{ { "bytes_per_second", size / elapsed } });
+		}
+
+		virtfiles::filesystem tree;
+		auto start = bench_clock::now();
+
+		tree.load_image(path);
+
+		double load_elapsed = seconds_since(start);
+		size_t total = 0;
+		char byte;
+
+		start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "data/%zu/%zu.bin", i / 1000, i);
+			total += tree.lookup(name).as_file().readBytes(file_size / 2, &byte, 1);
+		}
+
+		double read_elapsed = seconds_since(start);
+
+		printf("image load:     %6zu MB  %8zu files  %9.3f ms load  %9.3f ms first reads  (%zu)\n",
+			size >> 20, count, load_elapsed * 1e3, read_elapsed * 1e3, total);
+
+		report(case_name("image/load/%zuMB", size >> 20), 1, load_elapsed);
+		report(case_name("image/first_read/%zuMB", size >> 20), count, read_elapsed);
+
+		std::remove(path);
+	}
+
+	// Exports tree of count files with file_size bytes each
+	// to tar archive in memory and imports it to new file system
+	void bench_tar(size_t count, size_t file_size)
+	{
+		std::ostringstream out;
+		char name[64];
+
+		{
+			virtfiles::filesystem tree;
+			std::string content(file_size, 'x');
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				snprintf(name, sizeof(name), "src/%zu/%zu.txt", i / 1000, i);
+				tree.createFile(name, true).writeBytes(content);
+			}
+
+			auto start = bench_clock::now();
+			virtfiles::export_tar(*tree.get_root(), out);
+
+			double elapsed = seconds_since(start);
+
+			printf("tar export:     %8zu files  %9.3f ms  %9.0f files/s  %8.2f MB/s\n",
+				count, elapsed * 1e3, count / elapsed, out.str().size() / elapsed / (1 << 20));
+
+			report(case_name("tar/export/%zu", count), count, elapsed,
+				{ { "bytes_per_second", out.str().size() / elapsed } });
+		}
+
+		std::istringstream in(out.str());
+		virtfiles::filesystem tree;
+
+		auto start = bench_clock::now();
+		virtfiles::import_tar(*tree.get_root(), in);
+
+		double elapsed = seconds_since(start);
+
+		printf("tar import:     %8zu files  %9.3f ms  %9.0f files/s  %8.2f MB/s\n",
+			count, elapsed * 1e3, count / elapsed, in.str().size() / elapsed / (1 << 20));
+
+		report(case_name("tar/import/%zu", count), count, elapsed,
+			{ { "bytes_per_second", in.str().size() / elapsed } });
+	}
+
+#ifdef VIRTFILES_JOURNAL
+	// Writes small files with and without journal, then restores them from it
+	void bench_journal(size_t count, size_t sync_count)
+	{
+		const char* path = "bench_journal.vfj";
+		const size_t file_count = 1000;
+		std::string content(100, 'x');
+		char name[64];
+
+		std::remove(path);
+
+		for (int mode = 0; mode < 3; ++mode)
+		{
+			virtfiles::journal_options options;
+			options.wait_for_commit = mode == 2;
+
+			std::unique_ptr<virtfiles::filesystem> tree(mode == 0
+				? new virtfiles::filesystem()
+				: new virtfiles::filesystem(path, options));
+
+			std::vector<virtfiles::file_t*> files;
+
+			for (size_t i = 0; i < file_count; ++i)
+			{
+				snprintf(name, sizeof(name), "data/%zu/%zu.txt", i / 100, i);
+				files.push_back(&tree->createFile(name, true));
+			}
+
+			size_t writes = mode == 2 ? sync_count : count;
+			auto start = bench_clock::now();
+
+			for (size_t i = 0; i < writes; ++i)
+			{
+				files[i % file_count]->writeBytes(content);
+			}
+
+			if (virtfiles::journal* log = tree->get_journal())
+			{
+				log->flush();
+			}
+
+			double elapsed = seconds_since(start);
+
+			static const char* const modes[] = { "none", "background", "wait" };
+
+			printf("journal %-10s %8zu writes  %9.3f ms  %9.2f ns/write\n",
+				modes[mode], writes, elapsed * 1e3, elapsed * 1e9 / writes);
+
+			report(case_name("journal/%s", modes[mode]), writes, elapsed);
+
+			std::remove(path);
+		}
+
+		{
+			virtfiles::journal_options options;
+			options.wait_for_commit = false;
+			options.checkpoint_size = ~size_t{ 0 };
+
+			virtfiles::filesystem tree(path, options);
+			std::vector<virtfiles::file_t*> files;
+
+			for (size_t i = 0; i < file_count; ++i)
+			{
+				snprintf(name, sizeof(name), "data/%zu/%zu.txt", i / 100, i);
+				files.push_back(&tree.createFile(name, true));
+			}
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				files[i % file_count]->writeBytes(content);
+			}
+		}
+
+		double replay_elapsed;
+		double checkpoint_elapsed;
+
+		{
+			auto start = bench_clock::now();
+			virtfiles::filesystem tree(path);
+
+			replay_elapsed = seconds_since(start);
+			start = bench_clock::now();
+
+			tree.get_journal()->checkpoint();
+			checkpoint_elapsed = seconds_since(start);
+		}
+
+		std::remove(path);
+
+		printf("journal replay: %8zu records  %9.3f ms replay  %9.3f ms checkpoint\n",
+			count, replay_elapsed * 1e3, checkpoint_elapsed * 1e3);
+
+		report(case_name("journal/replay/%zu", count), count, replay_elapsed);
+		report(case_name("journal/checkpoint/%zu", count), 1, checkpoint_elapsed);
+	}
+#endif
+
+#ifdef VIRTFILES_HOST_OVERLAY
+	// Mounts host directory of count files, only the first read of a file touches host
+	void bench_host(size_t count, size_t file_size)
+	{
+		const char* root = "bench_host";
+		std::string content(file_size, 'x');
+		char name[64];
+
+		::mkdir(root, 0777);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "%s/%zu.bin", root, i);
+			FILE* file = std::fopen(name, "wb");
+			std::fwrite(content.data(), 1, content.size(), file);
+			std::fclose(file);
+		}
+
+		virtfiles::filesystem tree;
+		auto start = bench_clock::now();
+
+		virtfiles::mount_host(*tree.get_root(), "host", root);
+
+		double mount_elapsed = seconds_since(start);
+		double read_elapsed[2];
+		size_t total = 0;
+		char byte;
+
+		for (double& elapsed : read_elapsed)
+		{
+			start = bench_clock::now();
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				snprintf(name, sizeof(name), "host/%zu.bin", i);
+				total += tree.lookup(name).as_file().readBytes(file_size / 2, &byte, 1);
+			}
+
+			elapsed = seconds_since(start);
+		}
+
+		printf("host overlay:   %8zu files  %9.3f ms mount  %9.3f ms first reads  %9.3f ms second reads  (%zu)\n",
+			count, mount_elapsed * 1e3, read_elapsed[0] * 1e3, read_elapsed[1] * 1e3, total);
+
+		report(case_name("host/mount/%zu", count), 1, mount_elapsed);
+		report(case_name("host/first_read/%zu", count), count, read_elapsed[0]);
+		report(case_name("host/second_read/%zu", count), count, read_elapsed[1]);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			snprintf(name, sizeof(name), "%s/%zu.bin", root, i);
+			std::remove(name);
+		}
+
+		std::remove(root);
+	}
+#endif
+
+	// Opens the same deep file count times
+	void bench_hot_open(size_t count)
+	{
+		const char* path = "hot/a/b/c/d/e/config.json";
+		virtfiles::fs.get_root()->createFile(path, true).writeBytes("{}");
+
+		virtfiles::dentry_cache& cache = virtfiles::fs.get_dentry_cache();
+		cache.reset_counters();
+
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			ifstream in(path);
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("hot open:       %8zu opens  %9.3f ms  %7.2f ns/open  (%zu hits, %zu misses)\n",
+			count, elapsed * 1e3, elapsed * 1e9 / count, cache.get_hits(), cache.get_misses());
+
+		report(case_name("hot_open/%zu", count), count, elapsed,
+			{ { "cache_hits", double(cache.get_hits()) }, { "cache_misses", double(cache.get_misses()) } });
+	}
+
+	// Times path parsing and opening and counts heap allocations they make
+	void bench_open_allocations(size_t count)
+	{
+		const char* path = "alloc/folder/subfolder/file.txt";
+		virtfiles::fs.get_root()->createFile(path, true).writeBytes("content");
+
+		size_t parts = 0;
+		size_t start_count = allocation_count;
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			virtfiles::path_t parsed(path);
+			parts += parsed.parts.get_count();
+		}
+
+		double elapsed = seconds_since(start);
+		double allocations = double(allocation_count - start_count) / count;
+
+		printf("path_t parse:   %8.2f allocs/path  %7.2f ns/path\n", allocations, elapsed * 1e9 / count);
+		report("path_t_parse", count, elapsed, { { "allocs_per_iteration", allocations } });
+
+		start_count = allocation_count;
+		start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			for (std::string_view part : virtfiles::path_view(path))
+			{
+				parts += part.size();
+			}
+		}
+
+		elapsed = seconds_since(start);
+		allocations = double(allocation_count - start_count) / count;
+
+		printf("path_view walk: %8.2f allocs/path  %7.2f ns/path\n", allocations, elapsed * 1e9 / count);
+		report("path_view_walk", count, elapsed, { { "allocs_per_iteration", allocations } });
+
+		start_count = allocation_count;
+		start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			virtfiles::fs.get_root()->lookup(path);
+		}
+
+		elapsed = seconds_since(start);
+		allocations = double(allocation_count - start_count) / count;
+
+		printf("folder lookup:  %8.2f allocs/lookup  %7.2f ns/lookup\n", allocations, elapsed * 1e9 / count);
+		report("folder_lookup", count, elapsed, { { "allocs_per_iteration", allocations } });
+
+		virtfiles::filebuf buf;
+		start_count = allocation_count;
+		start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			buf.open(path, std::ios::in);
+			buf.close();
+		}
+
+		elapsed = seconds_since(start);
+		allocations = double(allocation_count - start_count) / count;
+
+		printf("filebuf open:   %8.2f allocs/open  %7.2f ns/open  (%zu)\n", allocations, elapsed * 1e9 / count, parts);
+		report("filebuf_open", count, elapsed, { { "allocs_per_iteration", allocations } });
+	}
+
+	// Looks up a file under depth nested folders count times,
+	// walking the folders each time without dentry cache
+	void bench_deep_lookup(size_t depth, size_t count)
+	{
+		virtfiles::filesystem tree;
+		std::string path;
+
+		for (size_t i = 0; i < depth; ++i)
+		{
+			path += case_name("level_%zu/", i);
+		}
+
+		path += "leaf.txt";
+		tree.get_root()->createFile(path, true);
+
+		virtfiles::path_t parsed(path);
+		size_t found = 0;
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			found += !tree.get_root()->lookup(parsed).is_folder();
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("deep lookup:    %8zu deep  %7.2f ns/lookup  %7.2f ns/level  (%zu found)\n",
+			depth, elapsed * 1e9 / count, elapsed * 1e9 / count / depth, found);
+
+		report(case_name("deep_lookup/%zu", depth), count, elapsed);
+	}
+
+	// Writes count small files through ofstream of CharT and reads them back
+	template <class CharT>
+	void bench_small_streams(size_t count)
+	{
+		const char* kind = sizeof(CharT) == 1 ? "char" : "wchar_t";
+		const CharT line[] = { 's', 't', 'a', 't', 'e', '=', 'r', 'u', 'n', 'n', 'i', 'n', 'g', '\n', 0 };
+		constexpr size_t line_size = sizeof(line) / sizeof(CharT) - 1;
+
+		std::vector<std::string> names;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			names.push_back(case_name("small_streams/%s/%zu.txt", kind, i));
+		}
+
+		virtfiles::fs.get_root()->createFolder(case_name("small_streams/%s", kind), true);
+
+		auto start = bench_clock::now();
+
+		for (const std::string& name : names)
+		{
+			basic_ofstream<CharT> out(name.c_str());
+			out.write(line, line_size);
+		}
+
+		double write_elapsed = seconds_since(start);
+		CharT block[64];
+		size_t total = 0;
+
+		start = bench_clock::now();
+
+		for (const std::string& name : names)
+		{
+			basic_ifstream<CharT> in(name.c_str());
+			in.read(block, sizeof(block) / sizeof(CharT));
+			total += static_cast<size_t>(in.gcount());
+		}
+
+		double read_elapsed = seconds_since(start);
+
+		printf("small streams:  %-8s %8zu files  %7.2f ns/write  %7.2f ns/read  (%zu read)\n",
+			kind, count, write_elapsed * 1e9 / count, read_elapsed * 1e9 / count, total);
+
+		report(case_name("small_streams/%s/write", kind), count, write_elapsed);
+		report(case_name("small_streams/%s/read", kind), count, read_elapsed);
+	}
+
+	// Appends count log records through ofstream opened for appending,
+	// flushing each record and reopening log every reopen records
+	void bench_log_appends(size_t count, size_t reopen)
+	{
+		static const char record[] = "2024-01-01 00:00:00 INFO request served\n";
+		constexpr size_t record_size = sizeof(record) - 1;
+		const char* path = "bench_log.txt";
+
+		virtfiles::fs.get_root()->createFile(path);
+
+		auto start = bench_clock::now();
+
+		for (size_t done = 0; done < count;)
+		{
+			ofstream out(path, std::ios::app);
+
+			for (size_t i = 0; i < reopen && done < count; ++i, ++done)
+			{
+				out.write(record, record_size);
+				out.flush();
+			}
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("log appends:    %8zu records  %9.3f ms  %7.2f ns/record  (reopen every %zu)\n",
+			count, elapsed * 1e3, elapsed * 1e9 / count, reopen);
+
+		report(case_name("log_appends/%zu", reopen), count, elapsed,
+			{ { "bytes_per_second", count * record_size / elapsed } });
+
+		virtfiles::fs.remove(path);
+	}
+
+	// Reads or overwrites count records of record_size bytes at random
+	// offsets of a file of size bytes through fstream, a write per 4 reads
+	void bench_random_access(size_t size, size_t record_size, size_t count)
+	{
+		const char* path = "bench_random.bin";
+
+		{
+			std::string content(size, 'x');
+			ofstream out(path);
+			out.write(content.data(), content.size());
+		}
+
+		std::mt19937_64 random(20240101); // fixed seed, the same offsets each run
+		std::vector<size_t> offsets(count);
+
+		for (size_t& offset : offsets)
+		{
+			offset = random() % (size - record_size);
+		}
+
+		std::vector<char> record(record_size, 'r');
+		size_t total = 0;
+
+		fstream io(path, std::ios::in | std::ios::out);
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (i % 5 == 4)
+			{
+				io.seekp(offsets[i]);
+				io.write(record.data(), record_size);
+			}
+			else
+			{
+				io.seekg(offsets[i]);
+				io.read(record.data(), record_size);
+				total += static_cast<size_t>(io.gcount());
+			}
+		}
+
+		io.close();
+
+		double elapsed = seconds_since(start);
+
+		printf("random access:  %6zu MB  %8zu x %zu B  %9.3f ms  %7.2f ns/access  (%zu read)\n",
+			size >> 20, count, record_size, elapsed * 1e3, elapsed * 1e9 / count, total);
+
+		report(case_name("random_access/%zuMB/%zu", size >> 20, record_size), count, elapsed);
+
+		virtfiles::fs.remove(path);
+	}
+
+	// Streams size bytes to a new file through ofstream
+	void bench_ofstream_write(size_t size)
+	{
+		static char chunk[4096];
+		memset(chunk, 'x', sizeof(chunk));
+
+		auto start = bench_clock::now();
+
+		{
+			ofstream out("bench_write.bin");
+
+			for (size_t left = size; left > 0;)
+			{
+				size_t part = left < sizeof(chunk) ? left : sizeof(chunk);
+				out.write(chunk, part);
+				left -= part;
+			}
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("ofstream write: %6zu MB  %9.3f ms  %8.2f MB/s\n",
+			size >> 20, elapsed * 1e3, (size >> 20) / elapsed);
+
+		report(case_name("ofstream_write/%zuMB", size >> 20), 1, elapsed,
+			{ { "bytes_per_second", size / elapsed } });
+	}
+
+	// Patches few bytes of a big file through fstream, flushing after each patch
+	void bench_patch_flush(size_t size, size_t count)
+	{
+		{
+			std::string content(size, 'x');
+			ofstream out("bench_patch.bin");
+			out.write(content.data(), content.size());
+		}
+
+		fstream io("bench_patch.bin", std::ios::in | std::ios::out);
+		size_t offset = 0;
+
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			offset = (offset + 7919 * 4096 + 13) % (size - 8);
+
+			io.seekp(offset);
+			io.write("patched!", 8);
+			io.flush();
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("patch flush:    %6zu MB  %8zu patches  %9.3f ms  %8.2f us/patch\n",
+			size >> 20, count, elapsed * 1e3, elapsed * 1e6 / count);
+
+		report(case_name("patch_flush/%zuMB", size >> 20), count, elapsed);
+	}
+
+	// Opens a big file count times to read its first bytes
+	void bench_peek_magic(size_t size, size_t count)
+	{
+		{
+			static char chunk[1 << 16];
+			ofstream out("bench_magic.bin");
+
+			for (size_t left = size; left > 0; left -= sizeof(chunk))
+			{
+				out.write(chunk, sizeof(chunk));
+				out.flush(); // appended in parts, so content has several extents
+			}
+		}
+
+		char magic[4];
+		auto start = bench_clock::now();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			ifstream in("bench_magic.bin", std::ios::binary);
+			in.read(magic, sizeof(magic));
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("peek magic:     %6zu MB  %8zu opens  %9.3f ms  %8.2f us/open\n",
+			size >> 20, count, elapsed * 1e3, elapsed * 1e6 / count);
+
+		report(case_name("peek_magic/%zuMB", size >> 20), count, elapsed);
+	}
+
+	// Streams size wide chars to a new file through wofstream imbued with loc.
+	// Text is ASCII with one non-ASCII char per line, if loc can convert it
+	void bench_wofstream_write(size_t size, const std::locale& loc)
+	{
+		static wchar_t chunk[4096];
+		constexpr size_t chunk_count = sizeof(chunk) / sizeof(wchar_t);
+
+		bool unicode = loc.name() != "C";
+
+		for (size_t i = 0; i < chunk_count; ++i)
+		{
+			chunk[i] = i % 64 == 63 ? L'\n' : unicode && i % 64 == 10 ? L'\u00e9' : L'x';
+		}
+
+		auto start = bench_clock::now();
+
+		{
+			virtfiles::wofstream out;
+			out.imbue(loc);
+			out.open("bench_wwrite.txt");
+
+			for (size_t left = size; left > 0;)
+			{
+				size_t part = left < chunk_count ? left : chunk_count;
+				out.write(chunk, part);
+				left -= part;
+			}
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("wofstream write: %-8s %5zu M chars  %9.3f ms  %8.2f M chars/s\n",
+			loc.name().c_str(), size >> 20, elapsed * 1e3, (size >> 20) / elapsed);
+
+		report(case_name("wofstream_write/%s/%zuM", loc.name().c_str(), size >> 20), 1, elapsed,
+			{ { "items_per_second", size / elapsed } });
+	}
+
+	// Reads file written by bench_wofstream_write
+	void bench_wifstream_read(size_t size, const std::locale& loc)
+	{
+		static wchar_t block[1 << 16];
+		bench_wofstream_write(size, loc);
+
+		auto start = bench_clock::now();
+		size_t total = 0;
+
+		{
+			virtfiles::wifstream in;
+			in.imbue(loc);
+			in.open("bench_wwrite.txt");
+
+			while (in.read(block, sizeof(block) / sizeof(wchar_t)) || in.gcount() > 0)
+			{
+				total += static_cast<size_t>(in.gcount());
+			}
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("wifstream read:  %-8s %5zu M chars  %9.3f ms  %8.2f M chars/s\n",
+			loc.name().c_str(), total >> 20, elapsed * 1e3, (total >> 20) / elapsed);
+
+		report(case_name("wifstream_read/%s/%zuM", loc.name().c_str(), size >> 20), 1, elapsed,
+			{ { "items_per_second", total / elapsed } });
+	}
+
+	// Reads file written by bench_ofstream_write in 1 MB blocks
+	void bench_ifstream_read(size_t size)
+	{
+		static char block[1 << 20];
+
+		{
+			ofstream out("bench_read.bin");
+
+			for (size_t left = size; left > 0; left -= sizeof(block))
+			{
+				out.write(block, sizeof(block));
+			}
+		}
+
+		auto start = bench_clock::now();
+		size_t total = 0;
+
+		{
+			ifstream in("bench_read.bin");
+
+			while (in.read(block, sizeof(block)) || in.gcount() > 0)
+			{
+				total += static_cast<size_t>(in.gcount());
+			}
+		}
+
+		double elapsed = seconds_since(start);
+
+		printf("ifstream read:  %6zu MB  %9.3f ms  %8.2f MB/s\n",
+			total >> 20, elapsed * 1e3, (total >> 20) / elapsed);
+
+		report(case_name("ifstream_read/%zuMB", size >> 20), 1, elapsed,
+			{ { "bytes_per_second", total / elapsed } });
+	}
+
+	// Classic locale and UTF-8 one, if it is installed
+	std::vector<std::locale> wide_locales()
+	{
+		std::vector<std::locale> locales{ std::locale::classic() };
+
+		for (const char* name : { "en_US.utf8", "C.UTF-8" })
+		{
+			try
+			{
+				locales.emplace_back(name);
+				break;
+			}
+			catch (const std::runtime_error&)
+			{
+			}
+		}
+
+		return locales;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const char* filter = "";
+	const char* json_path = nullptr;
+	bool list = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+		{
+			filter = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+		{
+			json_path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--list"))
+		{
+			list = true;
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [--filter text] [--json file] [--list]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	// Groups of cases, in order they run
+	const std::pair<const char*, void (*)()> groups[] = {
+		{ "appends", []
+			{
+				for (size_t count = 125000; count <= 1000000; count *= 2)
+				{
+					bench_appends(count);
+				}
+			} },
+		{ "wide_folder", []
+			{
+				for (size_t count = 12500; count <= 100000; count *= 2)
+				{
+					bench_wide_folder(count);
+				}
+			} },
+		{ "name_lookup", [] { bench_folder_lookup(100000); } },
+		{ "tree", []
+			{
+				for (bool arena : { false, true })
+				{
+					bench_tree(1000, 1000, arena);
+				}
+			} },
+		{ "small_files", [] { bench_small_files(1000000); } },
+		{ "publish", []
+			{
+				for (size_t size = 1 << 10; size <= (1 << 20); size <<= 5)
+				{
+					bench_rename(10000, size);
+				}
+			} },
+		{ "hot_open", [] { bench_hot_open(100000); } },
+		{ "paths", [] { bench_open_allocations(100000); } },
+		{ "deep_lookup", []
+			{
+				for (size_t depth = 4; depth <= 64; depth *= 4)
+				{
+					bench_deep_lookup(depth, 100000);
+				}
+			} },
+		{ "small_streams", []
+			{
+				bench_small_streams<char>(100000);
+				bench_small_streams<wchar_t>(100000);
+			} },
+		{ "ofstream_write", []
+			{
+				for (size_t size = 1 << 20; size <= (size_t{ 1 } << 27); size <<= 2)
+				{
+					bench_ofstream_write(size);
+				}
+			} },
+		{ "ifstream_read", []
+			{
+				for (size_t size = 1 << 20; size <= (size_t{ 1 } << 27); size <<= 2)
+				{
+					bench_ifstream_read(size);
+				}
+			} },
+		{ "wide_streams", []
+			{
+				for (const std::locale& loc : wide_locales())
+				{
+					for (size_t size = 1 << 20; size <= (size_t{ 1 } << 25); size <<= 2)
+					{
+						bench_wifstream_read(size, loc);
+					}
+				}
+			} },
+		{ "log_appends", []
+			{
+				for (size_t reopen : { 1, 100, 10000 })
+				{
+					bench_log_appends(20000, reopen);
+				}
+			} },
+		{ "random_access", []
+			{
+				for (size_t size = 1 << 20; size <= (size_t{ 1 } << 26); size <<= 3)
+				{
+					bench_random_access(size, 64, 100000);
+				}
+			} },
+		{ "patch_flush", []
+			{
+				for (size_t size = 1 << 20; size <= (size_t{ 1 } << 26); size <<= 2)
+				{
+					bench_patch_flush(size, 1000);
+				}
+			} },
+		{ "peek_magic", []
+			{
+				for (size_t size = 1 << 20; size <= (size_t{ 1 } << 26); size <<= 2)
+				{
+					bench_peek_magic(size, 1000);
+				}
+			} },
+		{ "image", [] { bench_image(size_t{ 1 } << 30, 1 << 16); } },
+		{ "tar", [] { bench_tar(100000, 1000); } },
+#ifdef VIRTFILES_HOST_OVERLAY
+		{ "host", [] { bench_host(10000, 4096); } },
+#endif
+#ifdef VIRTFILES_JOURNAL
+		{ "journal", [] { bench_journal(1000000, 2000); } },
+#endif
+	};
+
+	for (const auto& group : groups)
+	{
+		if (!strstr(group.first, filter))
+		{
+			continue;
+		}
+
+		if (list)
+		{
+			printf("%s\n", group.first);
+		}
+		else
+		{
+			group.second();
+		}
+	}
+
+	if (json_path && !list && !write_json(json_path, argv[0]))
+	{
+		fprintf(stderr, "can't write %s\n", json_path);
+		return 1;
+	}
+}
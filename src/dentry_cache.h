@@ -0,0 +1,427 @@
+#pragma once
+
+#include "virt_sync.h"
+#include <atomic>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace virtfiles
+{
+	class base_entry;
+
+	// Bounded cache of resolved paths, evicted by CLOCK: a hit only sets
+	// reference bit of path under shared lock, so lookups of several threads
+	// don't wait for each other, and eviction passes over referenced paths
+	// once, clearing their bits. Paths are compared by their parts, so "a//b",
+	// "./a/b" and "a\\b" are the same key. Like the walk of folders, "a/" and
+	// "a/." require a to be a folder, so they are not the same key as "a".
+	// Only found entries are cached, so creation of entries never makes
+	// it stale. Cached entries are retained. Removal or move of any entry
+	// can make paths stale, even those going through it by "..", so all
+	// paths are dropped by the next lookup after folders relinked entries
+	class dentry_cache
+	{
+	public:
+		static constexpr size_t default_capacity = 4096;
+
+	protected:
+		struct node
+		{
+			std::string path;
+			size_t hash;
+			base_entry* entry;
+			mutable std::atomic<bool> referenced; // used since hand passed it
+
+			node(std::string_view path, size_t hash, base_entry* entry)
+				: path(path), hash(hash), entry(entry), referenced(false)
+			{
+			}
+		};
+
+		using node_list = std::list<node>;
+
+		node_list ring;			  // paths in order hand visits them
+		node_list::iterator hand; // next path to check for eviction
+		std::unordered_multimap<size_t, node_list::iterator> nodes; // path hash -> node
+
+		size_t capacity;
+		std::atomic<size_t> hits;
+		std::atomic<size_t> misses;
+		std::atomic<size_t> generation; // incremented by invalidation
+		std::atomic<size_t> relinks;	// relink count of tree when cache was last invalidated
+
+		mutable shared_mutex_t mutex; // shared by lookups, exclusive for changes
+
+	public:
+		explicit dentry_cache(size_t capacity = default_capacity)
+			: hand(ring.end()), capacity(capacity), hits(0), misses(0), generation(0), relinks(_relink_count())
+		{
+		}
+
+		~dentry_cache()
+		{
+			invalidate();
+		}
+
+		dentry_cache(const dentry_cache&) = delete;
+		dentry_cache& operator=(const dentry_cache&) = delete;
+
+		size_t get_capacity() const
+		{
+			read_lock lock(mutex);
+
+			return capacity;
+		}
+
+		void set_capacity(size_t new_capacity)
+		{
+			write_lock lock(mutex);
+
+			capacity = new_capacity;
+			_shrink();
+		}
+
+		size_t size() const
+		{
+			read_lock lock(mutex);
+
+			return ring.size();
+		}
+
+		size_t get_hits() const
+		{
+			return hits.load(std::memory_order_relaxed);
+		}
+
+		size_t get_misses() const
+		{
+			return misses.load(std::memory_order_relaxed);
+		}
+
+		void reset_counters()
+		{
+			hits.store(0, std::memory_order_relaxed);
+			misses.store(0, std::memory_order_relaxed);
+		}
+
+		size_t get_generation() const
+		{
+			return generation.load(std::memory_order_acquire);
+		}
+
+		// Returns cached entry retained for caller, or nullptr
+		base_entry* find(std::string_view path)
+		{
+			size_t hash = hash_path(path);
+			bool removed = false;
+
+			_drop_if_relinked();
+
+			{
+				read_lock lock(mutex);
+
+				if (const node* found = _find_locked(hash, path))
+				{
+					if (!_is_removed(found->entry))
+					{
+						found->referenced.store(true, std::memory_order_relaxed);
+						hits.fetch_add(1, std::memory_order_relaxed);
+
+						_retain(found->entry);
+						return found->entry;
+					}
+
+					removed = true;
+				}
+			}
+
+			if (removed)
+			{
+				// Drop path of removed entry, unless it was replaced meanwhile
+				write_lock lock(mutex);
+				auto range = nodes.equal_range(hash);
+
+				for (auto i = range.first; i != range.second; ++i)
+				{
+					if (same_path(i->second->path, path))
+					{
+						if (_is_removed(i->second->entry))
+						{
+							_erase(i);
+						}
+
+						break;
+					}
+				}
+			}
+
+			misses.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		// Cache entry found at path, unless cache was invalidated
+		// since since_generation, when lookup could find moved entry
+		void insert(std::string_view path, base_entry* entry, size_t since_generation)
+		{
+			size_t hash = hash_path(path);
+			write_lock lock(mutex);
+
+			if (capacity == 0 || generation.load(std::memory_order_relaxed) != since_generation)
+			{
+				return;
+			}
+
+			auto range = nodes.equal_range(hash);
+
+			for (auto i = range.first; i != range.second; ++i)
+			{
+				if (same_path(i->second->path, path))
+				{
+					_retain(entry);
+					_release(i->second->entry);
+					i->second->entry = entry;
+					i->second->referenced.store(true, std::memory_order_relaxed);
+
+					return;
+				}
+			}
+
+			// New path is checked last, after a whole round of the hand
+			node_list::iterator added = ring.emplace(hand, path, hash, entry);
+
+			try
+			{
+				nodes.emplace(hash, added);
+			}
+			catch (...)
+			{
+				ring.erase(added);
+				throw;
+			}
+
+			_retain(entry);
+			_shrink();
+		}
+
+		// Forget all cached paths
+		void invalidate()
+		{
+			write_lock lock(mutex);
+
+			for (node& cached : ring)
+			{
+				_release(cached.entry);
+			}
+
+			nodes.clear();
+			ring.clear();
+			hand = ring.end();
+			generation.fetch_add(1, std::memory_order_release);
+		}
+
+		// Forget cached paths whose entries match pred
+		template <class Pred>
+		void invalidate_if(Pred pred)
+		{
+			write_lock lock(mutex);
+
+			for (auto i = nodes.begin(); i != nodes.end();)
+			{
+				if (pred(i->second->entry))
+				{
+					i = _erase(i);
+				}
+				else
+				{
+					++i;
+				}
+			}
+
+			generation.fetch_add(1, std::memory_order_release);
+		}
+
+		static size_t hash_path(std::string_view path)
+		{
+			size_t hash = 14695981039346656037ull; // FNV-1a
+			bool folder = must_be_folder(path);
+
+			for (std::string_view part; next_part(path, part);)
+			{
+				for (char ch : part)
+				{
+					hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+				}
+
+				hash = (hash ^ '/') * 1099511628211ull;
+			}
+
+			return folder ? (hash ^ '.') * 1099511628211ull : hash;
+		}
+
+		static bool same_path(std::string_view left, std::string_view right)
+		{
+			if (must_be_folder(left) != must_be_folder(right))
+			{
+				return false;
+			}
+
+			std::string_view lpart, rpart;
+
+			while (true)
+			{
+				bool lnext = next_part(left, lpart);
+				bool rnext = next_part(right, rpart);
+
+				if (lnext != rnext)
+				{
+					return false;
+				}
+
+				if (!lnext)
+				{
+					return true;
+				}
+
+				if (lpart != rpart)
+				{
+					return false;
+				}
+			}
+		}
+
+		// If path names entry and ends with separator or ".", as "a/" or "a/.",
+		// which folder_t::lookup only resolves when the entry is a folder
+		static bool must_be_folder(std::string_view path)
+		{
+			bool trailing = false;
+
+			while (!path.empty())
+			{
+				size_t sep = path.find_last_of("/\\");
+				std::string_view part = sep == std::string_view::npos ? path : path.substr(sep + 1);
+
+				if (!part.empty() && part != ".")
+				{
+					return trailing;
+				}
+
+				if (sep == std::string_view::npos)
+				{
+					break;
+				}
+
+				trailing = true;
+				path = path.substr(0, sep);
+			}
+
+			return false;
+		}
+
+	private:
+		// Defined in file_entries.h, where entries are complete
+		static void _retain(base_entry* entry);
+		static void _release(base_entry* entry);
+		static bool _is_removed(const base_entry* entry);
+		static size_t _relink_count();
+
+		// Any cached path may be stale once entries were removed or moved
+		void _drop_if_relinked()
+		{
+			size_t current = _relink_count();
+
+			if (relinks.load(std::memory_order_acquire) != current)
+			{
+				invalidate();
+				relinks.store(current, std::memory_order_release);
+			}
+		}
+
+		// Cut next significant part (not empty and not ".") from path
+		static bool next_part(std::string_view& path, std::string_view& part)
+		{
+			while (!path.empty())
+			{
+				size_t end = path.find_first_of("/\\");
+
+				if (end == std::string_view::npos)
+				{
+					end = path.size();
+				}
+
+				part = path.substr(0, end);
+				path.remove_prefix(end == path.size() ? end : end + 1);
+
+				if (!part.empty() && part != ".")
+				{
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		const node* _find_locked(size_t hash, std::string_view path) const
+		{
+			auto range = nodes.equal_range(hash);
+
+			for (auto i = range.first; i != range.second; ++i)
+			{
+				if (same_path(i->second->path, path))
+				{
+					return &*i->second;
+				}
+			}
+
+			return nullptr;
+		}
+
+		// Forget path of index item, keeping hand at the next path
+		std::unordered_multimap<size_t, node_list::iterator>::iterator _erase(
+			std::unordered_multimap<size_t, node_list::iterator>::iterator item)
+		{
+			node_list::iterator erased = item->second;
+
+			if (hand == erased)
+			{
+				++hand;
+			}
+
+			_release(erased->entry);
+			ring.erase(erased);
+
+			return nodes.erase(item);
+		}
+
+		// Evict paths until capacity is met. Hand clears reference bits of
+		// paths used since it passed them and evicts the first one not used
+		void _shrink()
+		{
+			while (ring.size() > capacity)
+			{
+				if (hand == ring.end())
+				{
+					hand = ring.begin();
+				}
+
+				if (hand->referenced.exchange(false, std::memory_order_relaxed))
+				{
+					++hand;
+					continue;
+				}
+
+				auto range = nodes.equal_range(hand->hash);
+
+				for (auto i = range.first; i != range.second; ++i)
+				{
+					if (i->second == hand)
+					{
+						_erase(i);
+						break;
+					}
+				}
+			}
+		}
+	};
+};
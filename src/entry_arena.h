@@ -0,0 +1,166 @@
+#pragma once
+
+#include "virt_sync.h"
+#include <cstddef>
+#include <memory_resource>
+
+namespace virtfiles
+{
+	// Slab allocator for entries, their names and folder indexes.
+	// Small blocks are cut from big chunks and freed ones are kept in
+	// free lists of their size for reuse, so building a tree doesn't call
+	// heap for every entry and its nodes stay close to each other.
+	// Chunks are returned to upstream resource only when arena is released.
+	// Bigger blocks are allocated from upstream directly
+	class entry_arena : public std::pmr::memory_resource
+	{
+	public:
+		static constexpr size_t chunk_size = 64 * 1024;
+
+		// Sizes of small blocks are rounded up to it
+		static constexpr size_t granularity = alignof(std::max_align_t);
+
+		static constexpr size_t max_small_size = 512;
+
+	protected:
+		struct free_block
+		{
+			free_block* next;
+		};
+
+		// Placed at start of each chunk
+		struct alignas(granularity) chunk_header
+		{
+			chunk_header* next;
+		};
+
+		free_block* free_lists[max_small_size / granularity];
+		chunk_header* chunks;
+		char* cursor; // free space of last chunk
+		char* cursor_end;
+		size_t chunk_count;
+
+		std::pmr::memory_resource* upstream;
+
+		mutable mutex_t mutex; // guards all above
+
+	public:
+		explicit entry_arena(std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+			: free_lists{}, chunks(nullptr), cursor(nullptr), cursor_end(nullptr),
+			chunk_count(0), upstream(upstream)
+		{
+		}
+
+		entry_arena(const entry_arena&) = delete;
+		entry_arena& operator=(const entry_arena&) = delete;
+
+		~entry_arena()
+		{
+			release();
+		}
+
+		std::pmr::memory_resource* get_upstream() const
+		{
+			return upstream;
+		}
+
+		size_t get_chunk_count() const
+		{
+			exclusive_lock lock(mutex);
+
+			return chunk_count;
+		}
+
+		// Free all chunks at once, small blocks allocated from arena become invalid.
+		// Big blocks have to be deallocated by their owners
+		void release()
+		{
+			exclusive_lock lock(mutex);
+
+			while (chunks)
+			{
+				chunk_header* next = chunks->next;
+				upstream->deallocate(chunks, chunk_size, granularity);
+				chunks = next;
+			}
+
+			for (free_block*& list : free_lists)
+			{
+				list = nullptr;
+			}
+
+			cursor = nullptr;
+			cursor_end = nullptr;
+			chunk_count = 0;
+		}
+
+	protected:
+		void* do_allocate(size_t size, size_t alignment) override
+		{
+			if (size > max_small_size || alignment > granularity)
+			{
+				return upstream->allocate(size, alignment);
+			}
+
+			size_t index = _size_class(size);
+			exclusive_lock lock(mutex);
+
+			if (free_block* block = free_lists[index])
+			{
+				free_lists[index] = block->next;
+				return block;
+			}
+
+			size_t block_size = (index + 1) * granularity;
+
+			if (static_cast<size_t>(cursor_end - cursor) < block_size)
+			{
+				_add_chunk();
+			}
+
+			void* block = cursor;
+			cursor += block_size;
+
+			return block;
+		}
+
+		void do_deallocate(void* p, size_t size, size_t alignment) override
+		{
+			if (size > max_small_size || alignment > granularity)
+			{
+				upstream->deallocate(p, size, alignment);
+				return;
+			}
+
+			size_t index = _size_class(size);
+			exclusive_lock lock(mutex);
+
+			free_block* block = static_cast<free_block*>(p);
+			block->next = free_lists[index];
+			free_lists[index] = block;
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+		{
+			return this == &other;
+		}
+
+	private:
+		static size_t _size_class(size_t size)
+		{
+			return size == 0 ? 0 : (size - 1) / granularity;
+		}
+
+		// Start new chunk, rest of the last one is left unused. Must be called under lock
+		void _add_chunk()
+		{
+			chunk_header* chunk = static_cast<chunk_header*>(upstream->allocate(chunk_size, granularity));
+			chunk->next = chunks;
+			chunks = chunk;
+
+			cursor = reinterpret_cast<char*>(chunk + 1);
+			cursor_end = reinterpret_cast<char*>(chunk) + chunk_size;
+			++chunk_count;
+		}
+	};
+};
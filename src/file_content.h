@@ -0,0 +1,642 @@
+#pragma once
+
+#include "virt_stats.h"
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace virtfiles
+{
+	// Content of a file at some version.
+	// Content is stored in extents, each next extent is at least as
+	// big as whole content before it, so there are only few of them.
+	// Copies of file_content share extents with the original, bytes
+	// which belong to some copy are never modified, so any copy can be
+	// read while other one is appended to (by single writer at a time).
+	// Overwriting bytes of shared extents replaces them with slices of
+	// the old buffers around a new one, instead of copying whole content.
+	// Small content is kept inline, without extents, until it grows
+	class file_content
+	{
+	public:
+		// Max size of content kept inline
+		static constexpr size_t inline_capacity = 64;
+
+		// Smallest capacity of newly allocated extent
+		static constexpr size_t min_extent_capacity = 64;
+
+		// Content overwritten in many places is flattened when it has more extents
+		static constexpr size_t max_extent_count = 64;
+
+		// Memory block of extent. Bytes below used are never modified,
+		// only content which ends exactly at used can write past it
+		struct extent_buffer
+		{
+			char* data;
+			size_t capacity;
+			size_t used;
+			std::shared_ptr<const void> owner; // set if data is not allocated by buffer
+
+			explicit extent_buffer(size_t capacity)
+				: data(new char[capacity]), capacity(capacity), used(0)
+			{
+				stats::add(counter::allocated_bytes, capacity);
+			}
+
+			// Buffer over writable memory kept alive by owner, e.g. private
+			// file mapping. It is full, so nothing is appended into it
+			extent_buffer(char* data, size_t size, std::shared_ptr<const void> owner)
+				: data(data), capacity(size), used(size), owner(std::move(owner))
+			{
+			}
+
+			extent_buffer(const extent_buffer&) = delete;
+			extent_buffer& operator=(const extent_buffer&) = delete;
+
+			~extent_buffer()
+			{
+				if (!owner)
+				{
+					delete[] data;
+				}
+			}
+		};
+
+	protected:
+		struct extent
+		{
+			std::shared_ptr<extent_buffer> buffer;
+			size_t offset; // start of extent in buffer
+			size_t size;   // set when next extent is added
+		};
+
+		// Extents shared between copies, only appended to.
+		// It is never reallocated, new table is created when it is full
+		struct extent_table
+		{
+			std::unique_ptr<extent[]> extents;
+			size_t capacity;
+			size_t count;
+
+			explicit extent_table(size_t capacity)
+				: extents(new extent[capacity]), capacity(capacity), count(0)
+			{
+			}
+		};
+
+		std::shared_ptr<extent_table> table; // null while content is inline
+		size_t extent_count; // count of table extents which belong to this content
+		size_t last_size;	 // size of last extent
+		size_t total_size;
+		size_t version;
+
+		char inline_bytes[inline_capacity];
+
+	public:
+		file_content()
+			: extent_count(0), last_size(0), total_size(0), version(0)
+		{
+		}
+
+		size_t size() const
+		{
+			return total_size;
+		}
+
+		bool empty() const
+		{
+			return total_size == 0;
+		}
+
+		// Incremented on every modification of file
+		size_t get_version() const
+		{
+			return version;
+		}
+
+		void set_version(size_t new_version)
+		{
+			version = new_version;
+		}
+
+		// Content is kept inline, not in extents
+		bool is_inline() const
+		{
+			return !table;
+		}
+
+		// Inline content has single extent, unless it's empty
+		size_t get_extent_count() const
+		{
+			return table ? extent_count : total_size != 0;
+		}
+
+		std::string_view get_extent(size_t index) const
+		{
+			if (!table)
+			{
+				return std::string_view(inline_bytes, total_size);
+			}
+
+			const extent& ext = table->extents[index];
+
+			return std::string_view(ext.buffer->data + ext.offset,
+				index + 1 == extent_count ? last_size : ext.size);
+		}
+
+		bool is_contiguous() const
+		{
+			return get_extent_count() <= 1;
+		}
+
+		// View of whole content, available only when it is contiguous
+		std::string_view view() const
+		{
+			if (!is_contiguous())
+			{
+				throw std::logic_error("file content is not contiguous");
+			}
+
+			return get_extent_count() == 0 ? std::string_view() : get_extent(0);
+		}
+
+		// Same content collapsed into single extent, or inline if it fits
+		file_content flattened() const
+		{
+			file_content flat;
+			flat.version = version;
+
+			if (total_size <= inline_capacity)
+			{
+				copy_to(flat.inline_bytes, 0, total_size);
+				flat.total_size = total_size;
+			}
+			else
+			{
+				extent_buffer& buffer = flat._push_extent(total_size);
+				copy_to(buffer.data, 0, total_size);
+
+				buffer.used = total_size;
+				flat.last_size = total_size;
+				flat.total_size = total_size;
+			}
+
+			return flat;
+		}
+
+		void clear()
+		{
+			table.reset();
+			extent_count = 0;
+			last_size = 0;
+			total_size = 0;
+		}
+
+		void assign(const char* bytes, size_t count)
+		{
+			clear();
+			append(bytes, count);
+		}
+
+		// Replace content with count bytes kept alive by owner without copying them.
+		// They may be modified in place, when this content is their only user.
+		// Small content is copied inline
+		void assign_external(char* bytes, size_t count, std::shared_ptr<const void> owner)
+		{
+			clear();
+
+			if (count <= inline_capacity)
+			{
+				append(bytes, count);
+				return;
+			}
+
+			table = std::make_shared<extent_table>(4);
+			_add_extent(*table, std::make_shared<extent_buffer>(bytes, count, std::move(owner)), 0, count);
+
+			extent_count = 1;
+			last_size = count;
+			total_size = count;
+		}
+
+		void append(const char* bytes, size_t count)
+		{
+			if (count == 0)
+			{
+				return;
+			}
+
+			if (!table)
+			{
+				if (count <= inline_capacity - total_size)
+				{
+					memcpy(inline_bytes + total_size, bytes, count);
+					total_size += count;
+					return;
+				}
+
+				_move_to_extent(count);
+			}
+
+			// Fill free space of the last extent first,
+			// if no other content has written there yet
+			if (extent_count != 0)
+			{
+				const extent& last_ext = table->extents[extent_count - 1];
+				extent_buffer& last = *last_ext.buffer;
+
+				if (last.used == last_ext.offset + last_size)
+				{
+					size_t fit = last.capacity - last.used;
+
+					if (fit > count)
+					{
+						fit = count;
+					}
+
+					memcpy(last.data + last.used, bytes, fit);
+					last.used += fit;
+					last_size += fit;
+					total_size += fit;
+
+					bytes += fit;
+					count -= fit;
+
+					if (count == 0)
+					{
+						return;
+					}
+				}
+			}
+
+			// Grow geometrically: new extent is at least as big as whole content,
+			// so number of extents stays logarithmic and appends are amortized O(count)
+			size_t capacity = total_size > count ? total_size : count;
+			extent_buffer& buffer = _push_extent(capacity);
+
+			memcpy(buffer.data, bytes, count);
+			buffer.used = count;
+			last_size = count;
+			total_size += count;
+		}
+
+		// Writable space of at least min_count bytes at the end of content,
+		// available is set to its whole size. New extent is made for it
+		// if there is not enough, at least expected bytes big. Written
+		// bytes become part of content when commit_append is called
+		char* append_space(size_t min_count, size_t expected, size_t& available)
+		{
+			if (!table)
+			{
+				if (min_count <= inline_capacity - total_size)
+				{
+					available = inline_capacity - total_size;
+					return inline_bytes + total_size;
+				}
+
+				_move_to_extent(expected > min_count ? expected : min_count);
+			}
+
+			if (extent_count != 0)
+			{
+				const extent& last_ext = table->extents[extent_count - 1];
+				extent_buffer& last = *last_ext.buffer;
+
+				if (last.used == last_ext.offset + last_size && last.capacity - last.used >= min_count)
+				{
+					available = last.capacity - last.used;
+					return last.data + last.used;
+				}
+			}
+
+			size_t capacity = total_size > expected ? total_size : expected;
+			extent_buffer& buffer = _push_extent(capacity > min_count ? capacity : min_count);
+
+			available = buffer.capacity;
+			return buffer.data;
+		}
+
+		// Add count bytes written to space returned by append_space
+		void commit_append(size_t count)
+		{
+			if (!table)
+			{
+				total_size += count;
+				return;
+			}
+
+			extent_buffer& last = *table->extents[extent_count - 1].buffer;
+
+			last.used += count;
+			last_size += count;
+			total_size += count;
+		}
+
+		// Overwrite count bytes at offset. Content is extended if they go
+		// past its end, gap between the end and offset is filled with zeros
+		void write(size_t offset, const char* bytes, size_t count)
+		{
+			if (offset > total_size)
+			{
+				_append_zeros(offset - total_size);
+			}
+
+			size_t overlap = total_size - offset;
+
+			if (overlap > count)
+			{
+				overlap = count;
+			}
+
+			if (overlap != 0 && !_overwrite_in_place(offset, bytes, overlap))
+			{
+				_overwrite_shared(offset, bytes, overlap);
+			}
+
+			append(bytes + overlap, count - overlap);
+		}
+
+		// Copy count bytes starting at offset to out, returns copied count
+		size_t copy_to(char* out, size_t offset, size_t count) const
+		{
+			size_t copied = 0;
+			size_t count_of_extents = get_extent_count();
+
+			for (size_t i = 0; i < count_of_extents && count != 0; ++i)
+			{
+				std::string_view ext = get_extent(i);
+
+				if (offset >= ext.size())
+				{
+					offset -= ext.size();
+					continue;
+				}
+
+				size_t part = ext.size() - offset;
+
+				if (part > count)
+				{
+					part = count;
+				}
+
+				memcpy(out + copied, ext.data() + offset, part);
+				copied += part;
+				count -= part;
+				offset = 0;
+			}
+
+			return copied;
+		}
+
+		std::string str() const
+		{
+			std::string out(total_size, '\0');
+			copy_to(&out[0], 0, total_size);
+
+			return out;
+		}
+
+	private:
+		void _append_zeros(size_t count)
+		{
+			static const char zeros[256]{};
+
+			while (count != 0)
+			{
+				size_t part = count < sizeof(zeros) ? count : sizeof(zeros);
+
+				append(zeros, part);
+				count -= part;
+			}
+		}
+
+		// Nobody else refers to touched extents, so bytes can be modified.
+		// Inline bytes belong only to this content
+		bool _overwrite_in_place(size_t offset, const char* bytes, size_t count)
+		{
+			if (!table)
+			{
+				memcpy(inline_bytes + offset, bytes, count);
+				return true;
+			}
+
+			if (table.use_count() != 1)
+			{
+				return false;
+			}
+
+			size_t end = offset + count;
+			size_t pos = 0;
+
+			for (size_t i = 0; i < extent_count && pos < end; ++i)
+			{
+				size_t size = get_extent(i).size();
+
+				if (pos + size > offset && table->extents[i].buffer.use_count() != 1)
+				{
+					return false;
+				}
+
+				pos += size;
+			}
+
+			pos = 0;
+
+			for (size_t i = 0; i < extent_count && pos < end; ++i)
+			{
+				std::string_view ext = get_extent(i);
+
+				if (pos + ext.size() > offset)
+				{
+					size_t from = offset > pos ? offset - pos : 0;
+					size_t to = end < pos + ext.size() ? end - pos : ext.size();
+
+					memcpy(const_cast<char*>(ext.data()) + from, bytes + (pos + from - offset), to - from);
+				}
+
+				pos += ext.size();
+			}
+
+			return true;
+		}
+
+		// Build new extent table, where extents overlapping written range
+		// are cut around new extent with the bytes. Cost doesn't depend on size of content
+		void _overwrite_shared(size_t offset, const char* bytes, size_t count)
+		{
+			auto new_table = std::make_shared<extent_table>((extent_count + 2) * 2);
+			size_t end = offset + count;
+			size_t pos = 0;
+
+			for (size_t i = 0; i < extent_count; ++i)
+			{
+				const extent& ext = table->extents[i];
+				size_t size = get_extent(i).size();
+				size_t ext_end = pos + size;
+
+				if (ext_end <= offset || pos >= end) // untouched
+				{
+					_add_extent(*new_table, ext.buffer, ext.offset, size);
+				}
+				else
+				{
+					if (pos < offset) // head of extent before written range
+					{
+						_add_extent(*new_table, ext.buffer, ext.offset, offset - pos);
+					}
+
+					if (pos <= offset) // written range starts in this extent
+					{
+						auto buffer = std::make_shared<extent_buffer>(
+							count > min_extent_capacity ? count : min_extent_capacity);
+
+						memcpy(buffer->data, bytes, count);
+						buffer->used = count;
+
+						_add_extent(*new_table, std::move(buffer), 0, count);
+					}
+
+					if (ext_end > end) // tail of extent after written range
+					{
+						_add_extent(*new_table, ext.buffer, ext.offset + (end - pos), ext_end - end);
+					}
+				}
+
+				pos = ext_end;
+			}
+
+			table = std::move(new_table);
+			extent_count = table->count;
+			last_size = table->extents[extent_count - 1].size;
+
+			if (extent_count > max_extent_count)
+			{
+				*this = flattened();
+			}
+		}
+
+		// Move inline content to new extent, which has room
+		// for at least extra more bytes. Growth is geometric as for appends
+		void _move_to_extent(size_t extra)
+		{
+			size_t size = total_size;
+			extent_buffer& buffer = _push_extent(size + (size > extra ? size : extra));
+
+			memcpy(buffer.data, inline_bytes, size);
+			buffer.used = size;
+			last_size = size;
+		}
+
+		static void _add_extent(extent_table& to, std::shared_ptr<extent_buffer> buffer,
+			size_t offset, size_t size)
+		{
+			extent& ext = to.extents[to.count++];
+			ext.buffer = std::move(buffer);
+			ext.offset = offset;
+			ext.size = size;
+		}
+
+		extent_buffer& _push_extent(size_t capacity)
+		{
+			if (capacity < min_extent_capacity)
+			{
+				capacity = min_extent_capacity;
+			}
+
+			// Table is shared with content which has more extents or is full, copy it
+			if (!table || table->count != extent_count || table->count == table->capacity)
+			{
+				auto new_table = std::make_shared<extent_table>(extent_count < 2 ? 4 : extent_count * 2);
+
+				for (size_t i = 0; i < extent_count; ++i)
+				{
+					new_table->extents[i] = table->extents[i];
+				}
+
+				new_table->count = extent_count;
+				table = std::move(new_table);
+			}
+
+			if (extent_count != 0)
+			{
+				table->extents[extent_count - 1].size = last_size; // seal last extent
+			}
+
+			extent& ext = table->extents[table->count++];
+			ext.buffer = std::make_shared<extent_buffer>(capacity);
+			ext.offset = 0;
+			ext.size = 0;
+
+			++extent_count;
+			last_size = 0;
+
+			return *ext.buffer;
+		}
+	};
+
+	// Read-only handle to file content as it was at some version.
+	// Content referred by snapshot is never modified, so it can
+	// be read without copying or locking
+	class content_snapshot
+	{
+	protected:
+		std::shared_ptr<const file_content> content;
+
+	public:
+		content_snapshot()
+		{
+		}
+
+		explicit content_snapshot(std::shared_ptr<const file_content> content)
+			: content(std::move(content))
+		{
+		}
+
+		bool valid() const
+		{
+			return content != nullptr;
+		}
+
+		size_t get_version() const
+		{
+			return content ? content->get_version() : 0;
+		}
+
+		size_t size() const
+		{
+			return content ? content->size() : 0;
+		}
+
+		size_t get_extent_count() const
+		{
+			return content ? content->get_extent_count() : 0;
+		}
+
+		std::string_view get_extent(size_t index) const
+		{
+			return content->get_extent(index);
+		}
+
+		bool is_contiguous() const
+		{
+			return !content || content->is_contiguous();
+		}
+
+		std::string_view view() const
+		{
+			return content ? content->view() : std::string_view();
+		}
+
+		size_t copy_to(char* out, size_t offset, size_t count) const
+		{
+			return content ? content->copy_to(out, offset, count) : 0;
+		}
+
+		std::string str() const
+		{
+			return content ? content->str() : std::string();
+		}
+	};
+};
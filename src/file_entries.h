@@ -1,9 +1,26 @@
 #pragma once
 
+#include "dentry_cache.h"
+#include "entry_arena.h"
+#include "file_content.h"
 #include "file_path.h"
+#include "virt_ascii.h"
 #include "virt_exceptions.h"
+#include "virt_stats.h"
+#include "virt_sync.h"
+#include "virt_trace.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cwchar>
 #include <cwctype>
+#include <memory>
+#include <memory_resource>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 
@@ -11,12 +28,36 @@ namespace virtfiles
 {
 	class file_t;
 	class folder_t;
+	class journal;
+	struct journal_options;
 
 	class base_entry
 	{
+		friend class folder_t;
+
 	protected:
-		folder_t* parent;
+		// Kept before each entry allocated with new,
+		// so it is freed to the resource it came from
+		struct alignas(std::max_align_t) allocation_header
+		{
+			std::pmr::memory_resource* resource;
+			size_t size;
+		};
+
+		// Set in references when entry is removed from tree
+		static constexpr uint32_t removed_flag = uint32_t{ 1 } << 31;
+
+		std::pmr::memory_resource* resource; // allocates names and entries of subtree
+		std::atomic<folder_t*> parent; // null if entry is root or removed
+		journal* log; // records modifications of entry, inherited from parent
 		const char* name;
+		std::string_view folded_name; // case-folded name, used as lookup key
+
+		// Entry is referenced by its folder and by handles, like the ones
+		// of streams which opened it, so it's deleted when it's removed
+		// and the last handle is released
+		std::atomic<uint32_t> references;
+		uint32_t slot; // position in entries of parent
 
 	public:
 		const char* get_name() const
@@ -24,24 +65,39 @@ namespace virtfiles
 			return name;
 		}
 
+		std::string_view get_folded_name() const
+		{
+			return folded_name;
+		}
+
 		folder_t* get_parent() const
 		{
-			return parent;
+			return parent.load(std::memory_order_acquire);
 		}
 
-		base_entry(const char* entry_name,
-			folder_t* parent = nullptr)
-			: parent(parent)
+		journal* get_journal() const
 		{
-			size_t name_size = strlen(entry_name);
+			return log;
+		}
 
-			if (!check_name(entry_name, name_size))
-			{
-				throw invalid_path_error();
-			}
+		// Removed entries stay valid while they have handles,
+		// but they can't be found and nothing can be added to them
+		bool is_removed() const
+		{
+			return (references.load(std::memory_order_acquire) & removed_flag) != 0;
+		}
+
+		std::pmr::memory_resource* get_resource() const
+		{
+			return resource;
+		}
 
-			this->name = new char[name_size + 1] {};
-			memcpy(const_cast<char*>(name), entry_name, name_size);
+		base_entry(std::string_view entry_name,
+			folder_t* parent = nullptr,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+			: resource(resource), parent(parent), log(_inherit_journal(parent)), references(1), slot(0)
+		{
+			name = _allocate_names(entry_name, resource, folded_name);
 		}
 
 		base_entry(const base_entry&) = delete;
@@ -49,7 +105,54 @@ namespace virtfiles
 
 		virtual ~base_entry()
 		{
-			delete[] name;
+			_free_names();
+		}
+
+		void _retain()
+		{
+			references.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void _release()
+		{
+			if ((references.fetch_sub(1, std::memory_order_acq_rel) & ~removed_flag) == 1)
+			{
+				delete this;
+			}
+		}
+
+		static void* operator new(size_t size, std::pmr::memory_resource* resource)
+		{
+			void* block = resource->allocate(sizeof(allocation_header) + size, alignof(allocation_header));
+
+			allocation_header* header = static_cast<allocation_header*>(block);
+			header->resource = resource;
+			header->size = size;
+
+			return header + 1;
+		}
+
+		static void* operator new(size_t size)
+		{
+			return operator new(size, std::pmr::get_default_resource());
+		}
+
+		static void operator delete(void* p) noexcept
+		{
+			if (!p)
+			{
+				return;
+			}
+
+			allocation_header* header = static_cast<allocation_header*>(p) - 1;
+			header->resource->deallocate(header, sizeof(allocation_header) + header->size,
+				alignof(allocation_header));
+		}
+
+		// Called if constructor throws
+		static void operator delete(void* p, std::pmr::memory_resource*) noexcept
+		{
+			operator delete(p);
 		}
 
 		base_entry& operator=(const base_entry&) = delete;
@@ -77,6 +180,11 @@ namespace virtfiles
 
 		static bool check_name(const char* name, size_t size)
 		{
+			if (ascii::is_ascii(name, size))
+			{
+				return ascii::is_valid_name(name, size);
+			}
+
 			std::mbstate_t state{};
 
 			wchar_t ch;
@@ -120,351 +228,1543 @@ namespace virtfiles
 			return true;
 		}
 
-		bool is_named(const std::string& name) const
+		bool is_named(std::string_view name) const
 		{
-			std::mbstate_t state{};
+			if (name.size() == folded_name.size() && _folds_as_ascii(name))
+			{
+				return ascii::equal_folded(name.data(), folded_name.data(), name.size());
+			}
+
+			return fold_name(name) == folded_name;
+		}
+
+		// Convert name to lower case, so case independently
+		// equal names are converted to the same string
+		static std::string fold_name(std::string_view name)
+		{
+			std::string out(fold_name_max_size(name), '\0');
+			out.resize(fold_name(name, &out[0]));
+
+			return out;
+		}
+
+		// Max size of folded name
+		static size_t fold_name_max_size(std::string_view name)
+		{
+			return _folds_as_ascii(name) ? name.size() : name.size() * MB_CUR_MAX;
+		}
+
+		// Write folded name to out, which must be at least
+		// fold_name_max_size(name) long, returns its size
+		static size_t fold_name(std::string_view name, char* out)
+		{
+			if (_folds_as_ascii(name))
+			{
+				ascii::to_lower(name.data(), name.size(), out);
+				return name.size();
+			}
+
+			std::mbstate_t in_state{};
+			std::mbstate_t out_state{};
 
-			wchar_t lch, rch;
-			const char* li = this->name;
-			const char* ri = name.c_str();
-			size_t lleft = strlen(this->name);
-			size_t rleft = name.length();
+			char* out_start = out;
+			const char* i = name.data();
+			size_t left = name.size();
 
-			while (lleft > 0 && rleft > 0)
+			while (left > 0)
 			{
-				_is_named_next_char(lch, li, lleft, &state);
-				_is_named_next_char(rch, ri, rleft, &state);
+				wchar_t ch;
+				size_t count = std::mbrtowc(&ch, i, left, &in_state);
 
-				// Null characters cannot be just in strings
-				// So this can only consider to be an error
-				if (lch == 0 || rch == 0)
+				switch (count)
 				{
-					return false;
+				case static_cast<size_t>(-1):
+				case static_cast<size_t>(-2):
+					// Invalid sequence, keep the rest as is
+					memcpy(out, i, left);
+					return out + left - out_start;
+				case 0:
+					count = 1; // null character
 				}
 
-				// Case independently comparing characters
-				if (std::towlower(static_cast<wint_t>(lch)) != std::towlower(static_cast<wint_t>(rch)))
+				size_t folded_count = std::wcrtomb(out,
+					static_cast<wchar_t>(std::towlower(static_cast<wint_t>(ch))), &out_state);
+
+				if (folded_count == static_cast<size_t>(-1))
 				{
-					return false;
+					memcpy(out, i, count);
+					folded_count = count;
 				}
+
+				out += folded_count;
+				i += count;
+				left -= count;
 			}
 
-			return true;
+			return out - out_start;
 		}
 
-	private:
-		static void _is_named_next_char(wchar_t& ch,
-			const char*& src, size_t& src_left,
-			std::mbstate_t* state)
+	protected:
+		// Allocate block with name and its folded form, which is returned in folded
+		static char* _allocate_names(std::string_view entry_name,
+			std::pmr::memory_resource* resource, std::string_view& folded)
 		{
-			// Convert next character
-			size_t count = std::mbrtowc(&ch, src, src_left, state);
+			size_t name_size = entry_name.size();
 
-			// If error, set null char
-			switch (count)
+			if (!check_name(entry_name.data(), name_size))
 			{
-			case static_cast<size_t>(-1):
-			case static_cast<size_t>(-2):
-				ch = 0;
-				return;
+				throw invalid_path_error();
+			}
+
+			// Folded ASCII name has the same size, other ones
+			// are folded first to know how much to allocate
+			std::string folded_str;
+			bool ascii = _folds_as_ascii(entry_name);
+
+			if (!ascii)
+			{
+				folded_str = fold_name(entry_name);
+			}
+
+			size_t folded_size = ascii ? name_size : folded_str.size();
+
+			// Name and folded name are kept in one block
+			char* names = static_cast<char*>(resource->allocate(name_size + folded_size + 2, 1));
+			char* folded_copy = names + name_size + 1;
+
+			entry_name.copy(names, name_size);
+			names[name_size] = '\0';
+
+			if (ascii)
+			{
+				ascii::to_lower(entry_name.data(), name_size, folded_copy);
+			}
+			else
+			{
+				folded_str.copy(folded_copy, folded_size);
 			}
 
-			src += count;
-			src_left -= count;
+			folded_copy[folded_size] = '\0';
+			folded = std::string_view(folded_copy, folded_size);
+
+			return names;
+		}
+
+		void _free_names()
+		{
+			resource->deallocate(const_cast<char*>(name), strlen(name) + folded_name.size() + 2, 1);
+		}
+
+		void _mark_removed()
+		{
+			references.fetch_or(removed_flag, std::memory_order_release);
+		}
+
+		// Journal of parent, defined after folder_t
+		static journal* _inherit_journal(folder_t* parent);
+
+	private:
+		// Name is ASCII and locale folds ASCII letters as ASCII
+		// (unlike Turkish one), so it can be folded byte by byte
+		static bool _folds_as_ascii(std::string_view name)
+		{
+			return ascii::is_ascii(name.data(), name.size()) && std::towlower(L'I') == L'i';
 		}
 	};
 
-	class file_t : public base_entry
+	// Counted reference to entry. Entry stays valid while it has handles,
+	// even if it's removed from tree concurrently, so entries are found and
+	// kept by streams this way. Lookups retain each entry under lock of its folder
+	template <class Entry>
+	class entry_handle
 	{
+		template <class Other>
+		friend class entry_handle;
+
 	protected:
-		const char* content;
-		size_t file_size;
+		Entry* entry;
 
 	public:
-		std::string getContent() const
+		entry_handle() noexcept
+			: entry(nullptr)
 		{
-			return std::string(content, file_size);
 		}
 
-		file_t(const char* name,
-			folder_t* parent = nullptr)
-			: base_entry(name, parent),
-			content(new char[1] {0}), file_size(0)
+		explicit entry_handle(Entry* entry) noexcept
+			: entry(entry)
 		{
+			if (entry)
+			{
+				entry->_retain();
+			}
 		}
 
-		virtual ~file_t()
+		// Take reference of owner for entry, which is the same entry as other type
+		template <class Other>
+		entry_handle(entry_handle<Other>&& owner, Entry& entry) noexcept
+			: entry(&entry)
 		{
-			delete[] content;
+			owner.entry = nullptr;
 		}
 
-		bool is_file() const override
+		entry_handle(const entry_handle& other) noexcept
+			: entry_handle(other.entry)
 		{
-			return true;
 		}
 
-		file_t& as_file() override
+		entry_handle(entry_handle&& other) noexcept
+			: entry(other.entry)
 		{
-			return *this;
+			other.entry = nullptr;
 		}
 
-		void empty()
+		~entry_handle()
 		{
-			delete[] content;
-			content = new char[1] {0};
-			file_size = 0;
+			reset();
 		}
 
-		void writeBytes(const char* bytes, size_t count)
+		entry_handle& operator=(entry_handle other) noexcept
 		{
-			char* buf = new char[count + 1] {};
-			memcpy(buf, bytes, count);
+			std::swap(entry, other.entry);
 
-			delete[] content;
-			content = buf;
-			file_size = count;
+			return *this;
 		}
 
-		void writeBytes(const char* bytes)
+		// Make handle from reference which entry was already retained with
+		static entry_handle adopt(Entry* entry) noexcept
 		{
-			writeBytes(bytes, strlen(bytes));
+			entry_handle out;
+			out.entry = entry;
+
+			return out;
 		}
 
-		void writeBytes(const std::string& bytes)
+		void reset() noexcept
 		{
-			writeBytes(bytes.c_str(), bytes.size());
+			if (entry)
+			{
+				std::exchange(entry, nullptr)->_release();
+			}
 		}
 
-		void appendBytes(const char* bytes, size_t count)
+		Entry* get() const noexcept
 		{
-			char* buf = new char[file_size + count + 1] {};
-			memcpy(buf, content, file_size);
-			memcpy(buf + file_size, bytes, count);
+			return entry;
+		}
 
-			delete[] content;
-			content = buf;
-			file_size += count;
+		Entry& operator*() const noexcept
+		{
+			return *entry;
 		}
 
-		void appendBytes(const char* bytes)
+		Entry* operator->() const noexcept
 		{
-			appendBytes(bytes, strlen(bytes));
+			return entry;
 		}
 
-		void appendBytes(const std::string& bytes)
+		explicit operator bool() const noexcept
 		{
-			appendBytes(bytes.c_str(), bytes.size());
+			return entry != nullptr;
 		}
 	};
 
-	class folder_t : public base_entry
+	// Folded name to look up, short names are kept on stack
+	class folded_key
 	{
 	protected:
-		std::vector<base_entry*> entries;
+		static constexpr size_t inline_size = 512;
+
+		char inline_str[inline_size];
+		std::string heap_str;
+		std::string_view key;
 
 	public:
-		const std::vector<base_entry*>& get_items()
+		explicit folded_key(std::string_view name)
 		{
-			return entries;
+			if (base_entry::fold_name_max_size(name) <= inline_size)
+			{
+				key = std::string_view(inline_str, base_entry::fold_name(name, inline_str));
+			}
+			else
+			{
+				heap_str = base_entry::fold_name(name);
+				key = heap_str;
+			}
 		}
 
-		folder_t(const char* name, folder_t* parent = nullptr)
-			: base_entry(name, parent)
+		folded_key(const folded_key&) = delete;
+		folded_key& operator=(const folded_key&) = delete;
+
+		std::string_view view() const
 		{
+			return key;
 		}
+	};
 
-		virtual ~folder_t()
+	// Operations recorded by journal, see virt_journal.h
+	enum class journal_operation : uint8_t
+	{
+		create_file = 1,
+		create_folder = 2,
+		write = 3, // replaces content
+		append = 4,
+		write_at = 5,
+		remove = 6,
+		move = 7 // data is new path
+	};
+
+	// Records operation on entry to journal, if its file system has one.
+	// Journal doesn't checkpoint while scope exists, so it must be made
+	// before entry is locked. Exclusive scope also waits for all other
+	// operations, it's needed to change names and parents of entries,
+	// which other records read. Defined in virt_journal.h
+	class journal_scope
+	{
+	protected:
+		journal* log;
+		uint64_t end; // journal position after record
+		bool exclusive;
+		bool frozen;
+
+	public:
+		explicit journal_scope(journal* log, bool exclusive = false);
+		~journal_scope();
+
+		journal_scope(const journal_scope&) = delete;
+		journal_scope& operator=(const journal_scope&) = delete;
+
+		void record(journal_operation operation, const base_entry& entry,
+			uint64_t offset = 0, const char* bytes = nullptr, size_t count = 0);
+
+		// Record bytes of content from offset from
+		void record(journal_operation operation, const base_entry& entry,
+			const file_content& content, size_t from);
+
+		// Record move of entry to target folder under name
+		void record(const base_entry& entry, const folder_t& target, std::string_view name);
+
+		// Wait until record is on disk if journal waits for commits,
+		// must be called after entry is unlocked
+		void commit();
+
+	protected:
+		void _unfreeze();
+	};
+
+	class file_t : public base_entry
+	{
+	protected:
+		// Current content version. It is never modified after it's published,
+		// writers make a new one and replace the pointer atomically,
+		// so readers don't ever wait for writers.
+		// Null until content of lazily loaded file is loaded
+		std::shared_ptr<const file_content> content;
+
+		mutable mutex_t write_mutex; // serializes writers
+
+#ifdef VIRTFILES_FILE_STATS
+		file_stats io_stats;
+#endif
+
+	public:
+#ifdef VIRTFILES_FILE_STATS
+		const file_stats& get_stats() const
 		{
-			for (base_entry* entry : entries)
-			{
-				delete entry;
-			}
+			return io_stats;
 		}
 
-		bool is_folder() const override
+		void _count(counter which, uint64_t amount = 1)
 		{
-			return true;
+			io_stats.add(which, amount);
 		}
+#endif
 
-		folder_t& as_folder() override
+		std::string getContent() const
 		{
-			return *this;
+			return _current()->str();
 		}
 
-		base_entry* get_entry(const std::string& name)
+		size_t getSize() const
 		{
-			if (name == "" || name == ".")
-			{
-				return this;
-			}
+			return _current()->size();
+		}
 
-			if (name == "..")
-			{
-				if (!this->parent)
-				{
-					throw file_not_found_error();
-				}
+		// Incremented on every content modification
+		size_t getVersion() const
+		{
+			return _current()->get_version();
+		}
 
-				return this->parent;
-			}
+		// Handle to current content which stays valid after modifications
+		content_snapshot snapshot() const
+		{
+			return content_snapshot(_current());
+		}
 
-			for (base_entry* entry : entries)
+		// Contiguous view of current content, invalidated by next modification.
+		// Not synchronized, use snapshot() if file is modified concurrently
+		std::string_view view()
+		{
+			journal_scope logged(log); // content is replaced, though not changed
+			exclusive_lock lock(write_mutex);
+			_load_locked();
+
+			if (!content->is_contiguous())
 			{
-				if (entry->is_named(name))
-				{
-					return entry;
-				}
+				// Same bytes, so version doesn't change
+				store_shared(content, std::shared_ptr<const file_content>(
+					std::make_shared<file_content>(content->flattened())));
 			}
 
-			throw file_not_found_error();
+			return content->view();
 		}
 
-		bool name_is_free(const std::string& name)
+		size_t readBytes(size_t offset, char* out, size_t count) const
 		{
-			if (name.length() <= 2) // likea super mega effective check on "", "." and ".."
-			{
-				bool all_dot = true;
-				const char* i = name.c_str();
-
-				for (const char* end = i + name.length(); i < end; ++i)
-				{
-					if (*i != L'.')
-					{
-						all_dot = false;
-					}
-				}
+			return _current()->copy_to(out, offset, count);
+		}
 
-				if (all_dot)
-				{
-					return false;
-				}
-			}
+		file_t(std::string_view name,
+			folder_t* parent = nullptr,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+			: base_entry(name, parent, resource),
+			content(_empty_content())
+		{
+		}
 
-			for (base_entry* entry : entries)
-			{
-				if (entry->is_named(name))
-				{
-					return false;
-				}
-			}
+		virtual ~file_t()
+		{
+		}
 
+		bool is_file() const override
+		{
 			return true;
 		}
 
-		base_entry& lookup(const path_t& path)
+		file_t& as_file() override
 		{
-			base_entry* out = this;
+			return *this;
+		}
+
+		void empty()
+		{
+			VIRTFILES_TRACE_SCOPE(write);
+			journal_scope logged(log);
 
-			for (std::string part : path.parts)
 			{
-				out = out->as_folder().get_entry(part);
+				exclusive_lock lock(write_mutex);
+
+				auto next = _next_content();
+				next->clear();
+
+				logged.record(journal_operation::write, *this);
+				_publish(std::move(next));
 			}
 
-			return *out;
+			logged.commit();
 		}
 
-		folder_t* _Approach(const path_t& path,
-			const char*& out_name, bool create_parents = false)
+		void writeBytes(const char* bytes, size_t count)
 		{
-			folder_t* dir = this;
-			auto i = path.parts.begin();
-			auto back = path.parts.end() - 1;
-			out_name = *back;
+			VIRTFILES_TRACE_SCOPE(write);
+			journal_scope logged(log);
 
-			if (create_parents)
 			{
-				for (; i != back; ++i)
-				{
-					folder_t* prev_dir = dir;
+				exclusive_lock lock(write_mutex);
 
-					try {
-						dir = &dir->get_entry(*i)->as_folder();
-					}
-					catch (const file_not_found_error&)
-					{
-						dir = &prev_dir->_createFolder(*i);
-					}
-				}
-			}
-			else
-			{
-				for (; i != back; ++i)
-				{
-					dir = &dir->get_entry(*i)->as_folder();
-				}
+				// Small content is rewritten inline, without allocations, if it's not shared
+				auto next = _next_content();
+				next->assign(bytes, count);
+
+				logged.record(journal_operation::write, *this, 0, bytes, count);
+				_publish(std::move(next));
 			}
 
-			return dir;
+			logged.commit();
 		}
 
-		file_t& createFile(const path_t& path, bool parents = false)
+		void writeBytes(const char* bytes)
 		{
-			const char* name;
-			folder_t* dir = _Approach(path, name, parents);
+			writeBytes(bytes, strlen(bytes));
+		}
 
-			return dir->_createFile(name);
+		void writeBytes(const std::string& bytes)
+		{
+			writeBytes(bytes.c_str(), bytes.size());
 		}
 
-		file_t& _createFile(const char* name)
+		// Overwrite count bytes at offset, file is extended if they go past
+		// its end. Only touched bytes are copied, not whole content
+		void writeAt(size_t offset, const char* bytes, size_t count)
 		{
-			if (!name_is_free(name))
+			VIRTFILES_TRACE_SCOPE(write);
+			journal_scope logged(log);
+
 			{
-				throw file_exists_error();
-			}
+				exclusive_lock lock(write_mutex);
 
-			file_t* file = new file_t(name, this);
+				auto next = _next_content();
+				next->write(offset, bytes, count);
 
-			entries.push_back(file);
-			return *file;
+				logged.record(journal_operation::write_at, *this, offset, bytes, count);
+				_publish(std::move(next));
+			}
+
+			logged.commit();
 		}
 
-		folder_t& createFolder(const path_t& path, bool parents = false)
+		// Make next version of content in place: fill gets empty content
+		// (or copy of current one if append is set) and appends bytes to it,
+		// e.g. with append_space. Nothing is changed if fill returns false
+		template <class Fill>
+		bool writeWith(Fill fill, bool append = false)
 		{
-			const char* name;
-			folder_t* dir = _Approach(path, name, parents);
+			VIRTFILES_TRACE_SCOPE(write);
+			journal_scope logged(log);
 
-			return dir->_createFolder(name);
-		}
+			{
+				exclusive_lock lock(write_mutex);
+				_load_locked();
 
-		folder_t& _createFolder(const char* name)
+				size_t old_size = content->size();
+				auto next = append ? std::make_shared<file_content>(*content) : _fresh_content();
+				next->set_version(content->get_version() + 1);
+
+				if (!fill(*next))
+				{
+					return false;
+				}
+
+				if (append)
+				{
+					logged.record(journal_operation::append, *this, *next, old_size);
+				}
+				else
+				{
+					logged.record(journal_operation::write, *this, *next, 0);
+				}
+
+				_publish(std::move(next));
+			}
+
+			logged.commit();
+			return true;
+		}
+
+		void appendBytes(const char* bytes, size_t count)
+		{
+			VIRTFILES_TRACE_SCOPE(write);
+			journal_scope logged(log);
+
+			{
+				exclusive_lock lock(write_mutex);
+
+				auto next = _next_content();
+				next->append(bytes, count);
+
+				logged.record(journal_operation::append, *this, 0, bytes, count);
+				_publish(std::move(next));
+			}
+
+			logged.commit();
+		}
+
+		void appendBytes(const char* bytes)
+		{
+			appendBytes(bytes, strlen(bytes));
+		}
+
+		void appendBytes(const std::string& bytes)
+		{
+			appendBytes(bytes.c_str(), bytes.size());
+		}
+
+		// Called when stream which opened file is closed, false if it failed
+		virtual bool _on_close()
+		{
+			return true;
+		}
+
+	protected:
+		// Content of lazily loaded file, called once under write lock
+		virtual std::shared_ptr<const file_content> _load_content()
+		{
+			return _empty_content();
+		}
+
+		// Content of new files, shared by all of them until they are written
+		static const std::shared_ptr<const file_content>& _empty_content()
+		{
+			static const std::shared_ptr<const file_content> empty = std::make_shared<file_content>();
+
+			return empty;
+		}
+
+	private:
+		// Current content for readers, loaded first if it's not yet
+		std::shared_ptr<const file_content> _current() const
+		{
+			std::shared_ptr<const file_content> current = load_shared(content);
+
+			if (!current)
+			{
+				exclusive_lock lock(write_mutex);
+				current = const_cast<file_t*>(this)->_load_locked();
+			}
+
+			return current;
+		}
+
+		// Load content if it's not yet, must be called under write lock
+		const std::shared_ptr<const file_content>& _load_locked()
+		{
+			if (!content)
+			{
+				store_shared(content, _load_content());
+			}
+
+			return content;
+		}
+
+		// Copy of current content with next version, must be called under write lock
+		std::shared_ptr<file_content> _next_content()
+		{
+			std::shared_ptr<file_content> next;
+			_load_locked();
+
+#ifndef VIRTFILES_THREADSAFE
+			// Nobody else refers to current content, so it can be modified in place
+			if (content.use_count() == 1)
+			{
+				next = std::const_pointer_cast<file_content>(content);
+			}
+			else
+#endif
+			{
+				// Copy shares extents, so it's O(1)
+				next = std::make_shared<file_content>(*content);
+			}
+
+			next->set_version(next->get_version() + 1);
+
+			return next;
+		}
+
+		// Empty content of next version, must be called under write lock.
+		// Lazy content which wasn't loaded is replaced without loading it
+		std::shared_ptr<file_content> _fresh_content() const
+		{
+			auto next = std::make_shared<file_content>();
+			next->set_version(content ? content->get_version() + 1 : 1);
+
+			return next;
+		}
+
+		void _publish(std::shared_ptr<file_content> next)
+		{
+			store_shared(content, std::shared_ptr<const file_content>(std::move(next)));
+		}
+	};
+
+	class folder_t : public base_entry
+	{
+	protected:
+		std::vector<base_entry*> entries;
+		std::pmr::unordered_map<std::string_view, base_entry*> index; // folded name -> entry
+
+		mutable shared_mutex_t entries_mutex; // guards entries and index
+
+		// Cleared by folders which list their entries lazily, until they do
+		std::atomic<bool> listed;
+
+		// Held exclusively while entries are removed or moved, so parents
+		// don't change while lookups go up and moves check for cycles
+		static inline shared_mutex_t relink_mutex;
+
+		// Incremented after each removal and move, so caches know
+		// paths resolved before it may be stale
+		static inline std::atomic<size_t> relink_count{ 0 };
+
+	public:
+		// Count of removals and moves of entries of all trees so far
+		static size_t get_relink_count()
+		{
+			return relink_count.load(std::memory_order_acquire);
+		}
+
+		// Not synchronized, don't use while folder is modified concurrently
+		const std::vector<base_entry*>& get_items()
+		{
+			_ensure_listed();
+
+			return entries;
+		}
+
+		folder_t(std::string_view name, folder_t* parent = nullptr,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+			: base_entry(name, parent, resource), index(resource), listed(true)
+		{
+		}
+
+		virtual ~folder_t()
+		{
+			// Entries which have handles outlive the folder
+			for (base_entry* entry : entries)
+			{
+				entry->parent = nullptr;
+				entry->_release();
+			}
+		}
+
+		bool is_folder() const override
+		{
+			return true;
+		}
+
+		// Make journal record modifications of folder and its entries
+		void _set_journal(journal* log)
+		{
+			this->log = log;
+
+			for (base_entry* entry : entries)
+			{
+				if (entry->is_folder())
+				{
+					entry->as_folder()._set_journal(log);
+				}
+				else
+				{
+					entry->log = log;
+				}
+			}
+		}
+
+		folder_t& as_folder() override
+		{
+			return *this;
+		}
+
+		base_entry* get_entry(std::string_view name)
+		{
+			if (name == "" || name == ".")
+			{
+				return this;
+			}
+
+			if (name == "..")
+			{
+				if (!this->parent)
+				{
+					throw file_not_found_error();
+				}
+
+				return this->parent;
+			}
+
+			_ensure_listed();
+
+			folded_key folded(name);
+			read_lock lock(entries_mutex);
+
+			auto found = index.find(folded.view());
+
+			if (found == index.end())
+			{
+				throw file_not_found_error();
+			}
+
+			return found->second;
+		}
+
+		// Find entry and retain it, so it stays valid if it's removed meanwhile
+		entry_handle<base_entry> acquire_entry(std::string_view name)
+		{
+			if (name == "" || name == ".")
+			{
+				return entry_handle<base_entry>(this);
+			}
+
+			if (name == "..")
+			{
+				read_lock relinking(relink_mutex);
+				folder_t* up = get_parent();
+
+				if (!up)
+				{
+					throw file_not_found_error();
+				}
+
+				return entry_handle<base_entry>(up);
+			}
+
+			_ensure_listed();
+
+			folded_key folded(name);
+			read_lock lock(entries_mutex);
+
+			auto found = index.find(folded.view());
+
+			if (found == index.end())
+			{
+				throw file_not_found_error();
+			}
+
+			return entry_handle<base_entry>(found->second);
+		}
+
+		bool name_is_free(std::string_view name)
+		{
+			if (_is_special_name(name))
+			{
+				return false;
+			}
+
+			_ensure_listed();
+
+			folded_key folded(name);
+			read_lock lock(entries_mutex);
+
+			return index.find(folded.view()) == index.end();
+		}
+
+		base_entry& lookup(path_view path)
+		{
+			VIRTFILES_TRACE_SCOPE(lookup);
+			base_entry* out = this;
+			size_t depth = 0;
+
+			for (std::string_view part : path)
+			{
+				out = out->as_folder().get_entry(part);
+				++depth;
+			}
+
+			_count_lookup(depth);
+			return *out;
+		}
+
+		// Find entry by path and retain it, see acquire_entry
+		entry_handle<base_entry> acquire(path_view path)
+		{
+			VIRTFILES_TRACE_SCOPE(lookup);
+			entry_handle<base_entry> out(this);
+			size_t depth = 0;
+
+			for (std::string_view part : path)
+			{
+				out = out->as_folder().acquire_entry(part);
+				++depth;
+			}
+
+			_count_lookup(depth);
+			return out;
+		}
+
+		entry_handle<folder_t> _Approach(path_view path,
+			std::string_view& out_name, bool create_parents = false)
+		{
+			entry_handle<folder_t> dir(this);
+			auto i = path.begin();
+
+			for (; !i.is_last(); ++i)
+			{
+				dir = dir->_acquire_folder(*i, create_parents);
+			}
+
+			out_name = *i;
+
+			return dir;
+		}
+
+		file_t& createFile(path_view path, bool parents = false)
+		{
+			return *acquire_new_file(path, parents);
+		}
+
+		// Create file and retain it, so it stays valid if it's removed meanwhile
+		entry_handle<file_t> acquire_new_file(path_view path, bool parents = false)
+		{
+			std::string_view name;
+			entry_handle<folder_t> dir = _Approach(path, name, parents);
+
+			return dir->_acquire_new_file(name);
+		}
+
+		file_t& _createFile(std::string_view name)
+		{
+			return *_acquire_new_file(name);
+		}
+
+		entry_handle<file_t> _acquire_new_file(std::string_view name)
+		{
+			VIRTFILES_TRACE_SCOPE(create_file);
+
+			if (_is_special_name(name))
+			{
+				throw file_exists_error();
+			}
+
+			journal_scope logged(log);
+			entry_handle<file_t> file = _add_entry(_new_file(name), &logged, journal_operation::create_file);
+
+			logged.commit();
+			return file;
+		}
+
+		folder_t& createFolder(path_view path, bool parents = false)
+		{
+			return *acquire_new_folder(path, parents);
+		}
+
+		entry_handle<folder_t> acquire_new_folder(path_view path, bool parents = false)
+		{
+			std::string_view name;
+			entry_handle<folder_t> dir = _Approach(path, name, parents);
+
+			return dir->_acquire_new_folder(name);
+		}
+
+		folder_t& _createFolder(std::string_view name)
+		{
+			return *_acquire_new_folder(name);
+		}
+
+		entry_handle<folder_t> _acquire_new_folder(std::string_view name)
+		{
+			VIRTFILES_TRACE_SCOPE(create_folder);
+
+			if (_is_special_name(name))
+			{
+				throw file_exists_error();
+			}
+
+			journal_scope logged(log);
+			entry_handle<folder_t> folder = _add_entry(_new_folder(name), &logged, journal_operation::create_folder);
+
+			logged.commit();
+			return folder;
+		}
+
+		// Get existing folder or create new one if there is no entry named so
+		folder_t& _getOrCreateFolder(std::string_view name)
+		{
+			return *_acquire_folder(name, true);
+		}
+
+		// Find folder and retain it, it's created if create is set and there is no entry named so
+		entry_handle<folder_t> _acquire_folder(std::string_view name, bool create)
+		{
+			if (!create || _is_special_name(name))
+			{
+				entry_handle<base_entry> entry = acquire_entry(name);
+				folder_t& folder = entry->as_folder();
+
+				return entry_handle<folder_t>(std::move(entry), folder);
+			}
+
+			journal_scope logged(log);
+			std::unique_ptr<folder_t> folder(_new_folder(name));
+
+			_ensure_listed();
+			write_lock lock(entries_mutex);
+
+			auto found = index.find(folder->get_folded_name());
+
+			if (found != index.end())
+			{
+				return entry_handle<folder_t>(&found->second->as_folder());
+			}
+
+			_add_entry_locked(folder.get());
+
+			entry_handle<folder_t> out(folder.release());
+			logged.record(journal_operation::create_folder, *out);
+
+			lock.unlock();
+			logged.commit();
+			return out;
+		}
+
+		// Unlink entry, it's deleted when its last handle is released.
+		// Folder must be empty unless recursive is set
+		void remove(path_view path, bool recursive = false)
+		{
+			std::string_view name;
+			entry_handle<folder_t> dir = _Approach(path, name);
+
+			dir->_remove(name, recursive);
+		}
+
+		void _remove(std::string_view name, bool recursive = false)
+		{
+			if (_is_special_name(name))
+			{
+				throw invalid_path_error();
+			}
+
+			folded_key folded(name);
+			journal_scope logged(log, true);
+			write_lock relinking(relink_mutex);
+
+			_ensure_listed();
+			write_lock lock(entries_mutex);
+
+			auto found = index.find(folded.view());
+
+			if (found == index.end())
+			{
+				throw file_not_found_error();
+			}
+
+			base_entry* entry = found->second;
+			folder_t* folder = entry->is_folder() ? &entry->as_folder() : nullptr;
+			write_lock folder_lock;
+
+			// Folder is locked until it's marked removed, so nothing is added to it meanwhile
+			if (folder)
+			{
+				if (!recursive)
+				{
+					folder->_ensure_listed();
+				}
+
+				folder_lock = write_lock(folder->entries_mutex);
+
+				if (!recursive && !folder->entries.empty())
+				{
+					throw directory_not_empty_error();
+				}
+			}
+
+			logged.record(journal_operation::remove, *entry);
+
+			if (folder)
+			{
+				folder->_detach_locked();
+				folder_lock.unlock();
+			}
+
+			_unlink_locked(entry);
+			relink_count.fetch_add(1, std::memory_order_release);
+
+			lock.unlock();
+			relinking.unlock();
+			logged.commit();
+			entry->_release();
+		}
+
+		// Move entry at from to path to, relinking it without copying content.
+		// Entry which is at to is replaced, as rename() does: file by file, empty folder
+		// by folder. Open streams of moved and replaced files stay valid, so new
+		// content can be published by writing it to temporary file and moving it
+		void rename(path_view from, path_view to)
+		{
+			std::string_view name, new_name;
+			entry_handle<folder_t> dir = _Approach(from, name);
+			entry_handle<folder_t> target = _Approach(to, new_name);
+
+			dir->_move(name, *target, new_name);
+		}
+
+		void _move(std::string_view name, folder_t& target, std::string_view new_name)
+		{
+			if (_is_special_name(name) || _is_special_name(new_name))
+			{
+				throw invalid_path_error();
+			}
+
+			// Names are allocated from resource of tree, and journal records its folders only
+			if (target.log != log || target.resource != resource)
+			{
+				throw filesystem_exception(EXDEV, std::generic_category());
+			}
+
+			folded_key folded(name);
+			folded_key new_folded(new_name);
+			journal_scope logged(log, true);
+			write_lock relinking(relink_mutex);
+
+			_ensure_listed();
+			target._ensure_listed();
+
+			write_lock lock(entries_mutex, std::defer_lock);
+			write_lock target_lock(target.entries_mutex, std::defer_lock);
+
+			if (&target == this)
+			{
+				lock.lock();
+			}
+			else
+			{
+				std::lock(lock, target_lock);
+			}
+
+			auto found = index.find(folded.view());
+
+			if (found == index.end() || target.is_removed())
+			{
+				throw file_not_found_error();
+			}
+
+			base_entry* entry = found->second;
+
+			for (folder_t* i = &target; entry->is_folder() && i; i = i->get_parent())
+			{
+				if (i == entry)
+				{
+					throw invalid_path_error(); // into its own subtree
+				}
+			}
+
+			auto existing = target.index.find(new_folded.view());
+			base_entry* replaced = existing != target.index.end() && existing->second != entry
+				? existing->second
+				: nullptr;
+			write_lock replaced_lock;
+
+			if (replaced)
+			{
+				if (entry->is_folder() && !replaced->is_folder())
+				{
+					throw not_a_directory_error();
+				}
+
+				if (!entry->is_folder() && replaced->is_folder())
+				{
+					throw permission_error();
+				}
+			}
+
+			// Replaced folder is locked until it's marked removed, like in _remove
+			if (replaced && replaced->is_folder())
+			{
+				for (folder_t* i = this; i; i = i->get_parent())
+				{
+					if (i == replaced)
+					{
+						throw directory_not_empty_error(); // contains entry
+					}
+				}
+
+				folder_t& folder = replaced->as_folder();
+				folder._ensure_listed();
+				replaced_lock = write_lock(folder.entries_mutex);
+
+				if (!folder.entries.empty())
+				{
+					throw directory_not_empty_error();
+				}
+			}
+
+			// Allocate everything first, so relinking can't fail halfway
+			std::string_view folded_copy;
+			char* names = new_name != entry->name
+				? _allocate_names(new_name, resource, folded_copy)
+				: nullptr;
+
+			try
+			{
+				target.entries.reserve(target.entries.size() + 1);
+				target.index.reserve(target.index.size() + 1);
+
+				logged.record(*entry, target, new_name);
+			}
+			catch (...)
+			{
+				if (names)
+				{
+					resource->deallocate(names, new_name.size() + folded_copy.size() + 2, 1);
+				}
+
+				throw;
+			}
+
+			auto node = index.extract(found);
+
+			if (replaced)
+			{
+				if (replaced->is_folder())
+				{
+					replaced->as_folder()._detach_locked();
+					replaced_lock.unlock();
+				}
+
+				target._unlink_locked(replaced);
+			}
+
+			_remove_slot(entry);
+
+			if (names)
+			{
+				entry->_free_names();
+				entry->name = names;
+				entry->folded_name = folded_copy;
+			}
+
+			node.key() = entry->folded_name;
+			target.index.insert(std::move(node));
+
+			entry->slot = static_cast<uint32_t>(target.entries.size());
+			target.entries.push_back(entry);
+			entry->parent = &target;
+			relink_count.fetch_add(1, std::memory_order_release);
+
+			lock.unlock();
+
+			if (target_lock)
+			{
+				target_lock.unlock();
+			}
+
+			relinking.unlock();
+			logged.commit();
+
+			if (replaced)
+			{
+				replaced->_release();
+			}
+		}
+
+		// Add entry of other type, constructed from name, this folder,
+		// its memory resource and args. It isn't recorded by journal
+		template <class Entry, class... Args>
+		Entry& _createEntry(std::string_view name, Args&&... args)
 		{
-			if (!name_is_free(name))
+			if (_is_special_name(name))
 			{
 				throw file_exists_error();
 			}
 
-			folder_t* folder = new folder_t(name, this);
+			return *_add_entry(new (resource) Entry(name, this, resource, std::forward<Args>(args)...));
+		}
 
-			entries.push_back(folder);
-			return *folder;
+	protected:
+		// Make entries created in this folder, overridden by folders
+		// which make entries of other types
+		virtual file_t* _new_file(std::string_view name)
+		{
+			return new (resource) file_t(name, this, resource);
+		}
+
+		virtual folder_t* _new_folder(std::string_view name)
+		{
+			return new (resource) folder_t(name, this, resource);
+		}
+
+		// Add entries of lazily listed folder, called until it sets listed.
+		// Must add them with _add_entry_locked under write lock
+		virtual void _list()
+		{
+			listed.store(true, std::memory_order_release);
+		}
+
+		void _ensure_listed()
+		{
+			if (!listed.load(std::memory_order_acquire))
+			{
+				_list();
+			}
+		}
+
+		// Add new entry, must be called under write lock
+		void _add_entry_locked(base_entry* entry)
+		{
+			if (is_removed())
+			{
+				throw file_not_found_error();
+			}
+
+			if (!index.emplace(entry->get_folded_name(), entry).second)
+			{
+				throw file_exists_error();
+			}
+
+			try
+			{
+				entry->slot = static_cast<uint32_t>(entries.size());
+				entries.push_back(entry);
+			}
+			catch (...)
+			{
+				index.erase(entry->get_folded_name());
+				throw;
+			}
+		}
+
+		// Remove entry from folder, must be called under write lock.
+		// Folder's reference to entry is passed to caller
+		void _unlink_locked(base_entry* entry)
+		{
+			index.erase(entry->get_folded_name());
+			_remove_slot(entry);
+			entry->_mark_removed();
+			entry->parent = nullptr;
+		}
+
+		// Remove all entries of folder which is removed, recursively. Must be
+		// called under write lock, nothing can be added to folder after that
+		void _detach_locked()
+		{
+			_mark_removed();
+
+			for (base_entry* entry : entries)
+			{
+				if (entry->is_folder())
+				{
+					folder_t& folder = entry->as_folder();
+					write_lock lock(folder.entries_mutex);
+
+					folder._detach_locked();
+				}
+				else
+				{
+					entry->_mark_removed();
+				}
+
+				entry->parent = nullptr;
+				entry->_release();
+			}
+
+			entries.clear();
+			index.clear();
+			listed.store(true, std::memory_order_release);
+		}
+
+	private:
+		static void _count_lookup(size_t depth)
+		{
+			stats::add(counter::lookups);
+			stats::add(counter::lookup_depth, depth);
+		}
+
+		// Fill entry's slot with last entry, so entries aren't shifted
+		void _remove_slot(base_entry* entry)
+		{
+			base_entry* last = entries.back();
+
+			entries[entry->slot] = last;
+			last->slot = entry->slot;
+			entries.pop_back();
+		}
+
+		// "", "." and ".." can't be names of entries
+		static bool _is_special_name(std::string_view name)
+		{
+			return name.find_first_not_of('.') == std::string_view::npos && name.length() <= 2;
+		}
+
+		// Add new entry and retain it, deletes it if its name is already taken.
+		// Creation is recorded to logged before other threads can find
+		// the entry, so their records of it come after this one
+		template <class Entry>
+		entry_handle<Entry> _add_entry(Entry* entry, journal_scope* logged = nullptr,
+			journal_operation operation = journal_operation::create_file)
+		{
+			std::unique_ptr<base_entry> guard(entry);
+
+			_ensure_listed();
+			write_lock lock(entries_mutex);
+
+			_add_entry_locked(entry);
+			guard.release();
+
+			entry_handle<Entry> out(entry);
+
+			if (logged)
+			{
+				logged->record(operation, *entry);
+			}
+
+			return out;
 		}
 	};
 
+#ifdef VIRTFILES_FILE_STATS
+	// Up to count files under folder with most bytes read and written
+	// by streams, most used first. Not synchronized with modifications
+	inline std::vector<entry_handle<file_t>> hot_files(folder_t& folder, size_t count)
+	{
+		std::vector<entry_handle<file_t>> files;
+		std::vector<folder_t*> pending{ &folder };
+
+		while (!pending.empty())
+		{
+			folder_t& current = *pending.back();
+			pending.pop_back();
+
+			for (base_entry* entry : current.get_items())
+			{
+				if (entry->is_folder())
+				{
+					pending.push_back(&entry->as_folder());
+				}
+				else
+				{
+					files.emplace_back(&entry->as_file());
+				}
+			}
+		}
+
+		auto hotter = [](const entry_handle<file_t>& left, const entry_handle<file_t>& right)
+		{
+			return left->get_stats().traffic() > right->get_stats().traffic();
+		};
+
+		if (count < files.size())
+		{
+			std::partial_sort(files.begin(), files.begin() + count, files.end(), hotter);
+			files.resize(count);
+		}
+		else
+		{
+			std::sort(files.begin(), files.end(), hotter);
+		}
+
+		return files;
+	}
+#endif
+
+	inline journal* base_entry::_inherit_journal(folder_t* parent)
+	{
+		return parent ? parent->get_journal() : nullptr;
+	}
+
+	inline void dentry_cache::_retain(base_entry* entry)
+	{
+		entry->_retain();
+	}
+
+	inline void dentry_cache::_release(base_entry* entry)
+	{
+		entry->_release();
+	}
+
+	inline bool dentry_cache::_is_removed(const base_entry* entry)
+	{
+		return entry->is_removed();
+	}
+
+	inline size_t dentry_cache::_relink_count()
+	{
+		return folder_t::get_relink_count();
+	}
+
 	class filesystem
 	{
 	protected:
+		entry_arena arena; // allocates entries unless other resource is given
 		folder_t* root;
+		dentry_cache dentries;
+		journal* log; // owned, null if state isn't journaled
 	public:
 		folder_t* get_root() const
 		{
 			return root;
 		}
 
+		journal* get_journal() const
+		{
+			return log;
+		}
+
+		dentry_cache& get_dentry_cache()
+		{
+			return dentries;
+		}
+
+		entry_arena& get_arena()
+		{
+			return arena;
+		}
+
+		// Find entry by path from root, resolved paths are cached.
+		// Entry stays valid while it isn't removed, use acquire if it can be
+		base_entry& lookup(path_view path)
+		{
+			return *acquire(path);
+		}
+
+		// Find entry by path from root and retain it
+		entry_handle<base_entry> acquire(path_view path)
+		{
+			if (base_entry* entry = dentries.find(path.str()))
+			{
+				return entry_handle<base_entry>::adopt(entry);
+			}
+
+			size_t generation = dentries.get_generation();
+			entry_handle<base_entry> entry = root->acquire(path);
+			dentries.insert(path.str(), entry.get(), generation);
+
+			return entry;
+		}
+
+		file_t& createFile(path_view path, bool parents = false)
+		{
+			return *acquire_new_file(path, parents);
+		}
+
+		entry_handle<file_t> acquire_new_file(path_view path, bool parents = false)
+		{
+			size_t generation = dentries.get_generation();
+			entry_handle<file_t> file = root->acquire_new_file(path, parents);
+			dentries.insert(path.str(), file.get(), generation);
+
+			return file;
+		}
+
+		folder_t& createFolder(path_view path, bool parents = false)
+		{
+			size_t generation = dentries.get_generation();
+			entry_handle<folder_t> folder = root->acquire_new_folder(path, parents);
+			dentries.insert(path.str(), folder.get(), generation);
+
+			return *folder;
+		}
+
+		// Remove entry, see folder_t::remove. Cached paths are dropped
+		// by the next lookup, like after removals made by folders
+		void remove(path_view path, bool recursive = false)
+		{
+			root->remove(path, recursive);
+		}
+
+		// Move entry, see folder_t::rename
+		void rename(path_view from, path_view to)
+		{
+			root->rename(from, to);
+		}
+
 		filesystem()
-			: filesystem(new folder_t("."))
+			: root(new (&arena) folder_t(".", nullptr, &arena)), log(nullptr)
+		{
+			init();
+		}
+
+		// Entries are allocated from resource, which must outlive file system
+		explicit filesystem(std::pmr::memory_resource* resource)
+			: root(new (resource) folder_t(".", nullptr, resource)), log(nullptr)
 		{
+			init();
 		}
 
 		filesystem(folder_t* root)
-			: root(root)
+			: root(root), log(nullptr)
 		{
 			init();
 		}
 
+		// State is restored from journal file and its modifications
+		// are recorded to it, see virt_journal.h
+		explicit filesystem(const char* journal_path);
+		filesystem(const char* journal_path, const journal_options& options);
+
 		~filesystem()
 		{
 			before_uninit();
+			close_journal();
 
+			dentries.invalidate();
 			delete root;
 		}
 
@@ -474,6 +1774,21 @@ namespace virtfiles
 		filesystem& operator=(const filesystem&) = delete;
 		filesystem& operator=(filesystem&&) = delete;
 
+		// Add entries of image file to root, see virt_image.h
+		void load_image(const char* path);
+
+		// Write whole tree to image file, see virt_image.h
+		void save_image(const char* path);
+
+		// Restore state of empty file system from journal file and record
+		// its modifications to it, as constructor taking journal_path does.
+		// Lets the global fs be journaled, see virt_journal.h
+		void open_journal(const char* journal_path);
+		void open_journal(const char* journal_path, const journal_options& options);
+
+		// Commit records and stop journal, its file keeps the state
+		void close_journal();
+
 		void init();
 		void before_uninit();
 	};
@@ -1,22 +1,195 @@
 #pragma once
 
 #include <cstring>
+#include <iterator>
 #include <stdexcept>
 #include <string>
-#include <vector>
+#include <string_view>
 
 namespace virtfiles
 {
+	// Non-owning path, splits path string to parts on the fly
+	// without any copies or allocations
+	class path_view
+	{
+	protected:
+		std::string_view path;
+
+	public:
+		class iterator;
+
+		path_view()
+		{
+		}
+
+		path_view(const char* path)
+			: path(path)
+		{
+		}
+
+		path_view(const std::string& path)
+			: path(path)
+		{
+		}
+
+		path_view(std::string_view path)
+			: path(path)
+		{
+		}
+
+		std::string_view str() const
+		{
+			return path;
+		}
+
+		// Parts count, path always has at least one (maybe empty) part
+		size_t get_count() const
+		{
+			size_t count = 1;
+
+			for (char ch : path)
+			{
+				count += is_separator(ch);
+			}
+
+			return count;
+		}
+
+		// Last part of path
+		std::string_view filename() const
+		{
+			size_t sep = path.find_last_of("/\\");
+
+			return sep == std::string_view::npos ? path : path.substr(sep + 1);
+		}
+
+		static bool is_separator(char ch)
+		{
+			return ch == '/' || ch == '\\';
+		}
+
+		iterator begin() const;
+
+		iterator end() const;
+	};
+
+	class path_view::iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = std::string_view;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const std::string_view*;
+		using reference = const std::string_view&;
+
+	protected:
+		std::string_view part;
+		const char* path_end; // nullptr if iterator is at the end
+
+	public:
+		iterator()
+			: path_end(nullptr)
+		{
+		}
+
+		explicit iterator(std::string_view path)
+			: path_end(path.data() + path.size())
+		{
+			_find_end(path.data());
+		}
+
+		reference operator*() const
+		{
+			return part;
+		}
+
+		pointer operator->() const
+		{
+			return &part;
+		}
+
+		iterator& operator++()
+		{
+			const char* part_end = part.data() + part.size();
+
+			if (part_end == path_end) // it was last part
+			{
+				part = std::string_view();
+				path_end = nullptr;
+			}
+			else
+			{
+				_find_end(part_end + 1);
+			}
+
+			return *this;
+		}
+
+		iterator operator++(int)
+		{
+			iterator sav(*this);
+			++*this;
+			return sav;
+		}
+
+		bool operator==(const iterator& other) const
+		{
+			return path_end == other.path_end && part.data() == other.part.data();
+		}
+
+		bool operator!=(const iterator& other) const
+		{
+			return !(*this == other);
+		}
+
+		// If current part is the last one
+		bool is_last() const
+		{
+			return part.data() + part.size() == path_end;
+		}
+
+	private:
+		void _find_end(const char* part_start)
+		{
+			const char* i = part_start;
+
+			while (i < path_end && !path_view::is_separator(*i))
+			{
+				++i;
+			}
+
+			part = std::string_view(part_start, i - part_start);
+		}
+	};
+
+	inline path_view::iterator path_view::begin() const
+	{
+		return iterator(path);
+	}
+
+	inline path_view::iterator path_view::end() const
+	{
+		return iterator();
+	}
+
 	class path_t
 	{
 	public:
 		class parts_t
 		{
 		protected:
+			// Paths shorter than this are stored without heap allocations
+			static constexpr size_t inline_str_size = 256;
+			static constexpr size_t inline_items_count = 16;
+
 			const char* const* items;
 			size_t count;
-			const char* items_str;
+			const char* items_str; // parts separated by null characters
 			size_t str_size;
+			const char* path_str;  // original path
+
+			char inline_str[inline_str_size];
+			const char* inline_items[inline_items_count];
 
 		public:
 			class iterator;
@@ -31,22 +204,31 @@ namespace virtfiles
 				return items_str;
 			}
 
+			std::string_view path() const
+			{
+				return std::string_view(path_str, str_size);
+			}
+
 			parts_t()
-				: items(nullptr), count(0), items_str(nullptr), str_size(0)
+				: items(nullptr), count(0), items_str(nullptr), str_size(0), path_str(nullptr)
 			{
 			}
 
 			parts_t(const parts_t& other)
+				: parts_t()
 			{
-				init(other);
+				init(other.path());
 			}
 
 			parts_t(parts_t&& other) noexcept
-				: items(other.items), count(other.count),
-				items_str(other.items_str), str_size(other.str_size)
+				: parts_t()
 			{
-				other.items = nullptr;
-				other.items_str = nullptr;
+				_move(other);
+			}
+
+			~parts_t()
+			{
+				_free();
 			}
 
 			parts_t& operator=(const parts_t& other)
@@ -58,85 +240,153 @@ namespace virtfiles
 
 			parts_t& operator=(parts_t&& other) noexcept
 			{
-				items = other.items;
-				count = other.count;
-				items_str = other.items_str;
-				str_size = other.str_size;
-
-				other.items = nullptr;
-				other.items_str = nullptr;
+				if (this != &other)
+				{
+					_free();
+					_move(other);
+				}
 
 				return *this;
 			}
 
-			void init(const std::string& path)
+			void init(std::string_view path)
 			{
-				// Copy path string
-				str_size = path.length();
-				char* str = new char[str_size + 1] {};
-				items_str = str;
+				_free();
+
+				// Count parts
+				size_t parts_count = 1;
+
+				for (char ch : path)
+				{
+					parts_count += path_view::is_separator(ch);
+				}
+
+				// Both original path and parts are stored in one string
+				size_t size = path.size();
+				size_t storage_size = 2 * (size + 1);
+				char* str = storage_size <= inline_str_size ? inline_str : new char[storage_size];
+				const char** items = inline_items;
+
+				if (parts_count > inline_items_count)
+				{
+					try
+					{
+						items = new const char* [parts_count];
+					}
+					catch (...)
+					{
+						if (str != inline_str)
+						{
+							delete[] str;
+						}
 
-				memcpy(str, path.data(), str_size);
+						throw;
+					}
+				}
+
+				// Copy path string twice
+				memcpy(str, path.data(), size);
+				str[size] = 0;
+
+				char* parts = str + size + 1;
+				memcpy(parts, path.data(), size);
+				parts[size] = 0;
 
 				// First item starts at first string character
-				std::vector<const char*> out = { str };
+				size_t index = 0;
+				items[index++] = parts;
 
-				// Iterate over path
-				for (char* end_str = str + str_size; str < end_str; ++str)
+				for (size_t i = 0; i < size; ++i)
 				{
-					// If it's part separator
-					// then append new part
-					switch (*str)
+					if (path_view::is_separator(parts[i]))
 					{
-					case '/':
-					case '\\':
 						// Finish previous part by NULL character
-						*str = 0;
-						out.push_back(str + 1);
+						parts[i] = 0;
+						items[index++] = parts + i + 1;
 					}
 				}
 
-				// Copy vector to items
-				count = out.size();
-				const char** items;
-				this->items = items = new const char* [count];
-
-				memcpy(items, out.data(), count * sizeof(const char*));
+				this->items = items;
+				count = parts_count;
+				items_str = parts;
+				str_size = size;
+				path_str = str;
 			}
 
 			void init(const parts_t& other)
 			{
-				if (items_str)
+				if (this != &other)
+				{
+					init(other.path());
+				}
+			}
+
+			const char* const& operator[] (long long index) const
+			{
+				return items[index];
+			}
+
+			iterator begin() const;
+
+			iterator end() const;
+
+		private:
+			void _free()
+			{
+				if (path_str != inline_str)
+				{
+					delete[] path_str;
+				}
+
+				if (items != inline_items)
 				{
-					delete[] items_str;
 					delete[] items;
 				}
 
+				items = nullptr;
+				count = 0;
+				items_str = nullptr;
+				str_size = 0;
+				path_str = nullptr;
+			}
+
+			// Take heap storage of other, copy inline one
+			void _move(parts_t& other) noexcept
+			{
+				if (!other.path_str)
+				{
+					return;
+				}
+
 				count = other.count;
 				str_size = other.str_size;
 
-				const char** items;
-				this->items = items = new const char* [count];
+				if (other.path_str == other.inline_str)
+				{
+					memcpy(inline_str, other.inline_str, 2 * (str_size + 1));
+					path_str = inline_str;
+				}
+				else
+				{
+					path_str = other.path_str;
+				}
 
-				char* items_str;
-				this->items_str = items_str = new char[str_size];
+				items_str = path_str + str_size + 1;
+				items = other.items == other.inline_items ? inline_items : other.items;
 
-				memcpy(items_str, other.items_str, str_size);
+				// Parts may have moved
+				const char** my_items = const_cast<const char**>(items);
 
 				for (size_t i = 0; i < count; ++i)
 				{
-					items[i] = items_str + (other.items_str - other.items[i]);
+					my_items[i] = items_str + (other.items[i] - other.items_str);
 				}
-			}
 
-			const char* const& operator[] (long long index) const
-			{
-				return items[index];
+				// Other doesn't own anything now
+				other.path_str = nullptr;
+				other.items = nullptr;
+				other._free();
 			}
-
-			iterator begin() const;
-
-			iterator end() const;
 		};
 
 		parts_t parts;
@@ -153,12 +403,27 @@ namespace virtfiles
 			parts.init(path);
 		}
 
-		path_t& operator=(const std::string& path)
+		path_t(std::string_view path)
+		{
+			parts.init(path);
+		}
+
+		path_t& operator=(std::string_view path)
 		{
 			parts.init(path);
 
 			return *this;
 		}
+
+		path_view view() const
+		{
+			return path_view(parts.path());
+		}
+
+		operator path_view() const
+		{
+			return view();
+		}
 	};
 
 	class path_t::parts_t::iterator : public std::iterator<
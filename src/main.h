@@ -1,6 +1,10 @@
 #include "file_entries.h"
 #include "file_path.h"
 #include "virt_fstream.h"
+#include "virt_host.h"
+#include "virt_image.h"
+#include "virt_journal.h"
+#include "virt_tar.h"
 #include <locale>
 
 namespace virtfiles {
@@ -0,0 +1,250 @@
+#include "main.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef VIRTFILES_THREADSAFE
+#error "virtfiles_stress must be built with VIRTFILES_THREADSAFE defined"
+#endif
+
+namespace
+{
+	using stress_clock = std::chrono::steady_clock;
+
+	constexpr size_t files_per_thread = 2000;
+	constexpr size_t shared_files = 64;
+
+	std::atomic<size_t> errors{ 0 };
+
+	// Creates, writes and reads back own files, appends to files shared by all threads
+	void stress_worker(size_t round, size_t thread_index)
+	{
+		std::string dir = "stress/" + std::to_string(round) + "/t" + std::to_string(thread_index) + "/";
+		std::string shared_dir = "stress/" + std::to_string(round) + "/shared/";
+		std::string text = "thread " + std::to_string(thread_index) + " was here\n";
+
+		virtfiles::fs.get_root()->createFolder(dir + "sub", true);
+
+		for (size_t i = 0; i < files_per_thread; ++i)
+		{
+			std::string path = dir + "file" + std::to_string(i);
+
+			{
+				ofstream out(path);
+				out << text;
+			}
+
+			{
+				ifstream in(path);
+				std::string line;
+
+				if (!std::getline(in, line) || line + "\n" != text)
+				{
+					++errors;
+				}
+			}
+
+			{
+				ofstream out(shared_dir + "log" + std::to_string(i % shared_files), std::ios::app);
+				out << text;
+			}
+		}
+	}
+
+	// Every line threads appended to shared logs has to be there whole
+	void check_logs(size_t round, size_t threads)
+	{
+		std::string shared_dir = "stress/" + std::to_string(round) + "/shared/";
+		std::vector<std::string> texts;
+
+		for (size_t i = 0; i < threads; ++i)
+		{
+			texts.push_back("thread " + std::to_string(i) + " was here");
+		}
+
+		for (size_t log = 0; log < shared_files; ++log)
+		{
+			// Appended by each thread for each i of files_per_thread where i % shared_files == log
+			size_t expected = files_per_thread / shared_files + (log < files_per_thread % shared_files);
+			std::vector<size_t> lines(threads, 0);
+
+			ifstream in(shared_dir + "log" + std::to_string(log));
+			std::string line;
+
+			while (std::getline(in, line))
+			{
+				size_t i = 0;
+
+				while (i < threads && line != texts[i])
+				{
+					++i;
+				}
+
+				if (i == threads)
+				{
+					++errors; // torn or mixed line
+				}
+				else
+				{
+					++lines[i];
+				}
+			}
+
+			for (size_t count : lines)
+			{
+				if (count != expected)
+				{
+					++errors; // lost line
+				}
+			}
+		}
+	}
+
+	// Readers open config file while writer rewrites it, every read has to see
+	// one complete version of the file. Writer starts when all readers are
+	// running and goes on until each of them has read
+	void stress_snapshots(size_t readers)
+	{
+		constexpr size_t config_size = 64 * 1024;
+		constexpr size_t rewrites = 200;
+
+		std::atomic<bool> go{ false };
+		std::atomic<bool> done{ false };
+		std::atomic<size_t> ready{ 0 };
+		std::atomic<size_t> readers_done{ 0 }; // readers which have read once
+		std::atomic<size_t> reads{ 0 };
+		std::vector<std::thread> workers;
+
+		{
+			ofstream out("stress/config");
+			out << std::string(config_size, 'a');
+		}
+
+		for (size_t i = 0; i < readers; ++i)
+		{
+			workers.emplace_back([&]
+				{
+					std::string text;
+					bool counted = false;
+
+					++ready;
+
+					while (!go)
+					{
+						std::this_thread::yield();
+					}
+
+					while (!done)
+					{
+						ifstream in("stress/config");
+						std::getline(in, text);
+
+						if (text.size() != config_size
+							|| text.find_first_not_of(text[0]) != std::string::npos)
+						{
+							++errors;
+						}
+
+						if (!counted)
+						{
+							counted = true;
+							++readers_done;
+						}
+
+						++reads;
+					}
+				});
+		}
+
+		// Start readers and writer together
+		while (ready < readers)
+		{
+			std::this_thread::yield();
+		}
+
+		go = true;
+
+		auto start = stress_clock::now();
+		size_t rewritten = 0;
+
+		for (; rewritten < rewrites || readers_done < readers; ++rewritten)
+		{
+			// Not truncated on open, so content is replaced at once on close
+			fstream out("stress/config", std::ios::in | std::ios::out);
+			out << std::string(config_size, static_cast<char>('a' + rewritten % 26));
+		}
+
+		double elapsed = std::chrono::duration<double>(stress_clock::now() - start).count();
+		done = true;
+
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+
+		if (reads == 0)
+		{
+			++errors;
+		}
+
+		printf("snapshots: %zu readers  %zu rewrites in %9.3f ms  %zu reads\n",
+			readers, rewritten, elapsed * 1e3, reads.load());
+	}
+
+	double run_round(size_t round, size_t threads)
+	{
+		virtfiles::fs.get_root()->createFolder("stress/" + std::to_string(round) + "/shared", true);
+
+		std::vector<std::thread> workers;
+		auto start = stress_clock::now();
+
+		for (size_t i = 0; i < threads; ++i)
+		{
+			workers.emplace_back(stress_worker, round, i);
+		}
+
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+
+		double elapsed = std::chrono::duration<double>(stress_clock::now() - start).count();
+		check_logs(round, threads);
+
+		return elapsed;
+	}
+}
+
+int main()
+{
+	size_t max_threads = std::thread::hardware_concurrency();
+	double base_rate = 0;
+
+	if (max_threads < 4)
+	{
+		max_threads = 4;
+	}
+
+	for (size_t threads = 1, round = 0; threads <= max_threads; threads *= 2, ++round)
+	{
+		double elapsed = run_round(round, threads);
+		double rate = threads * files_per_thread * 3 / elapsed;
+
+		if (threads == 1)
+		{
+			base_rate = rate;
+		}
+
+		printf("threads: %3zu  %9.3f ms  %10.0f opens/s  scaling %5.2fx\n",
+			threads, elapsed * 1e3, rate, rate / base_rate);
+	}
+
+	stress_snapshots(max_threads);
+
+	printf("errors: %zu\n", errors.load());
+
+	return errors != 0;
+}
@@ -0,0 +1,1144 @@
+#include "main.h"
+#include <cstdio>
+#include <cstring>
+#include <locale>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace
+{
+	size_t failures = 0;
+
+	void check(bool passed, const char* what)
+	{
+		if (!passed)
+		{
+			printf("FAILED: %s\n", what);
+			++failures;
+		}
+	}
+
+	// Path naming a file followed by a separator is rejected
+	// whether it was resolved before or not
+	void test_trailing_separator()
+	{
+		virtfiles::fs.get_root()->createFile("trailing.txt");
+
+		check(!ifstream("trailing.txt/").is_open(), "file path with trailing separator opens while cache is cold");
+		check(ifstream("trailing.txt").is_open(), "file doesn't open");
+		check(!ifstream("trailing.txt/").is_open(), "file path with trailing separator opens while cache is warm");
+		check(!ifstream("trailing.txt/.").is_open(), "file path with trailing dot opens while cache is warm");
+
+		virtfiles::fs.get_root()->createFolder("trailing");
+		virtfiles::fs.get_root()->createFile("trailing/inner.txt");
+
+		check(ifstream("trailing//inner.txt").is_open(), "path with double separator doesn't open");
+		check(ifstream("./trailing/inner.txt").is_open(), "path with leading dot doesn't open");
+		check(virtfiles::fs.lookup("trailing/").is_folder(), "folder path with trailing separator isn't resolved");
+		check(virtfiles::fs.lookup("trailing").is_folder(), "folder isn't resolved");
+	}
+
+	std::string read_file(const char* path)
+	{
+		ifstream in(path);
+		std::string content;
+		std::getline(in, content, '\0');
+
+		return content;
+	}
+
+	// Paths of entries moved or removed by folders themselves aren't
+	// resolved from cache of global file system
+	void test_folder_level_move()
+	{
+		virtfiles::folder_t& folder = virtfiles::fs.get_root()->createFolder("moves");
+		folder.createFolder("sub");
+
+		{
+			ofstream out("moves/a.txt");
+			out << "moved";
+		}
+
+		check(virtfiles::fs.lookup("moves/sub").is_folder(), "folder isn't resolved");
+
+		folder.rename("a.txt", "b.txt");
+		check(!ifstream("moves/a.txt").is_open(), "file opens at path it was moved from");
+
+		{
+			ofstream out("moves/a.txt");
+			out << "new";
+		}
+
+		check(read_file("moves/b.txt") == "moved", "moved file is written at its old path");
+		check(read_file("moves/a.txt") == "new", "file isn't created at path other was moved from");
+
+		folder.remove("a.txt");
+		check(!ifstream("moves/a.txt").is_open(), "removed file opens");
+
+		folder.rename("sub", "renamed");
+
+		try
+		{
+			virtfiles::fs.lookup("moves/sub");
+			check(false, "folder is resolved at path it was moved from");
+		}
+		catch (const virtfiles::filesystem_exception&)
+		{
+		}
+	}
+
+	// Expects operation to throw Error
+	template <class Error, class Operation>
+	void check_throws(Operation operation, const char* what)
+	{
+		try
+		{
+			operation();
+			check(false, what);
+		}
+		catch (const Error&)
+		{
+		}
+	}
+
+	// Entries are moved over others as rename() does, and stay valid
+	// for their holders when they are replaced or removed
+	void test_relinking()
+	{
+		virtfiles::filesystem tree;
+		virtfiles::folder_t& root = *tree.get_root();
+
+		root.createFile("one.txt").writeBytes("one");
+		root.createFile("two.txt").writeBytes("two");
+		root.createFolder("full/inner", true);
+		root.createFolder("empty");
+
+		virtfiles::entry_handle<virtfiles::file_t> replaced = root.acquire_new_file("replaced.txt");
+		replaced->writeBytes("old");
+
+		root.rename("one.txt", "replaced.txt");
+		check(root.get_entry("replaced.txt")->as_file().getContent() == "one", "file isn't replaced by moved one");
+		check(replaced->getContent() == "old" && replaced->is_removed(), "replaced file isn't kept for its holder");
+
+		root.rename("replaced.txt", "REPLACED.TXT");
+		check(root.get_entry("replaced.txt")->get_name() == std::string("REPLACED.TXT"), "case of name isn't changed");
+
+		root.rename("full", "empty");
+		check(root.get_entry("empty")->as_folder().get_entry("inner")->is_folder(), "empty folder isn't replaced by moved one");
+
+		root.createFolder("other");
+		check_throws<virtfiles::directory_not_empty_error>([&] { root.rename("other", "empty"); }, "folder replaces one with entries");
+		check_throws<virtfiles::invalid_path_error>([&] { root.rename("empty", "empty/inner/moved"); }, "folder is moved into itself");
+		check_throws<virtfiles::permission_error>([&] { root.rename("two.txt", "other"); }, "file replaces folder");
+		check_throws<virtfiles::not_a_directory_error>([&] { root.rename("other", "two.txt"); }, "folder replaces file");
+		check_throws<virtfiles::file_not_found_error>([&] { root.rename("missing", "found"); }, "missing entry is moved");
+
+		root.rename("two.txt", "empty/inner/two.txt");
+		check(tree.lookup("empty/inner/two.txt").as_file().getContent() == "two", "file isn't moved to other folder");
+		check(tree.lookup("empty/inner/two.txt").get_parent() == &tree.lookup("empty/inner").as_folder(), "parent of moved file isn't changed");
+
+		check_throws<virtfiles::directory_not_empty_error>([&] { root.remove("empty"); }, "folder with entries is removed");
+
+		virtfiles::entry_handle<virtfiles::base_entry> held = root.acquire("empty/inner/two.txt");
+		root.remove("empty", true);
+		check(held->is_removed() && held->as_file().getContent() == "two", "file of removed folder isn't kept for its holder");
+		check_throws<virtfiles::file_not_found_error>([&] { root.get_entry("empty"); }, "removed folder is found");
+	}
+
+	// Cached paths don't outlive removal or rename of folders they go
+	// through, including by ".."
+	void test_stale_paths()
+	{
+		virtfiles::folder_t& folder = virtfiles::fs.get_root()->createFolder("stale");
+		folder.createFolder("x");
+		folder.createFolder("old");
+		folder.createFile("y.txt");
+		virtfiles::fs.get_root()->createFile("stale/old/z.txt");
+
+		check(ifstream("stale/x/../y.txt").is_open(), "path with dot dot doesn't open");
+		check(ifstream("stale/old/z.txt").is_open(), "file in folder doesn't open");
+
+		folder.remove("x");
+		check(!ifstream("stale/x/../y.txt").is_open(), "path through removed folder opens");
+
+		folder.rename("old", "new");
+		check(!ifstream("stale/old/z.txt").is_open(), "path through renamed folder opens");
+		check(ifstream("stale/new/z.txt").is_open(), "file in renamed folder doesn't open");
+	}
+
+	// Entries are found by name in any case, through index of folded names
+	void test_folded_index()
+	{
+		virtfiles::folder_t& folder = virtfiles::fs.get_root()->createFolder("index");
+		const size_t count = 300;
+		size_t found = 0;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			folder.createFile("File" + std::to_string(i));
+		}
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			virtfiles::base_entry* entry = folder.get_entry("fILE" + std::to_string(i));
+			found += entry == folder.get_entry("file" + std::to_string(i)) && entry->is_named("FILE" + std::to_string(i));
+		}
+
+		check(found == count, "entry isn't found by name in other case");
+		check(folder.get_items().size() == count, "folder doesn't list all its entries");
+
+		try
+		{
+			folder.createFile("FILE7");
+			check(false, "name taken in other case is created again");
+		}
+		catch (const virtfiles::file_exists_error&)
+		{
+		}
+
+		folder.remove("file7");
+		folder.createFile("FILE7");
+		check(folder.get_entry("File7")->get_name() == std::string("FILE7"), "entry doesn't keep case of its name");
+
+		// Folded key of long name doesn't fit on stack
+		std::string long_name(600, 'N');
+		folder.createFolder(long_name);
+		check(folder.get_entry(std::string(600, 'n'))->is_folder(), "entry with long name isn't found in other case");
+	}
+
+	// Eviction passes over paths found since the hand passed them
+	void test_cache_eviction()
+	{
+		virtfiles::folder_t& folder = virtfiles::fs.get_root()->createFolder("eviction");
+		virtfiles::base_entry* a = &folder.createFile("a");
+		virtfiles::base_entry* b = &folder.createFile("b");
+		virtfiles::base_entry* c = &folder.createFile("c");
+
+		virtfiles::dentry_cache cache(2);
+		cache.insert("a", a, cache.get_generation());
+		cache.insert("b", b, cache.get_generation());
+
+		using handle = virtfiles::entry_handle<virtfiles::base_entry>;
+
+		check(handle::adopt(cache.find("a")).get() == a, "cached path isn't found");
+
+		cache.insert("c", c, cache.get_generation());
+		check(cache.size() == 2, "cache grows past its capacity");
+		check(handle::adopt(cache.find("a")).get() == a, "recently found path is evicted");
+
+		check(cache.find("b") == nullptr, "path which wasn't found is kept");
+		check(cache.get_hits() == 2 && cache.get_misses() == 1, "hits and misses aren't counted");
+	}
+
+	// Exported tree is imported back with its folders, long paths and contents
+	void test_tar_round_trip()
+	{
+		const std::string long_folder(80, 'f');
+		const std::string long_name(120, 'n'); // path doesn't fit to name and prefix
+		std::ostringstream archive;
+
+		{
+			virtfiles::filesystem tree;
+			tree.createFolder("empty");
+			tree.createFile("a/b/c.txt", true).writeBytes("nested");
+			tree.createFile("a/none", true);
+			tree.createFile(long_folder + "/" + std::string(60, 'p'), true).writeBytes("prefixed");
+			tree.createFile(long_folder + "/" + long_name, true).writeBytes(std::string(1000, 'z'));
+
+			virtfiles::export_tar(*tree.get_root(), archive);
+		}
+
+		check(archive.str().size() % virtfiles::tar::block_size == 0, "archive isn't made of blocks");
+
+		virtfiles::filesystem tree;
+		tree.createFile("a/b/c.txt", true).writeBytes("overwritten");
+
+		std::istringstream in(archive.str());
+		virtfiles::import_tar(*tree.get_root(), in);
+
+		check(tree.lookup("empty").is_folder() && tree.lookup("empty").as_folder().get_items().empty(), "empty folder isn't imported");
+		check(tree.lookup("a/b/c.txt").as_file().getContent() == "nested", "existing file isn't overwritten by archived one");
+		check(tree.lookup("a/none").as_file().getSize() == 0, "empty file isn't imported");
+		check(tree.lookup(long_folder + "/" + std::string(60, 'p')).as_file().getContent() == "prefixed", "path split to prefix isn't imported");
+		check(tree.lookup(long_folder + "/" + long_name).as_file().getContent() == std::string(1000, 'z'), "pax path isn't imported");
+	}
+
+	// Archive made by GNU tar, with long name entries, old folder entries
+	// and entries which have no place in virtual tree
+	void test_tar_gnu_import()
+	{
+		namespace tar = virtfiles::tar;
+		const std::string long_path = "gnu/" + std::string(150, 'l');
+		std::ostringstream archive;
+
+		auto entry = [&archive](const char* name, char type, const std::string& content)
+		{
+			tar::header head{};
+			memcpy(head.name, name, strlen(name));
+			tar::detail::write_octal(head.mode, sizeof(head.mode), 0644);
+			tar::detail::write_octal(head.size, sizeof(head.size), content.size());
+			head.typeflag = type;
+
+			tar::detail::write_block(archive, head);
+
+			archive << content;
+			tar::detail::write_padding(archive, content.size());
+		};
+
+		entry("././@LongLink", 'L', long_path + '\0');
+		entry("gnu/truncated", '0', "long");
+		entry("old/", '0', "");
+		entry("pax_global_header", 'g', "20 comment=ignored\n");
+		entry("link", '2', "");
+		entry("gnu/short", '0', "short");
+		archive << std::string(2 * tar::block_size, '\0');
+
+		virtfiles::filesystem tree;
+		std::istringstream in(archive.str());
+		virtfiles::import_tar(*tree.get_root(), in);
+
+		check(tree.lookup(long_path).as_file().getContent() == "long", "GNU long name isn't imported");
+		check(tree.lookup("old").is_folder(), "folder marked by separator isn't imported");
+		check(tree.lookup("gnu/short").as_file().getContent() == "short", "entry after skipped ones isn't imported");
+		check(tree.get_root()->get_items().size() == 2, "link or global header is imported as entry");
+	}
+
+	// Imports archive which declares entry size far bigger than it is
+	bool imports_as_truncated(const std::string& archive)
+	{
+		virtfiles::filesystem tree;
+		std::istringstream in(archive);
+
+		try
+		{
+			virtfiles::import_tar(*tree.get_root(), in);
+		}
+		catch (const virtfiles::invalid_archive_error&)
+		{
+			return true;
+		}
+		catch (const std::bad_alloc&)
+		{
+		}
+
+		return false;
+	}
+
+	// Size declared by archive doesn't allocate memory before content is read
+	void test_tar_oversized_entry()
+	{
+		namespace tar = virtfiles::tar;
+		const uint64_t huge = uint64_t{ 1 } << 46;
+		const std::string content(3000, 'x');
+
+		std::ostringstream pax;
+		tar::detail::write_header(pax, "huge.bin", '0', huge);
+		pax << content;
+
+		check(imports_as_truncated(pax.str()), "entry with huge pax size isn't rejected as truncated");
+
+		tar::header head{};
+		memcpy(head.name, "huge.bin", 8);
+		tar::detail::write_octal(head.mode, sizeof(head.mode), 0644);
+		head.typeflag = '0';
+		head.size[0] = static_cast<char>(0x80); // base-256
+
+		for (size_t i = 0; i < 8; ++i)
+		{
+			head.size[sizeof(head.size) - 1 - i] = static_cast<char>(huge >> (i * 8));
+		}
+
+		std::ostringstream base256;
+		tar::detail::write_block(base256, head);
+		base256 << content;
+
+		check(imports_as_truncated(base256.str()), "entry with huge base-256 size isn't rejected as truncated");
+	}
+
+	// Flush writes only ranges modified through stream, so other changes
+	// of the file made meanwhile are kept
+	void test_dirty_ranges()
+	{
+		using virtfiles::counter;
+		using virtfiles::stats;
+
+		virtfiles::file_t& file = virtfiles::fs.get_root()->createFile("dirty.txt");
+		file.writeBytes(std::string(100, 'a'));
+
+		{
+			fstream both("dirty.txt", std::ios_base::in | std::ios_base::out);
+			file.writeAt(50, "ZZ", 2); // not through stream
+
+			virtfiles::stats_snapshot before = stats::snapshot();
+
+			both.seekp(10);
+			both << "XY";
+			both.flush();
+
+			check((stats::snapshot() - before)[counter::bytes_written] == 2, "unmodified content is written by flush");
+		}
+
+		std::string expected(100, 'a');
+		expected.replace(10, 2, "XY");
+		expected.replace(50, 2, "ZZ");
+
+		check(file.getContent() == expected, "flush overwrites content it didn't modify");
+
+		{
+			// More ranges than are tracked apart, and write past the end
+			fstream both("dirty.txt", std::ios_base::in | std::ios_base::out);
+
+			for (int i = 0; i < 12; ++i)
+			{
+				both.seekp(i * 8);
+				both << 'x';
+				expected[i * 8] = 'x';
+			}
+
+			both.seekp(98);
+			both << "tail";
+			expected.replace(98, 2, "tail");
+		}
+
+		check(file.getContent() == expected, "content modified at many places isn't written");
+	}
+
+	// Read-only stream reads file content an extent at a time,
+	// it sees content of the file as it was when it was opened
+	void test_windowed_reads()
+	{
+		virtfiles::file_t& file = virtfiles::fs.get_root()->createFile("windowed.txt");
+		std::string expected;
+
+		for (int i = 0; i < 2000; ++i)
+		{
+			std::string line = std::to_string(i) + "\n";
+			file.appendBytes(line);
+			expected += line;
+		}
+
+		check(file.snapshot().get_extent_count() > 2, "appends don't make several extents");
+
+		size_t first_window = file.snapshot().get_extent(0).size();
+
+		ifstream in("windowed.txt");
+		file.writeBytes("replaced"); // after open
+
+		std::string content(expected.size() + 10, '\0');
+		in.read(&content[0], content.size());
+		content.resize(static_cast<size_t>(in.gcount()));
+		check(content == expected, "stream doesn't read content it was opened with");
+
+		size_t boundary = expected.size() / 2;
+		in.clear();
+
+		for (size_t pos : { boundary, size_t{ 1 }, expected.size() - 1, size_t{ 0 } })
+		{
+			in.seekg(static_cast<std::streamoff>(pos));
+			check(in.get() == expected[pos] && static_cast<size_t>(in.tellg()) == pos + 1, "seek across windows misplaces stream");
+		}
+
+		// Put back every char, including first ones of windows
+		in.seekg(0);
+		size_t ungets = 0;
+
+		for (size_t i = 0; i < expected.size(); ++i)
+		{
+			in.get();
+
+			if (in.unget().get() == expected[i])
+			{
+				++ungets;
+			}
+		}
+
+		check(ungets == expected.size(), "char put back isn't read again");
+
+		// From start of second window back to end of the first one
+		in.seekg(static_cast<std::streamoff>(first_window + 1));
+		in.unget().unget();
+		check(in.get() == expected[first_window - 1], "char of previous window isn't put back");
+
+		ifstream at_end("windowed.txt", std::ios_base::ate);
+		check(static_cast<size_t>(at_end.tellg()) == file.getSize(), "stream opened at end isn't there");
+	}
+
+	// Keeps each element in two bytes, high one first, so content
+	// of file is twice as long as text of stream
+	class two_byte_cvt
+		: public std::codecvt<wchar_t, char, std::mbstate_t>
+	{
+	protected:
+		result do_out(state_type&, const wchar_t* from, const wchar_t* from_end, const wchar_t*& from_next,
+			char* to, char* to_end, char*& to_next) const override
+		{
+			for (; from != from_end && to_end - to >= 2; ++from)
+			{
+				*to++ = static_cast<char>((*from >> 8) & 0xFF);
+				*to++ = static_cast<char>(*from & 0xFF);
+			}
+
+			from_next = from;
+			to_next = to;
+
+			return from == from_end ? ok : partial;
+		}
+
+		result do_in(state_type&, const char* from, const char* from_end, const char*& from_next,
+			wchar_t* to, wchar_t* to_end, wchar_t*& to_next) const override
+		{
+			for (; from_end - from >= 2 && to != to_end; from += 2)
+			{
+				*to++ = static_cast<wchar_t>(static_cast<unsigned char>(from[0]) << 8 | static_cast<unsigned char>(from[1]));
+			}
+
+			from_next = from;
+			to_next = to;
+
+			return from == from_end ? ok : partial;
+		}
+
+		result do_unshift(state_type&, char* to, char*, char*& to_next) const override
+		{
+			to_next = to;
+			return noconv;
+		}
+
+		int do_encoding() const noexcept override
+		{
+			return 2;
+		}
+
+		bool do_always_noconv() const noexcept override
+		{
+			return false;
+		}
+
+		int do_length(state_type&, const char* from, const char* from_end, size_t max) const override
+		{
+			size_t count = static_cast<size_t>(from_end - from) / 2;
+
+			return static_cast<int>((count < max ? count : max) * 2);
+		}
+
+		int do_max_length() const noexcept override
+		{
+			return 2;
+		}
+	};
+
+	// Content converted by facet which changes its size is written, appended
+	// and read back whole, though it's converted by parts
+	void test_codecvt_streams()
+	{
+		std::locale two_byte(std::locale::classic(), new two_byte_cvt);
+		std::wstring text;
+
+		for (size_t i = 0; i < 50000; ++i)
+		{
+			text += static_cast<wchar_t>(0x100 + i % 500);
+		}
+
+		{
+			virtfiles::wofstream out;
+			out.imbue(two_byte);
+			out.open("converted.txt");
+			out << text;
+		}
+
+		const virtfiles::file_t& file = virtfiles::fs.lookup("converted.txt").as_file();
+		std::string content = file.getContent();
+
+		check(content.size() == text.size() * 2 && content.compare(0, 4, std::string("\x01\x00\x01\x01", 4)) == 0, "text isn't converted to file");
+
+		{
+			virtfiles::wofstream out;
+			out.imbue(two_byte);
+			out.open("converted.txt", std::ios_base::app);
+			out << L"end";
+		}
+
+		check(file.getSize() == (text.size() + 3) * 2, "appended text isn't converted to file");
+
+		virtfiles::wifstream in;
+		in.imbue(two_byte);
+		in.open("converted.txt");
+
+		std::wstring read;
+		std::getline(in, read, L'\0');
+
+		check(read == text + L"end", "file isn't converted back to text");
+	}
+
+	// Long ASCII runs, converted by vector instructions where they are
+	// available, and multibyte chars between them are transcoded exactly
+	void test_utf8_transcoding()
+	{
+		namespace utf8 = virtfiles::utf8;
+
+		std::u32string text;
+		std::string encoded;
+
+		for (size_t i = 0; i < 300; ++i)
+		{
+			text.append(37 + i % 40, static_cast<char32_t>('a' + i % 26));
+			encoded.append(37 + i % 40, static_cast<char>('a' + i % 26));
+
+			text += U"\u00E9\u20AC\U0001F600";
+			encoded += "\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80";
+		}
+
+		std::string bytes(text.size() * 4, '\0');
+		utf8::result out = utf8::encode(text.data(), text.size(), &bytes[0], bytes.size());
+		bytes.resize(out.written);
+
+		check(out.code == utf8::status::ok && out.read == text.size() && bytes == encoded, "text isn't encoded to UTF-8");
+
+		std::u32string chars(encoded.size(), U'\0');
+		utf8::result in = utf8::decode(encoded.data(), encoded.size(), &chars[0], chars.size());
+		chars.resize(in.written);
+
+		check(in.code == utf8::status::ok && in.read == encoded.size() && chars == text, "UTF-8 isn't decoded to text");
+
+		char32_t small[4];
+		in = utf8::decode("ab\xFF" "cd", 5, small, 4);
+		check(in.code == utf8::status::invalid && in.read == 2 && in.written == 2, "invalid byte isn't reported where it is");
+
+		in = utf8::decode("ab\xE2\x82", 4, small, 4);
+		check(in.code == utf8::status::incomplete && in.read == 2, "char cut at end isn't reported as incomplete");
+
+		in = utf8::decode("abc", 3, small, 1);
+		check(in.code == utf8::status::output_full && in.read == 1 && in.written == 1, "full output isn't reported");
+
+		// Wide streams use transcoder for UTF-8 locale, if their elements are UTF-32
+		std::locale utf8_locale;
+
+		if (sizeof(wchar_t) != 4)
+		{
+			return;
+		}
+
+		try
+		{
+			utf8_locale = std::locale("C.UTF-8");
+		}
+		catch (const std::runtime_error&)
+		{
+			return;
+		}
+
+		std::wstring wide(text.begin(), text.end());
+
+		{
+			virtfiles::wofstream stream;
+			stream.imbue(utf8_locale);
+			stream.open("utf8.txt");
+			stream << wide;
+		}
+
+		check(virtfiles::fs.lookup("utf8.txt").as_file().getContent() == encoded, "wide stream doesn't write UTF-8");
+
+		virtfiles::wifstream stream;
+		stream.imbue(utf8_locale);
+		stream.open("utf8.txt");
+
+		std::wstring read;
+		std::getline(stream, read, L'\0');
+		check(read == wide, "wide stream doesn't read UTF-8");
+	}
+
+	// Buffer given by setbuf is used only if the whole buffer fits it
+	void test_setbuf_capacity()
+	{
+		char small[100] = {};
+		char big[1024] = {};
+
+		{
+			ofstream out("setbuf.txt");
+			out << "0123456789";
+
+			out.rdbuf()->pubsetbuf(small, sizeof(small)); // buffer has 256 elements
+			out << "abc";
+			check(small[0] == 0, "buffer smaller than current one is used");
+
+			out.rdbuf()->pubsetbuf(big, sizeof(big));
+			out << "def";
+			check(std::string(big) == "0123456789abcdef", "buffer given by setbuf isn't used");
+		}
+
+		check(read_file("setbuf.txt") == "0123456789abcdef", "content of buffer given by setbuf isn't written");
+	}
+
+	// Buffer reserve goes with state of filebuf when it's moved or swapped
+	void test_filebuf_reserve_moves()
+	{
+		using filebuf = virtfiles::basic_filebuf<char>;
+
+		filebuf first;
+		first.set_buffer_reserve(1000);
+
+		filebuf moved(std::move(first));
+		check(moved.get_buffer_reserve() == 1000, "move construction loses buffer reserve");
+
+		filebuf assigned;
+		assigned = std::move(moved);
+		check(assigned.get_buffer_reserve() == 1000, "move assignment loses buffer reserve");
+
+		filebuf other;
+		other.set_buffer_reserve(2000);
+		assigned.swap(other);
+		check(assigned.get_buffer_reserve() == 2000 && other.get_buffer_reserve() == 1000, "swap doesn't exchange buffer reserves");
+	}
+
+	// Only elements streams hand to reader are counted as read, not
+	// content loaded by open or seeks
+	void test_bytes_read()
+	{
+		using virtfiles::counter;
+		using virtfiles::stats;
+
+		{
+			ofstream out("counted.txt");
+			out << std::string(100, 'x');
+		}
+
+		virtfiles::stats_snapshot before = stats::snapshot();
+
+		{
+			fstream both("counted.txt", std::ios_base::in | std::ios_base::out | std::ios_base::app);
+			both << "y";
+		}
+
+		check((stats::snapshot() - before)[counter::bytes_read] == 0, "content loaded by open is counted as read");
+
+		{
+			ifstream in("counted.txt");
+			char part[10];
+
+			in.read(part, sizeof(part));
+			in.get();
+			in.seekg(0);
+			in.read(part, 5);
+			in.seekg(-2, std::ios_base::end);
+		}
+
+		check((stats::snapshot() - before)[counter::bytes_read] == 16, "read and get aren't counted as read");
+
+		{
+			ifstream in("counted.txt");
+			std::string word;
+			in >> word;
+		}
+
+		check((stats::snapshot() - before)[counter::bytes_read] == 16 + 101, "extraction isn't counted as read");
+	}
+
+#ifdef VIRTFILES_FILE_STATS
+	// Files count I/O of their streams, hot_files orders them by it
+	void test_file_stats()
+	{
+		virtfiles::folder_t& folder = virtfiles::fs.get_root()->createFolder("file_stats");
+
+		{
+			ofstream out("file_stats/hot.txt");
+			out << std::string(100, 'h');
+		}
+
+		{
+			ofstream out("file_stats/cold.txt");
+			out << "cold";
+		}
+
+		for (int i = 0; i < 2; ++i)
+		{
+			ifstream in("file_stats/hot.txt");
+			std::string content;
+			in >> content;
+		}
+
+		ifstream("file_stats/cold.txt"); // opened, not read
+
+		const virtfiles::file_stats& hot = folder.get_entry("hot.txt")->as_file().get_stats();
+		const virtfiles::file_stats& cold = folder.get_entry("cold.txt")->as_file().get_stats();
+
+		check(hot.opens == 3 && cold.opens == 2, "opens of file aren't counted");
+		check(hot.bytes_written == 100 && cold.bytes_written == 4, "bytes written to file aren't counted");
+		check(hot.bytes_read == 200 && cold.bytes_read == 0, "bytes read from file aren't counted");
+		check(hot.flushes == 1 && cold.flushes == 1, "flushes of file aren't counted");
+		check(hot.traffic() == 300, "traffic of file isn't sum of its reads and writes");
+
+		std::vector<virtfiles::entry_handle<virtfiles::file_t>> files = virtfiles::hot_files(folder, 1);
+		check(files.size() == 1 && files[0]->get_name() == std::string("hot.txt"), "hot file isn't found first");
+	}
+#endif
+
+#ifdef VIRTFILES_TRACE
+	// Traced operations are counted to histograms of their points and
+	// captured as events while capture is on
+	void test_trace()
+	{
+		using virtfiles::latency_histogram;
+		using virtfiles::trace_point;
+		using virtfiles::tracer;
+
+		check(latency_histogram::bucket_of(15) == 15 && latency_histogram::bucket_floor(15) == 15, "small latency isn't kept exactly");
+
+		for (uint64_t value : { uint64_t{ 16 }, uint64_t{ 1000 }, uint64_t{ 123456789 } })
+		{
+			size_t bucket = latency_histogram::bucket_of(value);
+
+			check(latency_histogram::bucket_floor(bucket) <= value && value < latency_histogram::bucket_floor(bucket + 1),
+				"latency is out of its bucket");
+		}
+
+		tracer::reset();
+		tracer::start_capture(4);
+
+		for (int i = 0; i < 3; ++i)
+		{
+			ofstream out("traced.txt");
+			out << "traced";
+		}
+
+		tracer::stop_capture();
+
+		check(tracer::histogram(trace_point::open).count() == 3, "opens aren't traced");
+		check(tracer::histogram(trace_point::close).count() == 3, "closes aren't traced");
+		check(tracer::histogram(trace_point::create_file).count() == 1, "creation of file isn't traced");
+
+		latency_histogram opens = tracer::histogram(trace_point::open);
+		check(opens.min() <= opens.max() && opens.percentile(50) <= opens.max(), "percentile is past maximum");
+
+		check(tracer::get_events().size() == 4, "capture doesn't keep its capacity of events");
+		check(tracer::get_dropped() != 0, "events past capacity aren't counted as dropped");
+
+		std::ostringstream trace;
+		tracer::write_chrome_trace(trace);
+		check(trace.str().find("\"name\":\"open\"") != std::string::npos, "captured open isn't written");
+
+		ifstream("traced.txt");
+		check(tracer::get_events().size() == 4, "operation after capture stopped is captured");
+	}
+#endif
+
+#ifdef VIRTFILES_JOURNAL
+	// Global file system, which streams use, can be journaled once
+	// it's set up, and its state is restored from the journal
+	void test_global_journal()
+	{
+		const char* path = "tests_journal.vfj";
+		std::remove(path);
+
+		virtfiles::fs.open_journal(path);
+
+		{
+			ofstream out("journaled.txt");
+			out << "recorded";
+		}
+
+		try
+		{
+			virtfiles::fs.open_journal(path);
+			check(false, "second journal opens");
+		}
+		catch (const virtfiles::filesystem_exception&)
+		{
+		}
+
+		virtfiles::fs.close_journal();
+
+		{
+			virtfiles::filesystem restored(path);
+			char content[16] = {};
+			size_t size = restored.lookup("journaled.txt").as_file().readBytes(0, content, sizeof(content));
+
+			check(std::string(content, size) == "recorded", "stream write to global file system isn't restored");
+		}
+
+		try
+		{
+			virtfiles::fs.open_journal(path);
+			check(false, "journal opens for file system which has entries");
+		}
+		catch (const virtfiles::directory_not_empty_error&)
+		{
+		}
+
+		std::remove(path);
+	}
+
+#ifdef VIRTFILES_THREADSAFE
+	// File written by other thread as soon as it's created is restored,
+	// its creation is recorded before the write
+	void test_journal_create_then_write()
+	{
+		const char* path = "tests_journal_race.vfj";
+		const size_t count = 2000;
+		char name[32];
+
+		std::remove(path);
+
+		{
+			virtfiles::journal_options options;
+			options.wait_for_commit = false;
+
+			virtfiles::filesystem tree(path, options);
+			virtfiles::folder_t& root = *tree.get_root();
+
+			std::thread writer([&root, count]
+			{
+				char name[32];
+
+				for (size_t i = 0; i < count; ++i)
+				{
+					snprintf(name, sizeof(name), "f%zu", i);
+
+					while (true)
+					{
+						try
+						{
+							root.acquire_entry(name)->as_file().writeBytes("written");
+							break;
+						}
+						catch (const virtfiles::file_not_found_error&)
+						{
+							std::this_thread::yield();
+						}
+					}
+				}
+			});
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				snprintf(name, sizeof(name), "f%zu", i);
+				root.createFile(name);
+			}
+
+			writer.join();
+		}
+
+		try
+		{
+			virtfiles::filesystem restored(path);
+			size_t written = 0;
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				snprintf(name, sizeof(name), "f%zu", i);
+				written += restored.lookup(name).as_file().getSize() == 7;
+			}
+
+			check(written == count, "write to new file isn't restored");
+		}
+		catch (const virtfiles::filesystem_exception&)
+		{
+			check(false, "journal with writes to new files doesn't replay");
+		}
+
+		std::remove(path);
+	}
+#endif
+#endif
+
+	std::string read_host_file(const char* path)
+	{
+		std::string content;
+
+		if (FILE* file = std::fopen(path, "rb"))
+		{
+			for (int ch; (ch = std::fgetc(file)) != EOF;)
+			{
+				content += static_cast<char>(ch);
+			}
+
+			std::fclose(file);
+		}
+
+		return content;
+	}
+
+	// Tree loaded from image is the saved one, and writes to its files
+	// copy their content instead of changing the image
+	void test_image_round_trip()
+	{
+		const char* path = "tests_image.vfi";
+		std::string big;
+
+		{
+			virtfiles::filesystem tree;
+			tree.createFile("a/b/empty", true);
+			tree.createFile("a/x.txt").writeBytes("hello");
+
+			virtfiles::file_t& file = tree.createFile("big.bin");
+
+			for (int i = 0; i < 1000; ++i)
+			{
+				file.appendBytes(std::to_string(i));
+			}
+
+			big = file.getContent();
+			tree.save_image(path);
+		}
+
+		std::string saved = read_host_file(path);
+
+		{
+			virtfiles::filesystem tree;
+			tree.load_image(path);
+
+			check(tree.lookup("a/b").is_folder() && tree.lookup("a/b/empty").as_file().getSize() == 0, "empty file isn't loaded");
+			check(tree.lookup("a/x.txt").as_file().getContent() == "hello", "content of file isn't loaded");
+			check(tree.lookup("big.bin").as_file().getContent() == big, "content of file with several extents isn't loaded");
+
+			tree.lookup("a/x.txt").as_file().writeAt(0, "J", 1);
+			tree.lookup("big.bin").as_file().appendBytes("more");
+
+			check(tree.lookup("a/x.txt").as_file().getContent() == "Jello", "loaded file isn't written");
+			check(read_host_file(path) == saved, "write to loaded file changes image");
+		}
+
+		{
+			virtfiles::filesystem tree;
+			tree.load_image(path);
+			check(tree.lookup("a/x.txt").as_file().getContent() == "hello", "image isn't loaded again as saved");
+		}
+
+		if (FILE* file = std::fopen(path, "wb"))
+		{
+			std::fwrite(saved.data(), 1, saved.size() / 2, file); // cut
+			std::fclose(file);
+		}
+
+		try
+		{
+			virtfiles::filesystem tree;
+			tree.load_image(path);
+			check(false, "cut image is loaded");
+		}
+		catch (const virtfiles::invalid_image_error&)
+		{
+		}
+
+		std::remove(path);
+	}
+
+#ifdef VIRTFILES_HOST_OVERLAY
+	// Host file which is gone after its folder was listed fails to open
+	void test_host_file_removed()
+	{
+		const char* root = "tests_host";
+		::mkdir(root, 0777);
+
+		FILE* file = std::fopen("tests_host/a.txt", "wb");
+		std::fputs("host", file);
+		std::fclose(file);
+
+		virtfiles::mount_host(*virtfiles::fs.get_root(), "host", root);
+		virtfiles::fs.get_root()->get_entry("host")->as_folder().get_items(); // list it
+
+		std::remove("tests_host/a.txt");
+
+		try
+		{
+			ifstream in("host/a.txt");
+			check(!in.is_open() && in.fail(), "removed host file opens");
+		}
+		catch (const std::exception&)
+		{
+			check(false, "opening removed host file throws");
+		}
+
+		std::remove(root);
+	}
+
+	// Written back file is saved where it is after rename, and isn't
+	// saved at all after it's moved out of overlay
+	void test_host_write_back_after_move()
+	{
+		const char* root = "tests_write_back";
+		::mkdir(root, 0777);
+		::mkdir("tests_write_back/sub", 0777);
+
+		virtfiles::mount_host(*virtfiles::fs.get_root(), "back", root, true);
+
+		{
+			ofstream out("back/sub/old.txt");
+			out << "first";
+		}
+
+		virtfiles::fs.rename("back/sub", "back/renamed");
+		virtfiles::fs.rename("back/renamed/old.txt", "back/renamed/new.txt");
+
+		{
+			ofstream out("back/renamed/new.txt");
+			out << "second";
+		}
+
+		check(read_host_file("tests_write_back/sub/old.txt") == "first", "old host file is overwritten after rename");
+		check(read_host_file("tests_write_back/renamed/new.txt") == "second", "renamed file isn't saved to its new path");
+
+		virtfiles::fs.rename("back/renamed/new.txt", "moved_out.txt");
+
+		{
+			ofstream out("moved_out.txt");
+			out << "third";
+		}
+
+		check(read_host_file("tests_write_back/renamed/new.txt") == "second", "file moved out of overlay is written back");
+
+		std::remove("tests_write_back/sub/old.txt");
+		std::remove("tests_write_back/renamed/new.txt");
+		std::remove("tests_write_back/sub");
+		std::remove("tests_write_back/renamed");
+		std::remove(root);
+	}
+#endif
+}
+
+int main()
+{
+#ifdef VIRTFILES_JOURNAL
+	test_global_journal(); // while global file system is empty
+#endif
+
+#ifdef VIRTFILES_TRACE
+	test_trace();
+#endif
+
+#ifdef VIRTFILES_FILE_STATS
+	test_file_stats();
+#endif
+
+	test_trailing_separator();
+	test_folder_level_move();
+	test_stale_paths();
+	test_relinking();
+	test_folded_index();
+	test_bytes_read();
+	test_filebuf_reserve_moves();
+	test_setbuf_capacity();
+	test_dirty_ranges();
+	test_windowed_reads();
+	test_codecvt_streams();
+	test_utf8_transcoding();
+	test_cache_eviction();
+	test_tar_round_trip();
+	test_tar_gnu_import();
+	test_tar_oversized_entry();
+	test_image_round_trip();
+
+#if defined(VIRTFILES_JOURNAL) && defined(VIRTFILES_THREADSAFE)
+	test_journal_create_then_write();
+#endif
+
+#ifdef VIRTFILES_HOST_OVERLAY
+	test_host_file_removed();
+	test_host_write_back_after_move();
+#endif
+
+	printf("failures: %zu\n", failures);
+
+	return failures != 0;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "virt_simd.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace virtfiles
+{
+	// Operations on ASCII strings, which are most of names, 16 or 32 bytes
+	// at a time. Multibyte strings have to be handled by caller
+	namespace ascii
+	{
+		namespace detail
+		{
+			inline char lower(char ch)
+			{
+				return ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch + ('a' - 'A')) : ch;
+			}
+
+			// Reserved chars, which can't be in entry name
+			inline bool is_reserved(char ch)
+			{
+				switch (ch)
+				{
+				case '<':
+				case '>':
+				case ':':
+				case '"':
+				case '/':
+				case '\\':
+				case '|':
+				case '?':
+				case '*':
+					return true;
+				}
+
+				return static_cast<unsigned char>(ch) <= 0x1F; // special characters
+			}
+
+#ifdef VIRTFILES_SIMD_X86
+			// Upper case letters of block converted to lower case
+			inline __m128i lower(__m128i block)
+			{
+				// 'A'..'Z' are moved to the bottom of signed range, so one compare finds them
+				__m128i shifted = _mm_add_epi8(block, _mm_set1_epi8(static_cast<char>(0x80 - 'A')));
+				__m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(-0x80 + 26)));
+
+				return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+			}
+
+			VIRTFILES_TARGET_AVX2 inline bool is_ascii_avx2(const char* str, size_t size, size_t& i)
+			{
+				__m256i any = _mm256_setzero_si256();
+
+				for (; i + 32 <= size; i += 32)
+				{
+					any = _mm256_or_si256(any, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + i)));
+				}
+
+				return _mm256_movemask_epi8(any) == 0;
+			}
+#endif
+		};
+
+		// All chars of string are ASCII
+		inline bool is_ascii(const char* str, size_t size)
+		{
+			size_t i = 0;
+
+#ifdef VIRTFILES_SIMD_X86
+			if (size >= 32 && simd::supported() == simd::level::avx2)
+			{
+				if (!detail::is_ascii_avx2(str, size, i))
+				{
+					return false;
+				}
+			}
+
+			__m128i any = _mm_setzero_si128();
+
+			for (; i + 16 <= size; i += 16)
+			{
+				any = _mm_or_si128(any, _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i)));
+			}
+
+			if (_mm_movemask_epi8(any) != 0)
+			{
+				return false;
+			}
+#endif
+			uint64_t high = 0;
+
+			for (; i + 8 <= size; i += 8)
+			{
+				uint64_t block;
+				memcpy(&block, str + i, sizeof(block));
+				high |= block;
+			}
+
+			for (; i < size; ++i)
+			{
+				high |= static_cast<unsigned char>(str[i]);
+			}
+
+			return (high & 0x8080808080808080ull) == 0;
+		}
+
+		// Write lower case copy of ASCII string to out
+		inline void to_lower(const char* str, size_t size, char* out)
+		{
+			size_t i = 0;
+
+#ifdef VIRTFILES_SIMD_X86
+			for (; i + 16 <= size; i += 16)
+			{
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), detail::lower(block));
+			}
+#endif
+			for (; i < size; ++i)
+			{
+				out[i] = detail::lower(str[i]);
+			}
+		}
+
+		// ASCII strings of the same size are equal ignoring case
+		inline bool equal_folded(const char* left, const char* right, size_t size)
+		{
+			size_t i = 0;
+
+#ifdef VIRTFILES_SIMD_X86
+			for (; i + 16 <= size; i += 16)
+			{
+				__m128i l = detail::lower(_mm_loadu_si128(reinterpret_cast<const __m128i*>(left + i)));
+				__m128i r = detail::lower(_mm_loadu_si128(reinterpret_cast<const __m128i*>(right + i)));
+
+				if (_mm_movemask_epi8(_mm_cmpeq_epi8(l, r)) != 0xFFFF)
+				{
+					return false;
+				}
+			}
+#endif
+			for (; i < size; ++i)
+			{
+				if (detail::lower(left[i]) != detail::lower(right[i]))
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		// ASCII string has no special or reserved chars, so it can be entry name
+		inline bool is_valid_name(const char* str, size_t size)
+		{
+			size_t i = 0;
+
+#ifdef VIRTFILES_SIMD_X86
+			for (; i + 16 <= size; i += 16)
+			{
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+
+				__m128i bad = _mm_cmplt_epi8(block, _mm_set1_epi8(0x20));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('<')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('>')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8(':')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('/')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('|')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('?')));
+				bad = _mm_or_si128(bad, _mm_cmpeq_epi8(block, _mm_set1_epi8('*')));
+
+				if (_mm_movemask_epi8(bad) != 0)
+				{
+					return false;
+				}
+			}
+#endif
+			for (; i < size; ++i)
+			{
+				if (detail::is_reserved(str[i]))
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+	};
+};
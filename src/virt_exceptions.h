@@ -70,6 +70,26 @@ namespace virtfiles
 		}
 	};
 
+	class directory_not_empty_error
+		: public filesystem_exception
+	{
+	public:
+		directory_not_empty_error()
+			: filesystem_exception(ENOTEMPTY, std::generic_category())
+		{
+		}
+
+		directory_not_empty_error(const char* what_arg)
+			: filesystem_exception(ENOTEMPTY, std::generic_category(), what_arg)
+		{
+		}
+
+		directory_not_empty_error(const std::string& what_arg)
+			: filesystem_exception(ENOTEMPTY, std::generic_category(), what_arg)
+		{
+		}
+	};
+
 	class permission_error
 		: public filesystem_exception
 	{
@@ -109,4 +129,64 @@ namespace virtfiles
 		{
 		}
 	};
+
+	class invalid_image_error
+		: public filesystem_exception
+	{
+	public:
+		invalid_image_error()
+			: filesystem_exception(EINVAL, std::generic_category())
+		{
+		}
+
+		invalid_image_error(const char* what_arg)
+			: filesystem_exception(EINVAL, std::generic_category(), what_arg)
+		{
+		}
+
+		invalid_image_error(const std::string& what_arg)
+			: filesystem_exception(EINVAL, std::generic_category(), what_arg)
+		{
+		}
+	};
+
+	class invalid_archive_error
+		: public filesystem_exception
+	{
+	public:
+		invalid_archive_error()
+			: filesystem_exception(EINVAL, std::generic_category())
+		{
+		}
+
+		invalid_archive_error(const char* what_arg)
+			: filesystem_exception(EINVAL, std::generic_category(), what_arg)
+		{
+		}
+
+		invalid_archive_error(const std::string& what_arg)
+			: filesystem_exception(EINVAL, std::generic_category(), what_arg)
+		{
+		}
+	};
+
+	class invalid_journal_error
+		: public filesystem_exception
+	{
+	public:
+		invalid_journal_error()
+			: filesystem_exception(EINVAL, std::generic_category())
+		{
+		}
+
+		invalid_journal_error(const char* what_arg)
+			: filesystem_exception(EINVAL, std::generic_category(), what_arg)
+		{
+		}
+
+		invalid_journal_error(const std::string& what_arg)
+			: filesystem_exception(EINVAL, std::generic_category(), what_arg)
+		{
+		}
+	};
 };
@@ -1,8 +1,13 @@
 #pragma once
 
 #include "file_entries.h"
+#include "virt_utf8.h"
+#include <algorithm>
+#include <cwchar>
 #include <locale>
 #include <streambuf>
+#include <string_view>
+#include <type_traits>
 
 
 namespace virtfiles
@@ -23,7 +28,7 @@ namespace virtfiles
 		using off_type = typename Traits::off_type;
 
 		basic_filebuf()
-			: _Mybase()
+			: _Mybase(), buffer_reserve(buffer_chunk_size)
 		{
 			_init(nullptr);
 		}
@@ -31,7 +36,7 @@ namespace virtfiles
 		basic_filebuf(const basic_filebuf&) = delete;
 
 		basic_filebuf(basic_filebuf&& other) noexcept
-			: _Mybase(std::move(other))
+			: _Mybase(std::move(other)), buffer_reserve(other.buffer_reserve)
 		{
 			_init(other);
 			other._init(nullptr);
@@ -46,6 +51,8 @@ namespace virtfiles
 
 			_init(other);
 			other._init(nullptr);
+
+			return *this;
 		}
 
 		virtual ~basic_filebuf() noexcept
@@ -65,74 +72,105 @@ namespace virtfiles
 
 		bool is_open() const
 		{
-			return myfile != nullptr;
+			return static_cast<bool>(myfile);
+		}
+
+		// Minimal count of elements reserved for buffer on open
+		size_t get_buffer_reserve() const
+		{
+			return buffer_reserve;
+		}
+
+		void set_buffer_reserve(size_t count)
+		{
+			buffer_reserve = count;
 		}
 
-		basic_filebuf* open(const char* filepath, _Myios::openmode mode)
+		// size_hint is expected count of elements in file, buffer
+		// will be reserved for it so it doesn't grow while writing
+		basic_filebuf* open(const char* filepath, _Myios::openmode mode,
+			size_t size_hint = 0)
 		{
+			VIRTFILES_TRACE_SCOPE(open);
+
 			if (myfile || !handle_openmode(mode))
 			{
 				return nullptr;
 			}
 
-			try
-			{
-				myfile = &fs.get_root()->lookup(filepath).as_file();
-			}
-			catch (const filesystem_exception&)
-			{
-				myfile = nullptr;
-			}
-
 			bool _only_out = (mode & (_Myios::out | _Myios::in)) == _Myios::out;
+			bool _created = false;
 
 			_init_mycvt(std::use_facet<_Cvt>(_Mybase::getloc()));
 
-			if (myfile) // file exists
+			myfile = _find_file(filepath);
+
+			if (!myfile && (mode & (_Myios::trunc | _Myios::app) || _only_out))
 			{
-				// if shouldn't truncate
-				if (!(mode & _Myios::trunc || _only_out) || mode & _Myios::app)
+				// create new file
+				try
 				{
-					// read content
-					// NOTE: when file::read_bytes will handle text mode, fix this line
-					if (!_init_buffer_from(myfile, mode))
-					{
-						myfile = nullptr;
-						return nullptr;
-					}
-
-					return this;
+					myfile = fs.acquire_new_file(filepath);
+					_created = true;
 				}
+				catch (const file_exists_error&)
+				{
+					// may be created by another thread meanwhile
+					myfile = _find_file(filepath);
+				}
+				catch (const filesystem_exception&)
+				{
+				}
+			}
 
-				myfile->empty(); // truncate file
+			if (!myfile) // need file to exists before opening
+			{
+				return nullptr;
 			}
-			else if (mode & (_Myios::trunc | _Myios::app) || _only_out)
+
+			if (!_created) // file exists
 			{
-				// create new file
 				try
 				{
-					myfile = &fs.get_root()->createFile(filepath);
+					// if shouldn't truncate
+					if (!(mode & _Myios::trunc || _only_out) || mode & _Myios::app)
+					{
+						// read content
+						// NOTE: when file::read_bytes will handle text mode, fix this line
+						if (!_init_buffer_from(myfile.get(), mode, size_hint))
+						{
+							myfile.reset();
+							return nullptr;
+						}
+
+						_count(counter::opens);
+						return this;
+					}
+
+					myfile->empty(); // truncate file
 				}
 				catch (const filesystem_exception&)
 				{
+					// content of lazily loaded file may fail to load, e.g. host one
+					myfile.reset();
 					return nullptr;
 				}
 			}
-			else // need file to exists before opening
-			{
-				return nullptr;
-			}
 
 			// Just create empty buffer
-			create_buffer();
+			create_buffer(size_hint);
 
 			put_area_start = buffer_fend = buffer_pos = buffer_start;
 			this->mode = mode;
+
+			_count(counter::opens);
 			return this;
 		}
 
 		basic_filebuf* close()
 		{
+			VIRTFILES_TRACE_SCOPE(close);
+
 			// it's better not to call virtual methods in constructor/destructor, so here is copy of sync
 			if (!myfile)
 			{
@@ -141,63 +179,226 @@ namespace virtfiles
 
 			bool out = true;
 
+			_release_areas();
+
 			if (mode & _Myios::out)
 			{
 				out = flush_buffer();
 			}
 
-			delete[] buffer_start;
+			if (!myfile->_on_close())
+			{
+				out = false;
+			}
+
+			if (buffer_owned)
+			{
+				delete[] buffer_start;
+			}
+
 			_init(nullptr);
 
 			return out ? this : nullptr;
 		}
 
 	private:
+		// Count event of stream to file system and, if it keeps them, to file
+		void _count(counter which, uint64_t amount = 1)
+		{
+			stats::add(which, amount);
+#ifdef VIRTFILES_FILE_STATS
+			myfile->_count(which, amount);
+#endif
+		}
+
+		static entry_handle<file_t> _find_file(const char* filepath)
+		{
+			try
+			{
+				entry_handle<base_entry> entry = fs.acquire(filepath);
+				file_t& file = entry->as_file();
+
+				return entry_handle<file_t>(std::move(entry), file);
+			}
+			catch (const filesystem_exception&)
+			{
+				return entry_handle<file_t>();
+			}
+		}
+
 		void _init(std::nullptr_t)
 		{
-			myfile = nullptr;
+			myfile.reset();
 			mycvt = nullptr;
+			utf8_cvt = false;
 			static _State_t state_init; // initial state
 			convstate = state_init;
 			posstate = _pos_initial;
 			mode = _Myios::openmode{};
 			pbackchar = Traits::eof();
+			mysnapshot = content_snapshot();
+			window_index = 0;
+			window_offset = 0;
 
 			// pointers
 			buffer_start = nullptr;
 			buffer_end = nullptr;
 			buffer_pos = nullptr;
 			buffer_fend = nullptr;
+			buffer_owned = false;
 
 			put_area_start = nullptr;
+			dirty_count = 0;
 
-			// Always nullptr
 			_Mybase::setp(nullptr, nullptr);
 			_Mybase::setg(nullptr, nullptr, nullptr);
 		}
 
-		void _init(const basic_filebuf& other)
+		void _init(basic_filebuf& other)
 		{
-			myfile = other.myfile;
+			other._release_areas();
+
+			myfile = std::move(other.myfile);
 			mycvt = other.mycvt;
+			utf8_cvt = other.utf8_cvt;
 			convstate = other.convstate;
 			posstate = other.posstate;
-			mode = 0;
+			mode = other.mode;
 			pbackchar = other.pbackchar;
+			mysnapshot = other.mysnapshot;
+			window_index = other.window_index;
+			window_offset = other.window_offset;
 
 			// pointers
 			buffer_start = other.buffer_start;
 			buffer_end = other.buffer_end;
 			buffer_pos = other.buffer_pos;
 			buffer_fend = other.buffer_fend;
+			buffer_owned = other.buffer_owned;
+			buffer_reserve = other.buffer_reserve;
 
 			put_area_start = other.put_area_start;
+			dirty_count = other.dirty_count;
+			std::copy(other.dirty, other.dirty + other.dirty_count, dirty);
 
-			// Always nullptr
 			_Mybase::setp(nullptr, nullptr);
 			_Mybase::setg(nullptr, nullptr, nullptr);
 		}
 
+		// Get and put areas are set up lazily by underflow/uflow and
+		// overflow/xsputn, so that std::basic_streambuf can read and write
+		// directly from/to buffer. Only one of them is set at a time.
+		// This function moves their position back to buffer_pos and resets
+		// them, it has to be called before any access to buffer pointers.
+		// Get area starts at buffer_pos, so elements read from it directly
+		// are counted as read when it's released
+		void _release_areas()
+		{
+			if (_Mybase::pbase())
+			{
+				buffer_pos = _Mybase::pptr();
+				_mark_dirty(_Mybase::pbase(), buffer_pos);
+
+				if (buffer_pos > buffer_fend) // increase content size
+				{
+					buffer_fend = buffer_pos;
+				}
+
+				_Mybase::setp(nullptr, nullptr);
+			}
+			else if (_Mybase::eback())
+			{
+				buffer_pos = _Mybase::gptr();
+				_count(counter::bytes_read, _Mybase::gptr() - _Mybase::eback());
+
+				_Mybase::setg(nullptr, nullptr, nullptr);
+			}
+		}
+
+		void _set_get_area()
+		{
+			_Mybase::setg(buffer_pos, buffer_pos, buffer_fend);
+		}
+
+		void _set_put_area()
+		{
+			_Mybase::setp(buffer_pos, buffer_end);
+		}
+
+		// Buffer is a window over extents of mysnapshot, instead of copy of file
+		bool _windowed() const
+		{
+			return mysnapshot.valid();
+		}
+
+		// Make extent at index the buffer, offset is its position in file
+		void _load_window(size_t index, size_t offset)
+		{
+			std::string_view window = mysnapshot.get_extent(index);
+
+			window_index = index;
+			window_offset = offset;
+
+			buffer_start = reinterpret_cast<CharT*>(const_cast<char*>(window.data()));
+			buffer_end = buffer_fend = buffer_pos = buffer_start + window.size();
+		}
+
+		// Slide window forward when it's read to the end
+		bool _next_window()
+		{
+			if (!_windowed() || window_index + 1 >= mysnapshot.get_extent_count())
+			{
+				return false;
+			}
+
+			_load_window(window_index + 1, window_offset + (buffer_fend - buffer_start));
+			buffer_pos = buffer_start;
+
+			return true;
+		}
+
+		bool _prev_window()
+		{
+			if (!_windowed() || window_index == 0)
+			{
+				return false;
+			}
+
+			_load_window(window_index - 1, window_offset - mysnapshot.get_extent(window_index - 1).size());
+
+			return true;
+		}
+
+		size_t _content_size() const
+		{
+			return _windowed() ? mysnapshot.size() : buffer_fend - buffer_start;
+		}
+
+		size_t _position() const
+		{
+			return window_offset + (buffer_pos - buffer_start);
+		}
+
+		// Set position, which must not be past the end of content
+		void _seek_to(size_t pos)
+		{
+			if (_windowed() && (pos < window_offset || pos > window_offset + (buffer_fend - buffer_start)))
+			{
+				size_t index = 0;
+				size_t offset = 0;
+
+				while (index + 1 < mysnapshot.get_extent_count()
+					&& pos >= offset + mysnapshot.get_extent(index).size())
+				{
+					offset += mysnapshot.get_extent(index++).size();
+				}
+
+				_load_window(index, offset);
+			}
+
+			buffer_pos = buffer_start + (pos - window_offset);
+		}
+
 		static bool handle_openmode(_Myios::openmode& mode)
 		{
 			if (!(mode & ~(_Myios::ate))													// empty mode
@@ -218,23 +419,102 @@ namespace virtfiles
 		void _init_mycvt(const _Cvt& newcvt)
 		{
 			mycvt = newcvt.always_noconv() ? nullptr : std::addressof(newcvt);
+			utf8_cvt = mycvt && _is_utf8(*mycvt);
 		}
 
-		bool _init_buffer_from(file_t* file, _Myios::openmode mode)
+		// Facet converts UTF-32 elements to UTF-8, so utf8 transcoder can
+		// be used instead of it. Checked by converting few probe chars
+		static bool _is_utf8(const _Cvt& cvt)
 		{
-			// Convert file content to CharT array
-			CharT* converted = nullptr;
-			size_t count = convert_from_char(this, file->getContent(), converted);
+			if constexpr (utf8_capable)
+			{
+				static const CharT probe[] = { CharT(0x61), CharT(0xE9), CharT(0x20AC), CharT(0x1F600) };
+				static const char encoded[] = "a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80";
+				constexpr size_t probe_count = sizeof(probe) / sizeof(CharT);
+				constexpr size_t encoded_size = sizeof(encoded) - 1;
+
+				_State_t state{};
+				const CharT* probe_next;
+				char out[16];
+				char* out_next;
+
+				if (cvt.out(state, probe, probe + probe_count, probe_next, out, out + sizeof(out), out_next) != std::codecvt_base::ok
+					|| static_cast<size_t>(out_next - out) != encoded_size
+					|| memcmp(out, encoded, encoded_size) != 0)
+				{
+					return false;
+				}
 
-			if (!converted)
+				state = _State_t{};
+				const char* encoded_next;
+				CharT in[probe_count];
+				CharT* in_next;
+
+				return cvt.in(state, encoded, encoded + encoded_size, encoded_next, in, in + probe_count, in_next) == std::codecvt_base::ok
+					&& static_cast<size_t>(in_next - in) == probe_count
+					&& std::equal(in, in + probe_count, probe);
+			}
+
+			return false;
+		}
+
+		// No partially converted char is kept in state
+		static bool _is_initial(const std::mbstate_t& state)
+		{
+			return std::mbsinit(&state) != 0;
+		}
+
+		template <class State>
+		static bool _is_initial(const State&)
+		{
+			return false;
+		}
+
+		bool _init_buffer_from(file_t* file, _Myios::openmode mode, size_t size_hint)
+		{
+			size_t count;
+
+			// Content won't change while it is read
+			content_snapshot snapshot = file->snapshot();
+			count = snapshot.size();
+
+			if (!mycvt && std::is_same<CharT, char>::value)
 			{
-				return false;
+				if (!(mode & _Myios::out) && count != 0)
+				{
+					// Nothing will be written, so read snapshot of file
+					// content directly, one extent at a time. Nothing is
+					// copied, so open doesn't depend on size of file
+					mysnapshot = std::move(snapshot);
+					_load_window(0, 0);
+					_seek_to(mode & _Myios::ate ? count : 0);
+
+					put_area_start = buffer_start;
+					this->mode = mode;
+
+					return true;
+				}
+
+				// Copy file content right to buffer
+				create_buffer(count > size_hint ? count : size_hint);
+				snapshot.copy_to(reinterpret_cast<char*>(buffer_start), 0, count);
 			}
+			else
+			{
+				// Each element is converted from at least one byte,
+				// so buffer of count elements fits the whole content
+				create_buffer(count > size_hint ? count : size_hint);
+
+				if (!convert_from_char(snapshot))
+				{
+					delete[] buffer_start;
+					buffer_start = nullptr;
+
+					return false;
+				}
 
-			// Create buffer, copy converted
-			create_buffer(count);
-			memcpy(buffer_start, converted, count * sizeof(CharT));
-			delete[] converted;
+				count = buffer_fend - buffer_start;
+			}
 
 			// Set pointers
 			buffer_fend = buffer_start + count;
@@ -256,7 +536,9 @@ namespace virtfiles
 				return 0;
 			}
 
-			return buffer_fend - buffer_pos;
+			_release_areas();
+
+			return _content_size() - _position();
 		}
 
 		// put an element back to get area
@@ -267,6 +549,13 @@ namespace virtfiles
 				return Traits::eof();
 			}
 
+			_release_areas();
+
+			if (buffer_pos <= buffer_start && posstate == _pos_initial)
+			{
+				_prev_window(); // put back to the end of previous window
+			}
+
 			if (buffer_pos <= buffer_start	 // cannot decrease buffer_pos
 				|| posstate != _pos_initial) // smth put back or broken or at the end
 			{
@@ -305,15 +594,18 @@ namespace virtfiles
 				return Traits::eof();
 			}
 
+			_release_areas();
+
 			CharT* p = mode & _Myios::app ? buffer_fend : buffer_pos;
 
 			if (p >= buffer_end) // buffer is too small, extend it
 			{
-				extend_buffer();
+				extend_buffer(buffer_end - buffer_start + 1);
 				p = mode & _Myios::app ? buffer_fend : buffer_pos;
 			}
 
 			*(p++) = Traits::to_char_type(ch); // finally put element to put area
+			_mark_dirty(p - 1, p);
 
 			if (mode & _Myios::app)
 			{
@@ -325,11 +617,56 @@ namespace virtfiles
 				buffer_fend = p;
 			}
 
-			++buffer_pos;
+			buffer_pos = p;
+			_set_put_area(); // next elements go right to buffer
 
 			return ch;
 		}
 
+		// put count elements to stream
+		virtual std::streamsize xsputn(const char_type* s, std::streamsize count) override
+		{
+			if (count <= 0)
+			{
+				return 0;
+			}
+
+			if (!(myfile && mode & _Myios::out) // cannot perform output operations
+				|| posstate & _pos_broken)		// position broken
+			{
+				return 0;
+			}
+
+			_release_areas();
+
+			CharT* p = mode & _Myios::app ? buffer_fend : buffer_pos;
+
+			if (count > buffer_end - p) // buffer is too small, extend it
+			{
+				extend_buffer((p - buffer_start) + count);
+				p = mode & _Myios::app ? buffer_fend : buffer_pos;
+			}
+
+			Traits::copy(p, s, count);
+			_mark_dirty(p, p + count);
+			p += count;
+
+			if (mode & _Myios::app)
+			{
+				posstate = _pos_ate;
+			}
+
+			if (p > buffer_fend) // increase content size
+			{
+				buffer_fend = p;
+			}
+
+			buffer_pos = p;
+			_set_put_area();
+
+			return count;
+		}
+
 		// get an element from stream, but don't point past it
 		virtual int_type underflow() override
 		{
@@ -344,17 +681,26 @@ namespace virtfiles
 				return Traits::eof();
 			}
 
+			_release_areas();
+
 			if (posstate & _pbackwas)
 			{
 				return pbackchar;
 			}
 
+			if (buffer_pos >= buffer_fend)
+			{
+				_next_window();
+			}
+
 			if (!(myfile && mode & _Myios::in) // cannot perform input operations
 				|| buffer_pos >= buffer_fend)  // pending input is empty
 			{
 				return Traits::eof();
 			}
 
+			_set_get_area(); // next elements are read right from buffer
+
 			return Traits::to_int_type(*buffer_pos); // peek char
 		}
 
@@ -372,14 +718,22 @@ namespace virtfiles
 				return Traits::eof();
 			}
 
+			_release_areas();
+
 			if (posstate & _pbackwas)
 			{
 				int_type out = pbackchar;
 				posstate &= ~_pbackwas;
 				++buffer_pos; // buffer_pos < buffer_fend because pbackfail was called
+				_count(counter::bytes_read);
 				return out;
 			}
 
+			if (buffer_pos >= buffer_fend)
+			{
+				_next_window();
+			}
+
 			if (!(myfile && mode & _Myios::in) // cannot perform input operations
 				|| buffer_pos >= buffer_fend)  // pending input is empty
 			{
@@ -387,19 +741,86 @@ namespace virtfiles
 			}
 
 			int_type ch = Traits::to_int_type(*(buffer_pos++)); // get char, increase pointers
+			_count(counter::bytes_read);
+			_set_get_area();
+
 			return ch;
 		}
 
+		// get count elements from stream
+		virtual std::streamsize xsgetn(char_type* s, std::streamsize count) override
+		{
+			std::streamsize done = 0;
+
+			if (count <= 0)
+			{
+				return 0;
+			}
+
+			if (posstate != _pos_initial) // let uflow handle put back char and position states
+			{
+				int_type ch = uflow();
+
+				if (Traits::eq_int_type(Traits::eof(), ch))
+				{
+					return 0;
+				}
+
+				*(s++) = Traits::to_char_type(ch);
+				++done;
+				--count;
+			}
+
+			if (!(myfile && mode & _Myios::in)) // cannot perform input operations
+			{
+				return done;
+			}
+
+			_release_areas();
+
+			std::streamsize copied = 0;
+
+			while (count > 0 && (buffer_pos < buffer_fend || _next_window()))
+			{
+				std::streamsize part = buffer_fend - buffer_pos;
+
+				if (part > count)
+				{
+					part = count;
+				}
+
+				Traits::copy(s, buffer_pos, part);
+				buffer_pos += part;
+
+				s += part;
+				copied += part;
+				count -= part;
+			}
+
+			_count(counter::bytes_read, copied);
+
+			return done + copied;
+		}
+
 		virtual _Mybase* setbuf(char_type* buf, std::streamsize count) override
 		{
-			if (!buf || count == 0					 // empty buffer
-				|| count < buffer_fend - buffer_end) // not capable for existing buffer contents
+			if (!buf || count == 0					   // empty buffer
+				|| count < buffer_end - buffer_start   // not capable for existing buffer
+				|| _windowed())						   // buffer is file content itself
 			{
 				return this;
 			}
 
+			_release_areas();
+
 			memcpy(buf, buffer_start, (buffer_fend - buffer_start) * sizeof(CharT));
-			delete[] buffer_start;
+
+			if (buffer_owned)
+			{
+				delete[] buffer_start;
+			}
+
+			buffer_owned = false;
 			size_t area_size = buffer_fend - buffer_start;
 			size_t pos = buffer_pos - buffer_start;
 			size_t put_area_shift = put_area_start - buffer_start;
@@ -416,18 +837,22 @@ namespace virtfiles
 
 		// change position by off in direction of dir
 		virtual pos_type seekoff(off_type off, _Myios::seekdir dir,
-			_Myios::openmode which = _Myios::in | _Myios::out) override
+			[[maybe_unused]] _Myios::openmode which = _Myios::in | _Myios::out) override
 		{
 			if (!myfile)
 			{
 				return pos_type{ off_type{-1} }; // no file, nowhere to change position
 			}
 
+			_release_areas();
+
+			off_type target;
+
 			// do seek
 			switch (dir)
 			{
 			case _Myios::beg:
-				buffer_pos = buffer_start + off;
+				target = off;
 				break;
 			case _Myios::cur:
 				if (off == 0)
@@ -437,65 +862,75 @@ namespace virtfiles
 						return pos_type{ off_type{-1} };
 					}
 
-					pos_type pos{ buffer_pos - buffer_start };
+					pos_type pos{ static_cast<off_type>(_position()) };
 					pos.state(convstate);
 
 					return pos; // just tell the position
 				}
-				buffer_pos += off;
+				target = static_cast<off_type>(_position()) + off;
 				break;
 			case _Myios::end:
-				buffer_pos = buffer_fend + off;
+				target = static_cast<off_type>(_content_size()) + off;
 				break;
 			default:
 				return pos_type{ off_type{-1} };
 			}
 
-			if (buffer_pos > buffer_fend)
+			if (target < 0)
 			{
-				buffer_pos = buffer_fend;
+				return pos_type{ off_type{-1} };
 			}
 
+			_seek_to(static_cast<size_t>(target) < _content_size() ? static_cast<size_t>(target) : _content_size());
+
 			posstate = _pos_initial; // reset position state
 
-			pos_type pos{ buffer_pos - buffer_start };
+			pos_type pos{ static_cast<off_type>(_position()) };
 			pos.state(convstate);
 
 			return pos;
 		}
 
 		virtual pos_type seekpos(pos_type pos,
-			_Myios::openmode which = _Myios::in | _Myios::out) override
+			[[maybe_unused]] _Myios::openmode which = _Myios::in | _Myios::out) override
 		{
 			if (!myfile)
 			{
 				return pos_type{ off_type{-1} }; // no file, nowhere to change position
 			}
 
-			posstate = _pos_initial;
-			buffer_pos = buffer_start + pos;
+			_release_areas();
 
-			if (buffer_pos > buffer_fend)
+			off_type target = pos;
+
+			if (target < 0)
 			{
-				buffer_pos = buffer_fend;
+				return pos_type{ off_type{-1} };
 			}
 
+			posstate = _pos_initial;
+			_seek_to(static_cast<size_t>(target) < _content_size() ? static_cast<size_t>(target) : _content_size());
+
 			return pos;
 		}
 
 		virtual int sync() override
 		{
+			VIRTFILES_TRACE_SCOPE(sync);
+
 			if (!myfile)
 			{
 				return 0;
 			}
 
+			_release_areas();
+
 			if (mode & _Myios::out)
 			{
-				return flush_buffer();
+				return flush_buffer() ? 0 : -1;
 			}
 
-			return 1;
+			return 0;
 		}
 
 		virtual void imbue(const std::locale& loc) override
@@ -505,6 +940,10 @@ namespace virtfiles
 
 	private:
 		const _Cvt* mycvt;	// ptr to codecvt facet (can be nullptr)
+		bool utf8_cvt;		// mycvt converts to UTF-8, utf8 transcoder is used instead
+
+		// Elements are UTF-32 code units, so utf8 transcoder can convert them
+		static constexpr bool utf8_capable = sizeof(CharT) == 4 && std::is_same<_State_t, std::mbstate_t>::value;
 		_State_t convstate; // current convertion state
 
 		constexpr static unsigned char _pos_initial = 0; // set by default
@@ -515,30 +954,57 @@ namespace virtfiles
 		int_type pbackchar; // char stored by pbackfail
 		unsigned char posstate;
 
+		content_snapshot mysnapshot; // file content buffer refers to (if any)
+		size_t window_index;		 // extent of mysnapshot which is the buffer
+		size_t window_offset;		 // position of buffer_start in file
+
 		// controlled buffer pointers
 		CharT* buffer_start;
 		CharT* buffer_end;
 		CharT* buffer_pos;
 		CharT* buffer_fend;
+		bool buffer_owned; // if buffer should be deleted
+
+		CharT* put_area_start; // elements before it are already appended to file in app mode
+
+		// Range of buffer elements modified since last flush
+		struct dirty_range
+		{
+			size_t start;
+			size_t end;
+		};
+
+		static constexpr size_t max_dirty_ranges = 8;
 
-		CharT* put_area_start;
+		dirty_range dirty[max_dirty_ranges + 1]; // sorted, not overlapping
+		size_t dirty_count;
 
-		file_t* myfile;
+		entry_handle<file_t> myfile; // keeps file valid if it's removed while open
 		_Myios::openmode mode;
 
 		static constexpr size_t buffer_chunk_size = 256;
+		static constexpr size_t buffer_growth_factor = 2;
 
-		size_t create_buffer(size_t min_size = buffer_chunk_size)
+		size_t buffer_reserve; // minimal size of created buffer
+
+		size_t create_buffer(size_t min_size = 0)
 		{
+			if (min_size < buffer_reserve)
+			{
+				min_size = buffer_reserve;
+			}
+
 			size_t size = (min_size / buffer_chunk_size + (min_size % buffer_chunk_size != 0)) * buffer_chunk_size;
 
 			buffer_start = new CharT[size]{};
 			buffer_end = buffer_start + size;
+			buffer_owned = true;
 
 			return size;
 		}
 
-		void extend_buffer()
+		// Grow buffer geometrically so that it can hold at least min_size elements
+		void extend_buffer(size_t min_size)
 		{
 			CharT* ob_start = buffer_start;
 			CharT* ob_end = buffer_end;
@@ -546,11 +1012,19 @@ namespace virtfiles
 			CharT* ob_fend = buffer_fend;
 
 			CharT* ob_put_area_start = put_area_start;
+			bool ob_owned = buffer_owned;
+
+			size_t size = (ob_end - ob_start) * buffer_growth_factor;
 
-			create_buffer(buffer_end - buffer_start + 1);
+			create_buffer(size > min_size ? size : min_size);
+			_count(counter::buffer_extensions);
 
-			memcpy(buffer_start, ob_start, ob_fend - ob_start);
-			delete[] ob_start;
+			memcpy(buffer_start, ob_start, (ob_fend - ob_start) * sizeof(CharT));
+
+			if (ob_owned)
+			{
+				delete[] ob_start;
+			}
 
 			buffer_pos = ob_pos - ob_start + buffer_start;
 			buffer_fend = ob_fend - ob_start + buffer_start;
@@ -558,144 +1032,332 @@ namespace virtfiles
 			put_area_start = ob_put_area_start - ob_start + buffer_start;
 		}
 
-		bool flush_buffer()
+		// Remember that elements in [from, to) were modified.
+		// Touching ranges are merged, and when there are too many
+		// of them, the closest ones are, so flush writes few ranges
+		void _mark_dirty(const CharT* from, const CharT* to)
 		{
-			char* converted = nullptr;
-			size_t size = convert_buffer_to_char(converted);
+			if (from >= to)
+			{
+				return;
+			}
 
-			if (!converted)
+			dirty_range range{ static_cast<size_t>(from - buffer_start), static_cast<size_t>(to - buffer_start) };
+
+			size_t first = 0;
+
+			while (first < dirty_count && dirty[first].end < range.start)
 			{
-				return false;
+				++first;
 			}
 
-			if (size == 0)
+			size_t last = first; // past last range merged with new one
+
+			while (last < dirty_count && dirty[last].start <= range.end)
 			{
-				delete[] converted;
-				return false;
+				range.start = std::min(range.start, dirty[last].start);
+				range.end = std::max(range.end, dirty[last].end);
+				++last;
+			}
+
+			if (last == first) // make room for new range
+			{
+				std::copy_backward(dirty + first, dirty + dirty_count, dirty + dirty_count + 1);
+				++dirty_count;
+			}
+			else if (last > first + 1) // remove merged ranges
+			{
+				std::copy(dirty + last, dirty + dirty_count, dirty + first + 1);
+				dirty_count -= last - first - 1;
+			}
+
+			dirty[first] = range;
+
+			if (dirty_count > max_dirty_ranges)
+			{
+				size_t closest = 0;
+
+				for (size_t i = 1; i + 1 < dirty_count; ++i)
+				{
+					if (dirty[i + 1].start - dirty[i].end < dirty[closest + 1].start - dirty[closest].end)
+					{
+						closest = i;
+					}
+				}
+
+				dirty[closest].end = dirty[closest + 1].end;
+				std::copy(dirty + closest + 2, dirty + dirty_count, dirty + closest + 1);
+				--dirty_count;
 			}
+		}
 
+		bool flush_buffer()
+		{
 			if (mode & _Myios::app)
 			{
-				myfile->appendBytes(converted, size);
+				// Everything is put to the end, append elements put since last flush
+				if (put_area_start != buffer_fend)
+				{
+					if (!mycvt)
+					{
+						size_t size = (buffer_fend - put_area_start) * sizeof(CharT);
+
+						myfile->appendBytes(reinterpret_cast<const char*>(put_area_start), size);
+						_count(counter::bytes_written, size);
+					}
+					else if (!convert_to_file(put_area_start, buffer_fend, true))
+					{
+						return false;
+					}
+
+					put_area_start = buffer_fend;
+					_count(counter::flushes);
+				}
 			}
-			else
+			else if (dirty_count != 0)
 			{
-				myfile->writeBytes(converted, size);
+				if (!mycvt)
+				{
+					// File has the same layout as buffer, write modified ranges only
+					for (size_t i = 0; i < dirty_count; ++i)
+					{
+						size_t size = (dirty[i].end - dirty[i].start) * sizeof(CharT);
+
+						myfile->writeAt(dirty[i].start * sizeof(CharT),
+							reinterpret_cast<const char*>(buffer_start + dirty[i].start), size);
+						_count(counter::bytes_written, size);
+					}
+				}
+				else
+				{
+					// Converted elements may change size, so whole content is rewritten
+					static _State_t state_init;
+					convstate = state_init;
+
+					if (!convert_to_file(buffer_start, buffer_fend, false))
+					{
+						return false;
+					}
+				}
+
+				_count(counter::flushes);
 			}
 
-			delete[] converted;
+			dirty_count = 0;
 			return true;
 		}
 
-		size_t convert_buffer_to_char(char*& converted)
+		// Convert elements in [from, to) right into extents of file content,
+		// which replaces current one or is appended to it
+		bool convert_to_file(const CharT* from, const CharT* to, bool append)
 		{
-			if (!mycvt) // just copy raw
-			{
-			noconv:
-				const size_t size = buffer_fend - put_area_start;
-				char* out = new char[size + 1] {'\0'};
-				memcpy(out, put_area_start, size * sizeof(CharT));
+			size_t written = 0;
+
+			bool out = myfile->writeWith([this, from, to, &written](file_content& content)
+				{
+					size_t before = content.size();
+					bool converted = convert_to_char(content, from, to);
+
+					written = content.size() - before;
+					return converted;
+				}, append);
 
-				converted = out;
-				return size;
+			_count(counter::conversions);
+
+			if (out)
+			{
+				_count(counter::bytes_written, written);
 			}
 
-			std::string out_buf;
-			const CharT* from_next = put_area_start;
+			return out;
+		}
+
+		bool convert_to_char(file_content& content, const CharT* from, const CharT* to)
+		{
+			// Space for at least one converted element
+			const size_t min_space = mycvt->max_length() > 16 ? mycvt->max_length() : 16;
 
-			while (true)
+			while (from != to)
 			{
-				constexpr size_t tmp_buf_size = 256;
-				char tmp_buf[tmp_buf_size]{};
-				char* tmp_buf_next = nullptr;
+				size_t available;
+				char* out = content.append_space(min_space, (to - from) * sizeof(CharT), available);
 
-				switch (mycvt->out(
+				if constexpr (utf8_capable)
+				{
+					if (utf8_cvt && _is_initial(convstate))
+					{
+						utf8::result converted = utf8::encode(from, to - from, out, available);
+
+						content.commit_append(converted.written);
+						from += converted.read;
+
+						if (converted.read != 0 || converted.code == utf8::status::ok)
+						{
+							continue;
+						}
+
+						// Let facet handle and report invalid char
+					}
+				}
+
+				char* out_next = out;
+				const CharT* from_next = from;
+
+				std::codecvt_base::result result = mycvt->out(
 					convstate,
-					from_next, buffer_fend, from_next,
-					tmp_buf, tmp_buf + tmp_buf_size, tmp_buf_next
-				))
+					from, to, from_next,
+					out, out + available, out_next
+				);
+
+				content.commit_append(out_next - out);
+
+				switch (result)
 				{
 				case std::codecvt_base::ok:
 				case std::codecvt_base::partial:
-					if (from_next == buffer_fend) // converted all
+					if (from_next == from && out_next == out) // no progress
 					{
-						const size_t size = out_buf.size();
-						char* out = new char[size + 1] {'\0'};
-						memcpy(out, out_buf.data(), size);
-
-						converted = out;
-						return size;
+						return false;
 					}
 
-					out_buf.append(tmp_buf, tmp_buf_next - tmp_buf);
+					from = from_next;
 					break;
 
 				case std::codecvt_base::noconv: // no convertion needed
-					goto noconv;
+					content.append(reinterpret_cast<const char*>(from), (to - from) * sizeof(CharT));
+					return true;
 
 				default: // failed convertion
-					converted = nullptr;
-					return 0;
+					return false;
 				}
 			}
+
+			return true;
 		}
 
-		static size_t convert_from_char(
-			basic_filebuf* buffer,
-			const std::string& from,
-			CharT*& converted)
+		// Convert whole content of snapshot right into buffer, which is expected
+		// to be big enough, but is extended if it is not. Extents are converted
+		// one by one, char split by extent boundary is converted from a copy
+		bool convert_from_char(const content_snapshot& snapshot)
 		{
-			if (!buffer->mycvt) // just copy raw
-			{
-			noconv:
-				const size_t size = from.size();
-				CharT* out = new CharT[size];
-				memcpy(out, from.c_str(), size);
+			_count(counter::conversions);
 
-				converted = out;
-				return size;
-			}
+			static _State_t state_init;
+			convstate = state_init;
 
-			std::basic_string<CharT> out_buf;
-			const char* from_next = from.c_str();
-			const char* from_end = from.c_str() + from.size();
+			buffer_pos = buffer_fend = put_area_start = buffer_start;
 
-			while (true)
+			const size_t size = snapshot.size();
+			size_t pos = 0;		  // position of next byte to convert
+			size_t ext_index = 0; // extent which contains pos
+			size_t ext_start = 0; // position of the extent
+
+			while (pos < size)
 			{
-				constexpr size_t tmp_buf_size = 256;
-				CharT tmp_buf[tmp_buf_size]{};
-				CharT* tmp_buf_next = nullptr;
+				std::string_view ext = snapshot.get_extent(ext_index);
 
-				switch (buffer->mycvt->in(
-					buffer->convstate,
-					from_next, from_end, from_next,
-					tmp_buf, tmp_buf + tmp_buf_size, tmp_buf_next
-				))
+				if (pos >= ext_start + ext.size())
 				{
-				case std::codecvt_base::ok:
-				case std::codecvt_base::partial:
-					if (from_next == from_end) // converted all
+					ext_start += ext.size();
+					++ext_index;
+					continue;
+				}
+
+				constexpr size_t carry_size = 16;
+
+				if (static_cast<size_t>(buffer_end - buffer_fend) < carry_size)
+				{
+					extend_buffer((buffer_end - buffer_start) + carry_size);
+				}
+
+				const char* from = ext.data() + (pos - ext_start);
+				const char* from_end = ext.data() + ext.size();
+
+				if constexpr (utf8_capable)
+				{
+					if (utf8_cvt && _is_initial(convstate))
 					{
-						const size_t count = out_buf.size();
-						CharT* out = new CharT[count];
-						memcpy(out, out_buf.data(), count * sizeof(CharT));
+						utf8::result converted = utf8::decode(from, from_end - from, buffer_fend, buffer_end - buffer_fend);
+
+						if (converted.read == 0 && converted.code == utf8::status::incomplete)
+						{
+							// Char continues in next extent
+							char carry[4];
+							size_t carry_count = snapshot.copy_to(carry, pos, sizeof(carry));
+
+							converted = utf8::decode(carry, carry_count, buffer_fend, 1);
+						}
+
+						pos += converted.read;
+						buffer_fend += converted.written;
+
+						if (converted.read != 0 || converted.code == utf8::status::ok)
+						{
+							continue;
+						}
+
+						// Let facet handle truncated or invalid char
+					}
+				}
+				const char* from_next = from;
+				CharT* out_next = buffer_fend;
+				size_t consumed;
+
+				std::codecvt_base::result result = mycvt
+					? mycvt->in(convstate, from, from_end, from_next, buffer_fend, buffer_end, out_next)
+					: std::codecvt_base::noconv;
+
+				if (result == std::codecvt_base::partial && from_next == from && out_next == buffer_fend)
+				{
+					// Incomplete char at the end of extent, convert it
+					// from copy of bytes which follow in next extents
+					char carry[carry_size];
+					size_t carry_count = snapshot.copy_to(carry, pos, carry_size);
+					const char* carry_next = carry;
+
+					result = mycvt->in(convstate, carry, carry + carry_count, carry_next, buffer_fend, buffer_end, out_next);
 
-						converted = out;
-						return count;
+					if (carry_next == carry) // truncated or too long char
+					{
+						return false;
 					}
 
-					// Append converted part
-					out_buf.append(tmp_buf, tmp_buf_next - tmp_buf);
+					consumed = carry_next - carry;
+				}
+				else
+				{
+					consumed = from_next - from;
+				}
+
+				switch (result)
+				{
+				case std::codecvt_base::ok:
+				case std::codecvt_base::partial:
+					pos += consumed;
+					buffer_fend = out_next;
 					break;
 
 				case std::codecvt_base::noconv: // no convertion needed
-					goto noconv;
+				{
+					size_t count = (size - pos) / sizeof(CharT);
+
+					if (static_cast<size_t>(buffer_end - buffer_fend) < count)
+					{
+						extend_buffer((buffer_fend - buffer_start) + count);
+					}
+
+					snapshot.copy_to(reinterpret_cast<char*>(buffer_fend), pos, count * sizeof(CharT));
+					buffer_fend += count;
+
+					return true;
+				}
 
 				default: // failed convertion
-					converted = nullptr;
-					return 0;
+					return false;
 				}
 			}
+
+			return true;
 		}
 	};
 
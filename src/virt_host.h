@@ -0,0 +1,340 @@
+#pragma once
+
+#include "file_entries.h"
+#include "virt_exceptions.h"
+#include "virt_image.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VIRTFILES_HOST_OVERLAY
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#ifdef VIRTFILES_HOST_OVERLAY
+namespace virtfiles
+{
+	// File of host directory. Its content is mapped from host file when
+	// it's first read, so files which are not opened cost nothing.
+	// If overlay writes back, changed content replaces host file
+	// when stream which opened the file is closed. Host file is found
+	// by path the file has then, so renamed and moved files are saved
+	// to their new place, and files moved out of overlay aren't saved
+	class host_file_t : public file_t
+	{
+	protected:
+		static constexpr size_t never_saved = ~size_t{ 0 };
+
+		std::string host_path; // where content is loaded from
+		bool write_back;
+		std::atomic<size_t> saved_version; // version which host file has
+
+		mutex_t save_mutex; // serializes write backs
+
+	public:
+		// on_host is set if host file exists, otherwise it's created on first write back
+		host_file_t(std::string_view name, folder_t* parent, std::pmr::memory_resource* resource,
+			std::string host_path, bool write_back, bool on_host)
+			: file_t(name, parent, resource), host_path(std::move(host_path)),
+			write_back(write_back), saved_version(on_host ? 0 : never_saved)
+		{
+			content.reset(); // loaded on first access
+		}
+
+		const std::string& get_host_path() const
+		{
+			return host_path;
+		}
+
+		bool is_loaded() const
+		{
+			return load_shared(content) != nullptr;
+		}
+
+		bool _on_close() override
+		{
+			// Unloaded file wasn't modified, unless it's new
+			if (!write_back || (!is_loaded() && saved_version.load(std::memory_order_relaxed) != never_saved))
+			{
+				return true;
+			}
+
+			exclusive_lock lock(save_mutex);
+			content_snapshot current = snapshot();
+
+			if (current.get_version() == saved_version.load(std::memory_order_relaxed))
+			{
+				return true;
+			}
+
+			std::string target = _target_path();
+
+			if (target.empty()) // moved out of folders which write back
+			{
+				return true;
+			}
+
+			if (!_save(current, target))
+			{
+				return false;
+			}
+
+			saved_version.store(current.get_version(), std::memory_order_relaxed);
+			return true;
+		}
+
+	protected:
+		std::shared_ptr<const file_content> _load_content() override
+		{
+			auto loaded = std::make_shared<file_content>();
+
+			if (saved_version.load(std::memory_order_relaxed) == never_saved)
+			{
+				return loaded;
+			}
+
+			auto map = std::make_shared<image::mapping>(host_path.c_str());
+			loaded->assign_external(map->data(), map->size(), map);
+
+			return loaded;
+		}
+
+	private:
+		// Defined after host_folder_t
+		std::string _target_path() const;
+
+		// Write content to temporary file and move it over host file at target,
+		// so host file is replaced atomically and its old mapping stays valid
+		static bool _save(const content_snapshot& current, const std::string& target)
+		{
+			_make_parents(target);
+
+			std::string temp_path = target + ".virtfiles-tmp";
+			FILE* file = std::fopen(temp_path.c_str(), "wb");
+
+			if (!file)
+			{
+				return false;
+			}
+
+			bool written = true;
+
+			for (size_t i = 0; i < current.get_extent_count() && written; ++i)
+			{
+				std::string_view extent = current.get_extent(i);
+				written = std::fwrite(extent.data(), 1, extent.size(), file) == extent.size();
+			}
+
+			if (std::fclose(file) != 0 || !written || std::rename(temp_path.c_str(), target.c_str()) != 0)
+			{
+				std::remove(temp_path.c_str());
+				return false;
+			}
+
+			return true;
+		}
+
+		// Create host directories of folders made in memory
+		static void _make_parents(const std::string& target)
+		{
+			for (size_t i = target.find('/', 1); i != std::string::npos; i = target.find('/', i + 1))
+			{
+				::mkdir(target.substr(0, i).c_str(), 0777); // fails if exists
+			}
+		}
+	};
+
+	// Folder showing host directory. Its entries are listed from host
+	// when folder is first accessed, subfolders are listed when they are
+	// accessed in turn. Entries created in it belong to host directory as well.
+	// Host names which are not valid names of entries or equal after case
+	// folding to already listed one are skipped, links are followed
+	class host_folder_t : public folder_t
+	{
+	protected:
+		std::string host_path; // where entries are listed from
+		bool write_back;
+		bool mount_point; // made by mount_host, not listed from host
+
+	public:
+		host_folder_t(std::string_view name, folder_t* parent, std::pmr::memory_resource* resource,
+			std::string host_path, bool write_back, bool mount_point = false)
+			: folder_t(name, parent, resource), host_path(std::move(host_path)),
+			write_back(write_back), mount_point(mount_point)
+		{
+			listed.store(false, std::memory_order_relaxed);
+			log = nullptr; // host keeps the state
+		}
+
+		const std::string& get_host_path() const
+		{
+			return host_path;
+		}
+
+		bool writes_back() const
+		{
+			return write_back;
+		}
+
+		// Host path of entry by names of folders it is in now up to mount point,
+		// empty if some of them is not host folder which writes back
+		static std::string _current_host_path(const base_entry& entry)
+		{
+			read_lock relinking(relink_mutex); // names and parents don't change
+			std::string path = entry.get_name();
+
+			for (host_folder_t* folder = dynamic_cast<host_folder_t*>(entry.get_parent()); folder && folder->write_back;
+				folder = dynamic_cast<host_folder_t*>(folder->get_parent()))
+			{
+				if (folder->mount_point)
+				{
+					return folder->_host_path_of(path);
+				}
+
+				path = std::string(folder->get_name()) + '/' + path;
+			}
+
+			return std::string();
+		}
+
+	protected:
+		file_t* _new_file(std::string_view name) override
+		{
+			return new (resource) host_file_t(name, this, resource, _host_path_of(name), write_back, false);
+		}
+
+		folder_t* _new_folder(std::string_view name) override
+		{
+			return new (resource) host_folder_t(name, this, resource, _host_path_of(name), write_back);
+		}
+
+		void _list() override
+		{
+			write_lock lock(entries_mutex);
+
+			if (listed.load(std::memory_order_relaxed))
+			{
+				return;
+			}
+
+			std::unique_ptr<DIR, int (*)(DIR*)> dir(::opendir(host_path.c_str()), &::closedir);
+
+			// Folder made in memory has no host directory yet
+			if (!dir && errno != ENOENT)
+			{
+				throw filesystem_exception(errno, std::generic_category(), host_path);
+			}
+
+			while (dir)
+			{
+				errno = 0;
+				dirent* item = ::readdir(dir.get());
+
+				if (!item)
+				{
+					if (errno != 0)
+					{
+						throw filesystem_exception(errno, std::generic_category(), host_path);
+					}
+
+					break;
+				}
+
+				std::string_view name = item->d_name;
+
+				if (name == "." || name == ".." || !check_name(name.data(), name.size()))
+				{
+					continue;
+				}
+
+				std::string path = _host_path_of(name);
+				bool is_folder;
+
+				if (!_host_type(*item, path, is_folder))
+				{
+					continue;
+				}
+
+				std::unique_ptr<base_entry> entry(is_folder
+					? static_cast<base_entry*>(new (resource) host_folder_t(name, this, resource, std::move(path), write_back))
+					: new (resource) host_file_t(name, this, resource, std::move(path), write_back, true));
+
+				if (index.find(entry->get_folded_name()) == index.end())
+				{
+					_add_entry_locked(entry.release());
+				}
+			}
+
+			listed.store(true, std::memory_order_release);
+		}
+
+	private:
+		std::string _host_path_of(std::string_view name) const
+		{
+			std::string path = host_path;
+
+			if (path.empty() || path.back() != '/')
+			{
+				path += '/';
+			}
+
+			path += name;
+
+			return path;
+		}
+
+		// Find if host entry is directory or regular file, false for other ones
+		static bool _host_type(const dirent& item, const std::string& path, bool& is_folder)
+		{
+#ifdef _DIRENT_HAVE_D_TYPE
+			switch (item.d_type)
+			{
+			case DT_DIR:
+				is_folder = true;
+				return true;
+			case DT_REG:
+				is_folder = false;
+				return true;
+			case DT_LNK:
+			case DT_UNKNOWN:
+				break;
+			default:
+				return false;
+			}
+#else
+			(void)item;
+#endif
+			struct stat info;
+
+			if (::stat(path.c_str(), &info) != 0)
+			{
+				return false;
+			}
+
+			is_folder = S_ISDIR(info.st_mode);
+
+			return is_folder || S_ISREG(info.st_mode);
+		}
+	};
+
+	// Add folder named name to parent, which shows host directory at host_path.
+	// Nothing is read from host until entries are accessed. Changes are kept
+	// in memory, and also written to host when streams are closed if write_back is set
+	inline host_folder_t& mount_host(folder_t& parent, std::string_view name,
+		std::string host_path, bool write_back = false)
+	{
+		return parent._createEntry<host_folder_t>(name, std::move(host_path), write_back, true);
+	}
+
+	inline std::string host_file_t::_target_path() const
+	{
+		return host_folder_t::_current_host_path(*this);
+	}
+};
+#endif
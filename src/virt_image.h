@@ -0,0 +1,408 @@
+#pragma once
+
+#include "file_entries.h"
+#include "virt_exceptions.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VIRTFILES_IMAGE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace virtfiles
+{
+	// Image of folder tree stored in a file:
+	//   header
+	//   entry table - entries in preorder, so parents are before children
+	//   name pool   - names of entries
+	//   content     - bytes of files
+	// Loaded files refer to content in mapped image instead of copying it.
+	// Numbers are in native byte order, images of other platforms are rejected
+	namespace image
+	{
+		constexpr char magic[8] = { 'V', 'F', 'S', 'I', 'M', 'A', 'G', 'E' };
+		constexpr uint32_t format_version = 1;
+		constexpr uint32_t byte_order_mark = 0x01020304;
+
+		// Parent of entries which are directly in saved folder
+		constexpr uint64_t no_parent = ~uint64_t{ 0 };
+
+		enum class entry_kind : uint32_t
+		{
+			folder = 0,
+			file = 1
+		};
+
+		struct header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t byte_order;
+			uint64_t entry_count;
+			uint64_t entries_offset;
+			uint64_t names_offset;
+			uint64_t names_size;
+			uint64_t content_offset;
+			uint64_t content_size;
+		};
+
+		// Offsets are relative to start of their section
+		struct entry_record
+		{
+			uint64_t parent; // index of parent folder entry or no_parent
+			uint64_t name_offset;
+			uint64_t content_offset;
+			uint64_t content_size;
+			uint32_t name_size;
+			entry_kind kind;
+		};
+
+		static_assert(sizeof(header) == 64, "image header must have no padding");
+		static_assert(sizeof(entry_record) == 40, "image entry must have no padding");
+
+		// Whole image file mapped privately: pages modified
+		// through loaded files are copied by the OS, file stays intact.
+		// Image is read to memory where mapping is not available
+		class mapping
+		{
+		protected:
+			char* bytes;
+			size_t byte_count;
+
+		public:
+			explicit mapping(const char* path)
+				: bytes(nullptr), byte_count(0)
+			{
+#ifdef VIRTFILES_IMAGE_MMAP
+				int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+
+				if (fd < 0)
+				{
+					throw filesystem_exception(errno, std::generic_category(), path);
+				}
+
+				struct stat info;
+
+				if (::fstat(fd, &info) != 0)
+				{
+					int error = errno;
+					::close(fd);
+					throw filesystem_exception(error, std::generic_category(), path);
+				}
+
+				byte_count = static_cast<size_t>(info.st_size);
+
+				if (byte_count != 0)
+				{
+					void* p = ::mmap(nullptr, byte_count, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+					if (p == MAP_FAILED)
+					{
+						int error = errno;
+						::close(fd);
+						throw filesystem_exception(error, std::generic_category(), path);
+					}
+
+					bytes = static_cast<char*>(p);
+				}
+
+				::close(fd); // mapping stays valid
+#else
+				std::unique_ptr<FILE, int (*)(FILE*)> file(std::fopen(path, "rb"), &std::fclose);
+
+				if (!file)
+				{
+					throw filesystem_exception(errno, std::generic_category(), path);
+				}
+
+				if (std::fseek(file.get(), 0, SEEK_END) != 0)
+				{
+					throw filesystem_exception(errno, std::generic_category(), path);
+				}
+
+				long size = std::ftell(file.get());
+
+				if (size < 0 || std::fseek(file.get(), 0, SEEK_SET) != 0)
+				{
+					throw filesystem_exception(errno, std::generic_category(), path);
+				}
+
+				byte_count = static_cast<size_t>(size);
+				bytes = new char[byte_count ? byte_count : 1];
+
+				if (std::fread(bytes, 1, byte_count, file.get()) != byte_count)
+				{
+					delete[] bytes;
+					throw filesystem_exception(EIO, std::generic_category(), path);
+				}
+#endif
+			}
+
+			mapping(const mapping&) = delete;
+			mapping& operator=(const mapping&) = delete;
+
+			~mapping()
+			{
+#ifdef VIRTFILES_IMAGE_MMAP
+				if (bytes)
+				{
+					::munmap(bytes, byte_count);
+				}
+#else
+				delete[] bytes;
+#endif
+			}
+
+			char* data() const
+			{
+				return bytes;
+			}
+
+			size_t size() const
+			{
+				return byte_count;
+			}
+		};
+
+		namespace detail
+		{
+			// Name is copied, so entries may be written after tree is changed
+			struct pending_entry
+			{
+				std::string name;
+				uint64_t parent;
+				bool is_file;
+				content_snapshot content;
+			};
+
+			// List entries of folder and its subfolders in preorder,
+			// entries for which include returns false are skipped with their subtrees
+			template <class Include>
+			void collect(folder_t& folder, uint64_t parent, std::vector<pending_entry>& out, Include include)
+			{
+				for (base_entry* entry : folder.get_items())
+				{
+					if (!include(*entry))
+					{
+						continue;
+					}
+
+					uint64_t index = out.size();
+
+					if (entry->is_file())
+					{
+						out.push_back({ entry->get_name(), parent, true, entry->as_file().snapshot() });
+					}
+					else
+					{
+						out.push_back({ entry->get_name(), parent, false, content_snapshot() });
+						collect(entry->as_folder(), index, out, include);
+					}
+				}
+			}
+
+			inline void write(FILE* file, const void* bytes, size_t count, const char* path)
+			{
+				if (count != 0 && std::fwrite(bytes, 1, count, file) != count)
+				{
+					throw filesystem_exception(errno ? errno : EIO, std::generic_category(), path);
+				}
+			}
+
+			// Range is inside of section of given size
+			inline bool in_bounds(uint64_t offset, uint64_t size, uint64_t section_size)
+			{
+				return offset <= section_size && size <= section_size - offset;
+			}
+
+			// Write image of collected entries at current position of file, returns its size.
+			// Position must be 8 byte aligned, so content is aligned in mapped image
+			inline uint64_t write_image(FILE* file, const std::vector<pending_entry>& entries, const char* path)
+			{
+				header head{};
+				memcpy(head.magic, magic, sizeof(head.magic));
+				head.version = format_version;
+				head.byte_order = byte_order_mark;
+				head.entry_count = entries.size();
+				head.entries_offset = sizeof(header);
+				head.names_offset = head.entries_offset + entries.size() * sizeof(entry_record);
+
+				std::vector<entry_record> records(entries.size());
+
+				for (size_t i = 0; i < entries.size(); ++i)
+				{
+					entry_record& record = records[i];
+					const pending_entry& entry = entries[i];
+
+					record.parent = entry.parent;
+					record.name_offset = head.names_size;
+					record.name_size = static_cast<uint32_t>(entry.name.size());
+					record.kind = entry.is_file ? entry_kind::file : entry_kind::folder;
+					record.content_offset = head.content_size;
+					record.content_size = entry.content.size();
+
+					head.names_size += record.name_size;
+					head.content_size += record.content_size;
+				}
+
+				// Content starts at 8 byte boundary
+				size_t padding = (8 - (head.names_offset + head.names_size) % 8) % 8;
+				head.content_offset = head.names_offset + head.names_size + padding;
+
+				write(file, &head, sizeof(head), path);
+				write(file, records.data(), records.size() * sizeof(entry_record), path);
+
+				for (const pending_entry& entry : entries)
+				{
+					write(file, entry.name.data(), entry.name.size(), path);
+				}
+
+				static const char zeros[8]{};
+				write(file, zeros, padding, path);
+
+				for (const pending_entry& entry : entries)
+				{
+					for (size_t i = 0; i < entry.content.get_extent_count(); ++i)
+					{
+						std::string_view extent = entry.content.get_extent(i);
+						write(file, extent.data(), extent.size(), path);
+					}
+				}
+
+				return head.content_offset + head.content_size;
+			}
+
+			// Add entries of image at bytes, which are part of map, to folder
+			inline void load_image(folder_t& folder, const std::shared_ptr<mapping>& map,
+				char* bytes, uint64_t size, const char* path)
+			{
+				header head;
+
+				if (size < sizeof(head))
+				{
+					throw invalid_image_error(path);
+				}
+
+				memcpy(&head, bytes, sizeof(head));
+
+				if (memcmp(head.magic, magic, sizeof(head.magic)) != 0
+					|| head.version != format_version
+					|| head.byte_order != byte_order_mark
+					|| head.entry_count > size / sizeof(entry_record)
+					|| !in_bounds(head.entries_offset, head.entry_count * sizeof(entry_record), size)
+					|| !in_bounds(head.names_offset, head.names_size, size)
+					|| !in_bounds(head.content_offset, head.content_size, size))
+				{
+					throw invalid_image_error(path);
+				}
+
+				const char* names = bytes + head.names_offset;
+				char* content = bytes + head.content_offset;
+
+				// Folder created for each entry, null for files
+				std::vector<folder_t*> folders(static_cast<size_t>(head.entry_count), nullptr);
+
+				for (size_t i = 0; i < folders.size(); ++i)
+				{
+					entry_record record;
+					memcpy(&record, bytes + head.entries_offset + i * sizeof(record), sizeof(record));
+
+					folder_t* parent = &folder;
+
+					if (record.parent != no_parent)
+					{
+						if (record.parent >= i || !folders[static_cast<size_t>(record.parent)])
+						{
+							throw invalid_image_error(path);
+						}
+
+						parent = folders[static_cast<size_t>(record.parent)];
+					}
+
+					if (!in_bounds(record.name_offset, record.name_size, head.names_size))
+					{
+						throw invalid_image_error(path);
+					}
+
+					std::string_view name(names + record.name_offset, record.name_size);
+
+					switch (record.kind)
+					{
+					case entry_kind::folder:
+						folders[i] = &parent->_createFolder(name);
+						break;
+					case entry_kind::file:
+					{
+						if (!in_bounds(record.content_offset, record.content_size, head.content_size))
+						{
+							throw invalid_image_error(path);
+						}
+
+						file_t& file = parent->_createFile(name);
+
+						file.writeWith([&](file_content& next)
+						{
+							next.assign_external(content + record.content_offset,
+								static_cast<size_t>(record.content_size), map);
+							return true;
+						});
+						break;
+					}
+					default:
+						throw invalid_image_error(path);
+					}
+				}
+			}
+		};
+	};
+
+	// Write folder tree to image file. Folders must not be modified
+	// while it is saved, file contents are saved as they were when listed
+	inline void save_image(folder_t& folder, const char* path)
+	{
+		std::vector<image::detail::pending_entry> entries;
+		image::detail::collect(folder, image::no_parent, entries, [](base_entry&) { return true; });
+
+		std::unique_ptr<FILE, int (*)(FILE*)> file(std::fopen(path, "wb"), &std::fclose);
+
+		if (!file)
+		{
+			throw filesystem_exception(errno, std::generic_category(), path);
+		}
+
+		image::detail::write_image(file.get(), entries, path);
+
+		if (std::fclose(file.release()) != 0)
+		{
+			throw filesystem_exception(errno, std::generic_category(), path);
+		}
+	}
+
+	// Add entries of image file to folder. Contents of files refer to
+	// mapped image, which is unmapped when no content refers to it
+	inline void load_image(folder_t& folder, const char* path)
+	{
+		auto map = std::make_shared<image::mapping>(path);
+
+		image::detail::load_image(folder, map, map->data(), map->size(), path);
+	}
+
+	inline void filesystem::load_image(const char* path)
+	{
+		virtfiles::load_image(*root, path);
+	}
+
+	inline void filesystem::save_image(const char* path)
+	{
+		virtfiles::save_image(*root, path);
+	}
+};
@@ -0,0 +1,1074 @@
+#pragma once
+
+#include "file_entries.h"
+#include "virt_exceptions.h"
+#include "virt_image.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VIRTFILES_JOURNAL
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace virtfiles
+{
+	struct journal_options
+	{
+		// Modifications return when their records are on disk. Otherwise
+		// records are written in background, at most commit_delay apart
+		bool wait_for_commit = true;
+
+		std::chrono::milliseconds commit_delay{ 10 };
+
+		// Size of records after last checkpoint which starts next one
+		size_t checkpoint_size = 64 << 20;
+	};
+
+#ifdef VIRTFILES_JOURNAL
+	// Append-only file of file system modifications:
+	//   header
+	//   image   - checkpoint of tree, see virt_image.h
+	//   records - operations made after checkpoint
+	// Records are gathered in memory and written by commit thread, all
+	// records made while it waits for disk are committed by its next write.
+	// When records grow past checkpoint_size, checkpoint thread lists tree
+	// (modifications wait only for that) and writes its image to new file.
+	// Records made meanwhile are copied after the image, and the new file
+	// replaces the journal by rename, so journal is valid at any moment.
+	// Folders which don't inherit journal, like host ones, are not recorded
+	class journal
+	{
+		friend class journal_scope;
+
+	public:
+		struct header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t byte_order;
+			uint64_t image_size; // image right after header, 0 if there is none
+			uint64_t reserved;
+		};
+
+		// Followed by path of entry relative to root and data
+		struct record_header
+		{
+			uint64_t checksum; // of rest of record
+			uint64_t offset;
+			uint64_t data_size;
+			uint32_t path_size;
+			journal_operation operation;
+			uint8_t padding[3];
+		};
+
+		static_assert(sizeof(header) == 32, "journal header must have no padding");
+		static_assert(sizeof(record_header) == 32, "journal record must have no padding");
+
+		static constexpr char magic[8] = { 'V', 'F', 'S', 'J', 'R', 'N', 'L', 'S' };
+		static constexpr uint32_t format_version = 1;
+
+		// Size of records which are committed without waiting for commit_delay,
+		// so they are written while they are still in cache
+		static constexpr size_t batch_size = 256 << 10;
+
+	protected:
+		// Byte buffer which doesn't initialize added bytes
+		class buffer
+		{
+		protected:
+			std::unique_ptr<char[]> bytes;
+			size_t used = 0;
+			size_t capacity = 0;
+
+		public:
+			char* extend(size_t count)
+			{
+				if (capacity - used < count)
+				{
+					size_t next_capacity = capacity * 2 > used + count ? capacity * 2 : used + count;
+					std::unique_ptr<char[]> next(new char[next_capacity]);
+
+					if (used != 0)
+					{
+						memcpy(next.get(), bytes.get(), used);
+					}
+
+					bytes = std::move(next);
+					capacity = next_capacity;
+				}
+
+				char* out = bytes.get() + used;
+				used += count;
+
+				return out;
+			}
+
+			void append(const char* from, size_t count)
+			{
+				memcpy(extend(count), from, count);
+			}
+
+			void resize(size_t size)
+			{
+				used = size;
+			}
+
+			// Big buffers are freed, not kept for reuse
+			void clear()
+			{
+				if (capacity > (16 << 20))
+				{
+					bytes.reset();
+					capacity = 0;
+				}
+
+				used = 0;
+			}
+
+			void swap(buffer& other)
+			{
+				std::swap(bytes, other.bytes);
+				std::swap(used, other.used);
+				std::swap(capacity, other.capacity);
+			}
+
+			const char* data() const
+			{
+				return bytes.get();
+			}
+
+			size_t size() const
+			{
+				return used;
+			}
+		};
+
+		folder_t& root;
+		std::string path;
+		journal_options options;
+		int fd; // journal file, used by commit thread once it runs
+
+		// Held shared by modifications, exclusively by checkpoint while it lists tree
+		std::shared_mutex freeze;
+
+		std::mutex mutex; // guards all below
+		std::condition_variable commit_needed;
+		std::condition_variable committed;
+		std::condition_variable checkpoint_needed;
+		std::condition_variable checkpointed;
+
+		buffer pending;          // records not written yet
+		uint64_t pending_start;  // position of pending records since journal was opened
+		uint64_t durable;        // records before this position are on disk
+		size_t record_bytes;     // size of records after last checkpoint
+
+		buffer retained;         // records made while checkpoint is written
+		bool retaining;
+		buffer switch_records;   // retained records handed to commit thread
+		int switch_fd;           // new journal file which commit thread switches to
+		uint64_t switch_at;      // position of first record which isn't retained
+		bool switched;
+
+		bool checkpoint_requested;
+		uint64_t checkpoint_count; // finished checkpoints, also failed ones
+		int checkpoint_error;
+
+		int error; // of failed commit, later modifications fail too
+		bool stopping;
+		bool closing;
+
+		std::thread committer;
+		std::thread checkpointer;
+
+	public:
+		// Restore state of root from journal file, or create it if there is none,
+		// then record modifications of root to it. Root must be empty
+		journal(folder_t& root, std::string path, const journal_options& options = journal_options())
+			: root(root), path(std::move(path)), options(options), fd(-1),
+			pending_start(0), durable(0), record_bytes(0), retaining(false), switch_fd(-1), switch_at(0), switched(false),
+			checkpoint_requested(false), checkpoint_count(0), checkpoint_error(0),
+			error(0), stopping(false), closing(false)
+		{
+			const char* file_path = this->path.c_str();
+			std::remove(_next_path().c_str()); // unfinished checkpoint
+
+			struct stat info;
+
+			if (::stat(file_path, &info) == 0)
+			{
+				_replay();
+			}
+			else if (errno == ENOENT)
+			{
+				_create();
+			}
+			else
+			{
+				throw filesystem_exception(errno, std::generic_category(), file_path);
+			}
+
+			fd = ::open(file_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+
+			if (fd < 0)
+			{
+				throw filesystem_exception(errno, std::generic_category(), file_path);
+			}
+
+			root._set_journal(this);
+
+			committer = std::thread([this] { _commit_loop(); });
+			checkpointer = std::thread([this] { _checkpoint_loop(); });
+		}
+
+		journal(const journal&) = delete;
+		journal& operator=(const journal&) = delete;
+
+		// Commits remaining records. Root must not be modified anymore
+		~journal()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+
+			checkpoint_needed.notify_all();
+			checkpointer.join();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				closing = true;
+			}
+
+			commit_needed.notify_all();
+			committer.join();
+
+			::close(fd);
+			root._set_journal(nullptr);
+		}
+
+		const std::string& get_path() const
+		{
+			return path;
+		}
+
+		const journal_options& get_options() const
+		{
+			return options;
+		}
+
+		// Wait until all records made so far are on disk
+		void flush()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			_wait_locked(lock, pending_start + pending.size());
+		}
+
+		// Checkpoint tree now and wait until journal file is replaced
+		void checkpoint()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			checkpointed.wait(lock, [this] { return !checkpoint_requested; });
+
+			uint64_t count = checkpoint_count;
+			checkpoint_requested = true;
+			checkpoint_needed.notify_one();
+
+			checkpointed.wait(lock, [this, count] { return checkpoint_count != count; });
+
+			if (checkpoint_error)
+			{
+				throw filesystem_exception(checkpoint_error, std::generic_category(), path);
+			}
+		}
+
+		uint64_t get_checkpoint_count()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			return checkpoint_count;
+		}
+
+	protected:
+		std::string _next_path() const
+		{
+			return path + ".next";
+		}
+
+		// Hash of record, words are hashed at once, so it keeps up with disk
+		static uint64_t _checksum(const char* bytes, size_t count)
+		{
+			constexpr uint64_t prime = 0x100000001b3;
+			uint64_t hash = 0xcbf29ce484222325;
+
+			for (; count >= 8; bytes += 8, count -= 8)
+			{
+				uint64_t word;
+				memcpy(&word, bytes, 8);
+				hash = (hash ^ word) * prime;
+				hash ^= hash >> 29;
+			}
+
+			for (; count != 0; ++bytes, --count)
+			{
+				hash = (hash ^ static_cast<unsigned char>(*bytes)) * prime;
+			}
+
+			return hash;
+		}
+
+		static size_t _path_size(const base_entry& entry)
+		{
+			size_t size = 0;
+
+			for (const base_entry* i = &entry; i->get_parent(); i = i->get_parent())
+			{
+				size += strlen(i->get_name()) + 1;
+			}
+
+			return size != 0 ? size - 1 : 0;
+		}
+
+		// Write names from entry up to root backwards, separated by '/'
+		static void _write_path(const base_entry& entry, char* out, size_t size)
+		{
+			char* end = out + size;
+
+			for (const base_entry* i = &entry; i->get_parent(); i = i->get_parent())
+			{
+				size_t name_size = strlen(i->get_name());
+				end -= name_size;
+				memcpy(end, i->get_name(), name_size);
+
+				if (end != out)
+				{
+					*--end = '/';
+				}
+			}
+		}
+
+		// Add record to pending ones, returns journal position after it.
+		// Must be called while entry is locked, so its records are in order
+		template <class Write>
+		uint64_t _append(journal_operation operation, const base_entry& entry,
+			uint64_t offset, size_t data_size, Write write_data)
+		{
+			size_t path_size = _path_size(entry);
+			size_t record_size = sizeof(record_header) + path_size + data_size;
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (error)
+			{
+				throw filesystem_exception(error, std::generic_category(), path);
+			}
+
+			size_t start = pending.size();
+			char* out = pending.extend(record_size);
+
+			record_header head{};
+			head.offset = offset;
+			head.data_size = data_size;
+			head.path_size = static_cast<uint32_t>(path_size);
+			head.operation = operation;
+
+			memcpy(out, &head, sizeof(head));
+			_write_path(entry, out + sizeof(head), path_size);
+			write_data(out + sizeof(head) + path_size);
+
+			head.checksum = _checksum(out + sizeof(head.checksum), record_size - sizeof(head.checksum));
+			memcpy(out, &head.checksum, sizeof(head.checksum));
+
+			if (retaining)
+			{
+				try
+				{
+					retained.append(out, record_size);
+				}
+				catch (...)
+				{
+					pending.resize(start);
+					throw;
+				}
+			}
+
+			record_bytes += record_size;
+
+			if (record_bytes > options.checkpoint_size && !checkpoint_requested)
+			{
+				checkpoint_requested = true;
+				checkpoint_needed.notify_one();
+			}
+
+			// Commit thread waits for first record of batch, or for full batch if it commits with delay
+			if (options.wait_for_commit ? start == 0 : start < batch_size && pending.size() >= batch_size)
+			{
+				commit_needed.notify_one();
+			}
+
+			return pending_start + pending.size();
+		}
+
+		// Failed commits without waiting are reported by next modifications
+		void _wait(uint64_t end)
+		{
+			if (options.wait_for_commit)
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				_wait_locked(lock, end);
+			}
+		}
+
+		void _wait_locked(std::unique_lock<std::mutex>& lock, uint64_t end)
+		{
+			committed.wait(lock, [this, end] { return durable >= end || error; });
+
+			if (error)
+			{
+				throw filesystem_exception(error, std::generic_category(), path);
+			}
+		}
+
+		static int _sync(int file)
+		{
+#ifdef __APPLE__
+			return ::fsync(file) == 0 ? 0 : errno;
+#else
+			return ::fdatasync(file) == 0 ? 0 : errno;
+#endif
+		}
+
+		// Make rename in directory of journal durable
+		int _sync_directory() const
+		{
+			size_t slash = path.rfind('/');
+			std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+
+			int dir = ::open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+
+			if (dir < 0)
+			{
+				return errno;
+			}
+
+			int result = ::fsync(dir) == 0 ? 0 : errno;
+			::close(dir);
+
+			return result;
+		}
+
+		// Write records and wait until they are on disk
+		static int _commit(int file, const char* bytes, size_t count)
+		{
+			if (count == 0)
+			{
+				return 0;
+			}
+
+			int result = _write_all(file, bytes, count);
+
+			return result ? result : _sync(file);
+		}
+
+		static int _write_all(int file, const char* bytes, size_t count)
+		{
+			while (count != 0)
+			{
+				ssize_t written = ::write(file, bytes, count);
+
+				if (written < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+
+					return errno;
+				}
+
+				bytes += written;
+				count -= static_cast<size_t>(written);
+			}
+
+			return 0;
+		}
+
+		void _commit_loop()
+		{
+			buffer batch;
+			buffer carried;
+			std::unique_lock<std::mutex> lock(mutex);
+
+			for (;;)
+			{
+				commit_needed.wait(lock, [this] { return closing || pending.size() != 0 || switch_fd >= 0; });
+
+				if (pending.size() == 0 && switch_fd < 0)
+				{
+					return; // closing
+				}
+
+				batch.swap(pending);
+				uint64_t batch_start = pending_start;
+				uint64_t batch_end = pending_start + batch.size();
+				pending_start = batch_end;
+
+				int next_fd = switch_fd;
+				switch_fd = -1;
+				carried.swap(switch_records);
+
+				// Records before switch go to current file, later ones to the new one
+				size_t split = next_fd >= 0 ? static_cast<size_t>(switch_at - batch_start) : batch.size();
+
+				bool failed_before = error != 0;
+				lock.unlock();
+
+				// After failure records are dropped, their modifications failed
+				int result = failed_before ? 0 : _commit(fd, batch.data(), split);
+				int switch_result = 0;
+
+				if (next_fd >= 0)
+				{
+					switch_result = _switch(next_fd, carried, failed_before || result);
+
+					if (!failed_before && !result)
+					{
+						result = _commit(fd, batch.data() + split, batch.size() - split);
+					}
+				}
+
+				batch.clear();
+				carried.clear();
+				lock.lock();
+
+				if (result && !error)
+				{
+					error = result;
+				}
+
+				durable = batch_end;
+
+				if (next_fd >= 0)
+				{
+					checkpoint_error = switch_result;
+					switched = true;
+				}
+
+				committed.notify_all();
+
+				if (!options.wait_for_commit && !closing)
+				{
+					commit_needed.wait_for(lock, options.commit_delay, [this]
+					{
+						return closing || switch_fd >= 0 || pending.size() >= batch_size;
+					});
+				}
+			}
+		}
+
+		// Replace journal with checkpointed one, which gets records made since
+		// checkpoint. Journal stays as it is if anything fails, it's still valid
+		int _switch(int next_fd, const buffer& records, bool abandon)
+		{
+			std::string next_path = _next_path();
+			int result = abandon ? EIO : _commit(next_fd, records.data(), records.size());
+
+			if (!result && std::rename(next_path.c_str(), path.c_str()) != 0)
+			{
+				result = errno;
+			}
+
+			if (result)
+			{
+				::close(next_fd);
+				std::remove(next_path.c_str());
+				return result;
+			}
+
+			_sync_directory();
+
+			::close(fd);
+			fd = next_fd;
+
+			return 0;
+		}
+
+		void _checkpoint_loop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			for (;;)
+			{
+				checkpoint_needed.wait(lock, [this] { return stopping || checkpoint_requested; });
+
+				if (stopping)
+				{
+					checkpoint_requested = false;
+					++checkpoint_count;
+					checkpoint_error = ECANCELED;
+					checkpointed.notify_all();
+					return;
+				}
+
+				checkpoint_error = 0;
+				lock.unlock();
+
+				int result = _checkpoint();
+
+				lock.lock();
+
+				if (result)
+				{
+					checkpoint_error = result;
+				}
+
+				checkpoint_requested = false;
+				++checkpoint_count;
+				checkpointed.notify_all();
+			}
+		}
+
+		// Write image of tree to new journal file and let commit thread switch to it
+		int _checkpoint()
+		{
+			std::vector<image::detail::pending_entry> entries;
+
+			{
+				std::unique_lock<std::shared_mutex> frozen(freeze);
+
+				image::detail::collect(root, image::no_parent, entries, [this](base_entry& entry)
+				{
+					return !entry.is_folder() || entry.as_folder().get_journal() == this;
+				});
+
+				std::lock_guard<std::mutex> lock(mutex);
+				retained.clear();
+				retaining = true;
+				record_bytes = 0;
+			}
+
+			std::string next_path = _next_path();
+			int next_fd = -1;
+			int result = 0;
+
+			try
+			{
+				_write_file(next_path.c_str(), &entries);
+			}
+			catch (const filesystem_exception& e)
+			{
+				result = e.code().value();
+			}
+
+			entries.clear();
+
+			if (!result)
+			{
+				next_fd = ::open(next_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+				result = next_fd < 0 ? errno : 0;
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			retaining = false;
+
+			if (result || stopping)
+			{
+				retained.clear();
+
+				if (next_fd >= 0)
+				{
+					::close(next_fd);
+				}
+
+				std::remove(next_path.c_str());
+				return result ? result : ECANCELED;
+			}
+
+			switch_records.swap(retained);
+			retained.clear();
+			switch_fd = next_fd;
+			switch_at = pending_start + pending.size();
+			switched = false;
+			commit_needed.notify_one();
+
+			committed.wait(lock, [this] { return switched; });
+
+			return checkpoint_error;
+		}
+
+		// Write journal file with image of entries, if any, and no records
+		void _write_file(const char* file_path, const std::vector<image::detail::pending_entry>* entries)
+		{
+			std::unique_ptr<FILE, int (*)(FILE*)> file(std::fopen(file_path, "wb"), &std::fclose);
+
+			if (!file)
+			{
+				throw filesystem_exception(errno, std::generic_category(), file_path);
+			}
+
+			header head{};
+			memcpy(head.magic, magic, sizeof(head.magic));
+			head.version = format_version;
+			head.byte_order = image::byte_order_mark;
+
+			image::detail::write(file.get(), &head, sizeof(head), file_path);
+
+			if (entries)
+			{
+				head.image_size = image::detail::write_image(file.get(), *entries, file_path);
+
+				if (std::fseek(file.get(), 0, SEEK_SET) != 0)
+				{
+					throw filesystem_exception(errno, std::generic_category(), file_path);
+				}
+
+				image::detail::write(file.get(), &head, sizeof(head), file_path);
+			}
+
+			int result = std::fflush(file.get()) == 0 ? _sync(fileno(file.get())) : errno;
+
+			if (std::fclose(file.release()) != 0 && !result)
+			{
+				result = errno;
+			}
+
+			if (result)
+			{
+				throw filesystem_exception(result, std::generic_category(), file_path);
+			}
+		}
+
+		// Make empty journal, atomically like checkpoints
+		void _create()
+		{
+			std::string next_path = _next_path();
+			_write_file(next_path.c_str(), nullptr);
+
+			if (std::rename(next_path.c_str(), path.c_str()) != 0)
+			{
+				throw filesystem_exception(errno, std::generic_category(), path);
+			}
+
+			_sync_directory();
+		}
+
+		// Load checkpoint and apply records after it. Incomplete record
+		// at the end, left by crash while it was written, is cut off
+		void _replay()
+		{
+			const char* file_path = path.c_str();
+			auto map = std::make_shared<image::mapping>(file_path);
+			char* bytes = map->data();
+			size_t size = map->size();
+
+			header head;
+
+			if (size < sizeof(head))
+			{
+				throw invalid_journal_error(file_path);
+			}
+
+			memcpy(&head, bytes, sizeof(head));
+
+			if (memcmp(head.magic, magic, sizeof(head.magic)) != 0
+				|| head.version != format_version
+				|| head.byte_order != image::byte_order_mark
+				|| head.image_size > size - sizeof(head))
+			{
+				throw invalid_journal_error(file_path);
+			}
+
+			if (head.image_size != 0)
+			{
+				image::detail::load_image(root, map, bytes + sizeof(head), head.image_size, file_path);
+			}
+
+			size_t position = sizeof(head) + static_cast<size_t>(head.image_size);
+
+			while (size - position >= sizeof(record_header))
+			{
+				record_header record;
+				memcpy(&record, bytes + position, sizeof(record));
+
+				size_t left = size - position - sizeof(record);
+
+				if (record.path_size > left || record.data_size > left - record.path_size)
+				{
+					break;
+				}
+
+				size_t record_size = sizeof(record) + record.path_size + static_cast<size_t>(record.data_size);
+
+				if (_checksum(bytes + position + sizeof(record.checksum), record_size - sizeof(record.checksum))
+					!= record.checksum)
+				{
+					break;
+				}
+
+				const char* entry_path = bytes + position + sizeof(record);
+
+				_apply(record, std::string_view(entry_path, record.path_size), entry_path + record.path_size);
+
+				position += record_size;
+				record_bytes += record_size;
+			}
+
+			if (position != size && ::truncate(file_path, static_cast<off_t>(position)) != 0)
+			{
+				throw filesystem_exception(errno, std::generic_category(), file_path);
+			}
+		}
+
+		void _apply(const record_header& record, std::string_view entry_path, const char* data)
+		{
+			size_t data_size = static_cast<size_t>(record.data_size);
+
+			try
+			{
+				std::string_view name;
+
+				switch (record.operation)
+				{
+				case journal_operation::create_file:
+				{
+					// Parents were recorded before, unless they were created concurrently
+					entry_handle<folder_t> dir = root._Approach(entry_path, name, true);
+
+					if (dir->name_is_free(name))
+					{
+						dir->_createFile(name);
+					}
+					break;
+				}
+				case journal_operation::create_folder:
+					root._Approach(entry_path, name, true)->_getOrCreateFolder(name);
+					break;
+				case journal_operation::write:
+					root.lookup(entry_path).as_file().writeBytes(data, data_size);
+					break;
+				case journal_operation::append:
+					root.lookup(entry_path).as_file().appendBytes(data, data_size);
+					break;
+				case journal_operation::write_at:
+					root.lookup(entry_path).as_file().writeAt(static_cast<size_t>(record.offset), data, data_size);
+					break;
+				case journal_operation::remove:
+					// Non-recursive removal was recorded only if folder was empty
+					root._Approach(entry_path, name)->_remove(name, true);
+					break;
+				case journal_operation::move:
+					root.rename(entry_path, std::string_view(data, data_size));
+					break;
+				default:
+					throw invalid_journal_error(path);
+				}
+			}
+			catch (const filesystem_exception&)
+			{
+				// Record doesn't fit tree made by previous ones
+				throw invalid_journal_error(path);
+			}
+		}
+	};
+
+	inline journal_scope::journal_scope(journal* log, bool exclusive)
+		: log(log), end(0), exclusive(exclusive), frozen(log != nullptr)
+	{
+		if (log && exclusive)
+		{
+			log->freeze.lock();
+		}
+		else if (log)
+		{
+			log->freeze.lock_shared();
+		}
+	}
+
+	inline journal_scope::~journal_scope()
+	{
+		_unfreeze();
+	}
+
+	inline void journal_scope::_unfreeze()
+	{
+		if (frozen && exclusive)
+		{
+			log->freeze.unlock();
+		}
+		else if (frozen)
+		{
+			log->freeze.unlock_shared();
+		}
+
+		frozen = false;
+	}
+
+	// Removed entries aren't part of the state, they are written until their streams are closed
+	inline void journal_scope::record(journal_operation operation, const base_entry& entry,
+		uint64_t offset, const char* bytes, size_t count)
+	{
+		if (log && !entry.is_removed())
+		{
+			end = log->_append(operation, entry, offset, count, [bytes, count](char* out)
+			{
+				if (count != 0)
+				{
+					memcpy(out, bytes, count);
+				}
+			});
+		}
+	}
+
+	inline void journal_scope::record(journal_operation operation, const base_entry& entry,
+		const file_content& content, size_t from)
+	{
+		if (log && !entry.is_removed())
+		{
+			size_t count = content.size() - from;
+
+			end = log->_append(operation, entry, 0, count, [&content, from, count](char* out)
+			{
+				content.copy_to(out, from, count);
+			});
+		}
+	}
+
+	inline void journal_scope::record(const base_entry& entry, const folder_t& target, std::string_view name)
+	{
+		if (log)
+		{
+			size_t target_size = journal::_path_size(target);
+			size_t count = target_size + (target_size != 0) + name.size();
+
+			end = log->_append(journal_operation::move, entry, 0, count, [&target, name, target_size](char* out)
+			{
+				journal::_write_path(target, out, target_size);
+				out += target_size;
+
+				if (target_size != 0)
+				{
+					*out++ = '/';
+				}
+
+				name.copy(out, name.size());
+			});
+		}
+	}
+
+	inline void journal_scope::commit()
+	{
+		_unfreeze();
+
+		if (log && end != 0)
+		{
+			log->_wait(end);
+		}
+	}
+
+	inline filesystem::filesystem(const char* journal_path)
+		: filesystem(journal_path, journal_options())
+	{
+	}
+
+	inline filesystem::filesystem(const char* journal_path, const journal_options& options)
+		: root(new (&arena) folder_t(".", nullptr, &arena)), log(nullptr)
+	{
+		try
+		{
+			// Setup runs on restored state and its modifications are recorded
+			log = new journal(*root, journal_path, options);
+			init();
+		}
+		catch (...)
+		{
+			close_journal();
+			delete root;
+			throw;
+		}
+	}
+
+	inline void filesystem::open_journal(const char* journal_path)
+	{
+		open_journal(journal_path, journal_options());
+	}
+
+	inline void filesystem::open_journal(const char* journal_path, const journal_options& options)
+	{
+		if (log)
+		{
+			throw filesystem_exception(EBUSY, std::generic_category(), "journal is already open");
+		}
+
+		if (!root->get_items().empty())
+		{
+			throw directory_not_empty_error("journal can only restore empty file system");
+		}
+
+		log = new journal(*root, journal_path, options);
+		dentries.invalidate();
+	}
+
+	inline void filesystem::close_journal()
+	{
+		delete log;
+		log = nullptr;
+	}
+#else
+	// Journal needs POSIX files, file systems can't have one elsewhere
+	inline journal_scope::journal_scope(journal* log, bool exclusive)
+		: log(log), end(0), exclusive(exclusive), frozen(false)
+	{
+	}
+
+	inline journal_scope::~journal_scope()
+	{
+	}
+
+	inline void journal_scope::_unfreeze()
+	{
+	}
+
+	inline void journal_scope::record(journal_operation, const base_entry&, uint64_t, const char*, size_t)
+	{
+	}
+
+	inline void journal_scope::record(journal_operation, const base_entry&, const file_content&, size_t)
+	{
+	}
+
+	inline void journal_scope::record(const base_entry&, const folder_t&, std::string_view)
+	{
+	}
+
+	inline void journal_scope::commit()
+	{
+	}
+
+	inline void filesystem::open_journal(const char*)
+	{
+		throw filesystem_exception(ENOSYS, std::generic_category(), "journal isn't supported");
+	}
+
+	inline void filesystem::open_journal(const char*, const journal_options&)
+	{
+		throw filesystem_exception(ENOSYS, std::generic_category(), "journal isn't supported");
+	}
+
+	inline void filesystem::close_journal()
+	{
+	}
+#endif
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+// SIMD instruction sets are detected at run time, so code built for
+// baseline x86-64 still uses AVX2 where it is available.
+// Define VIRTFILES_NO_SIMD before including library headers to use
+// scalar code only.
+
+#if !defined(VIRTFILES_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define VIRTFILES_SIMD_X86
+#include <immintrin.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define VIRTFILES_TARGET_AVX2
+#else
+#define VIRTFILES_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace virtfiles
+{
+	namespace simd
+	{
+		enum class level
+		{
+			scalar,
+			sse2,
+			avx2
+		};
+
+		inline level detect()
+		{
+#ifdef VIRTFILES_SIMD_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+			int info[4];
+			__cpuid(info, 0);
+
+			if (info[0] >= 7)
+			{
+				__cpuid(info, 1);
+				bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) // OSXSAVE and AVX
+					&& (_xgetbv(0) & 6) == 6;								  // OS saves YMM registers
+
+				__cpuidex(info, 7, 0);
+
+				if (os_avx && (info[1] & (1 << 5)))
+				{
+					return level::avx2;
+				}
+			}
+#else
+			__builtin_cpu_init();
+
+			if (__builtin_cpu_supports("avx2"))
+			{
+				return level::avx2;
+			}
+#endif
+			return level::sse2; // always present on x86-64
+#else
+			return level::scalar;
+#endif
+		}
+
+		// Best instruction set of this CPU, detected once
+		inline level supported()
+		{
+			static const level value = detect();
+
+			return value;
+		}
+	};
+};
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Define VIRTFILES_FILE_STATS before including library headers
+// to make each file count its opens and I/O of streams as well.
+// Global counters are always kept.
+
+namespace virtfiles
+{
+	// Events counted by file system
+	enum class counter : uint8_t
+	{
+		opens,			   // streams opened
+		lookups,		   // paths resolved by walking folders
+		lookup_depth,	   // folders walked by lookups
+		bytes_read,		   // elements streams handed to readers
+		bytes_written,	   // bytes written to files by streams
+		flushes,		   // stream buffers written to files
+		buffer_extensions, // stream buffers grown
+		conversions,	   // stream contents converted by codecvt
+		allocated_bytes	   // content memory allocated by files
+	};
+
+	constexpr size_t counter_count = static_cast<size_t>(counter::allocated_bytes) + 1;
+
+	inline const char* counter_name(counter which)
+	{
+		static const char* const names[counter_count] = {
+			"opens", "lookups", "lookup_depth", "bytes_read", "bytes_written",
+			"flushes", "buffer_extensions", "conversions", "allocated_bytes"
+		};
+
+		return names[static_cast<size_t>(which)];
+	}
+
+	// Values of counters at some moment
+	class stats_snapshot
+	{
+	protected:
+		uint64_t values[counter_count] = {};
+
+	public:
+		uint64_t operator[](counter which) const
+		{
+			return values[static_cast<size_t>(which)];
+		}
+
+		uint64_t& operator[](counter which)
+		{
+			return values[static_cast<size_t>(which)];
+		}
+
+		// Counts of events between since and this snapshot
+		stats_snapshot operator-(const stats_snapshot& since) const
+		{
+			stats_snapshot out;
+
+			for (size_t i = 0; i < counter_count; ++i)
+			{
+				out.values[i] = values[i] - since.values[i];
+			}
+
+			return out;
+		}
+	};
+
+	// Each thread counts to its own block, which only it writes,
+	// so counting is a plain add without bus locking or sharing cache lines.
+	// Blocks are summed when counters are read, blocks of finished
+	// threads are added to retired counts
+	class stats
+	{
+	protected:
+		struct alignas(64) thread_block
+		{
+			std::atomic<uint64_t> values[counter_count] = {};
+		};
+
+		struct registry
+		{
+			std::mutex mutex;
+			std::vector<thread_block*> blocks;
+			uint64_t retired[counter_count] = {};
+		};
+
+		// Unregisters block of thread when it finishes
+		struct thread_owner
+		{
+			thread_block* block = nullptr;
+
+			~thread_owner()
+			{
+				finished = true;
+
+				if (block)
+				{
+					_retire(block);
+				}
+			}
+		};
+
+		static inline thread_local thread_block* current = nullptr;
+		static inline thread_local bool finished = false; // set after owner is destroyed
+
+	public:
+		static void add(counter which, uint64_t amount = 1)
+		{
+			thread_block* block = current;
+
+			if (!block && !(block = _register()))
+			{
+				// Counted by destructor of other thread local or static object
+				registry& all = _registry();
+				std::lock_guard<std::mutex> lock(all.mutex);
+
+				all.retired[static_cast<size_t>(which)] += amount;
+				return;
+			}
+
+			std::atomic<uint64_t>& value = block->values[static_cast<size_t>(which)];
+
+			value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+
+		// Sum of counters of all threads. Counts of running threads
+		// may be behind by events which are counted meanwhile
+		static stats_snapshot snapshot()
+		{
+			registry& all = _registry();
+			std::lock_guard<std::mutex> lock(all.mutex);
+
+			stats_snapshot out;
+
+			for (size_t i = 0; i < counter_count; ++i)
+			{
+				counter which = static_cast<counter>(i);
+				out[which] = all.retired[i];
+
+				for (thread_block* block : all.blocks)
+				{
+					out[which] += block->values[i].load(std::memory_order_relaxed);
+				}
+			}
+
+			return out;
+		}
+
+	private:
+		// Never destroyed, so objects destroyed at exit can count
+		static registry& _registry()
+		{
+			static registry* instance = new registry;
+
+			return *instance;
+		}
+
+		static thread_block* _register()
+		{
+			if (finished)
+			{
+				return nullptr;
+			}
+
+			static thread_local thread_owner owner;
+
+			registry& all = _registry();
+			auto block = std::make_unique<thread_block>();
+
+			{
+				std::lock_guard<std::mutex> lock(all.mutex);
+				all.blocks.push_back(block.get());
+			}
+
+			owner.block = current = block.release();
+			return current;
+		}
+
+		static void _retire(thread_block* block)
+		{
+			registry& all = _registry();
+
+			{
+				std::lock_guard<std::mutex> lock(all.mutex);
+
+				for (size_t i = 0; i < counter_count; ++i)
+				{
+					all.retired[i] += block->values[i].load(std::memory_order_relaxed);
+				}
+
+				for (size_t i = 0; i < all.blocks.size(); ++i)
+				{
+					if (all.blocks[i] == block)
+					{
+						all.blocks[i] = all.blocks.back();
+						all.blocks.pop_back();
+						break;
+					}
+				}
+			}
+
+			current = nullptr;
+			delete block;
+		}
+	};
+
+	// Counters of file, kept if VIRTFILES_FILE_STATS is defined.
+	// Streams of several threads may count to the same file
+	struct file_stats
+	{
+		std::atomic<uint64_t> opens{ 0 };
+		std::atomic<uint64_t> bytes_read{ 0 };
+		std::atomic<uint64_t> bytes_written{ 0 };
+		std::atomic<uint64_t> flushes{ 0 };
+
+		void add(counter which, uint64_t amount = 1)
+		{
+			switch (which)
+			{
+			case counter::opens:
+				opens.fetch_add(amount, std::memory_order_relaxed);
+				break;
+			case counter::bytes_read:
+				bytes_read.fetch_add(amount, std::memory_order_relaxed);
+				break;
+			case counter::bytes_written:
+				bytes_written.fetch_add(amount, std::memory_order_relaxed);
+				break;
+			case counter::flushes:
+				flushes.fetch_add(amount, std::memory_order_relaxed);
+				break;
+			default:
+				break;
+			}
+		}
+
+		// Bytes moved between file and streams, to find hot files
+		uint64_t traffic() const
+		{
+			return bytes_read.load(std::memory_order_relaxed) + bytes_written.load(std::memory_order_relaxed);
+		}
+	};
+};
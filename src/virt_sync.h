@@ -0,0 +1,80 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+// Define VIRTFILES_THREADSAFE before including library headers
+// to make file system safe for use from several threads.
+// Otherwise all locks are no-op.
+
+namespace virtfiles
+{
+#ifdef VIRTFILES_THREADSAFE
+	using shared_mutex_t = std::shared_mutex;
+	using mutex_t = std::mutex;
+
+	// Read pointer which can be replaced concurrently
+	template <class T>
+	std::shared_ptr<T> load_shared(const std::shared_ptr<T>& ptr)
+	{
+		return std::atomic_load_explicit(&ptr, std::memory_order_acquire);
+	}
+
+	// Replace pointer which can be read concurrently
+	template <class T>
+	void store_shared(std::shared_ptr<T>& ptr, std::shared_ptr<T> value)
+	{
+		std::atomic_store_explicit(&ptr, std::move(value), std::memory_order_release);
+	}
+#else
+	class null_mutex
+	{
+	public:
+		void lock()
+		{
+		}
+
+		bool try_lock()
+		{
+			return true;
+		}
+
+		void unlock()
+		{
+		}
+
+		void lock_shared()
+		{
+		}
+
+		bool try_lock_shared()
+		{
+			return true;
+		}
+
+		void unlock_shared()
+		{
+		}
+	};
+
+	using shared_mutex_t = null_mutex;
+	using mutex_t = null_mutex;
+
+	template <class T>
+	std::shared_ptr<T> load_shared(const std::shared_ptr<T>& ptr)
+	{
+		return ptr;
+	}
+
+	template <class T>
+	void store_shared(std::shared_ptr<T>& ptr, std::shared_ptr<T> value)
+	{
+		ptr = std::move(value);
+	}
+#endif
+
+	using read_lock = std::shared_lock<shared_mutex_t>;
+	using write_lock = std::unique_lock<shared_mutex_t>;
+	using exclusive_lock = std::unique_lock<mutex_t>;
+};
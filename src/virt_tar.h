@@ -0,0 +1,701 @@
+#pragma once
+
+#include "file_entries.h"
+#include "file_path.h"
+#include "virt_exceptions.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace virtfiles
+{
+	// POSIX tar archives. Entries are read and written one at a time
+	// and file contents are streamed between archive and files,
+	// so whole archive is never kept in memory.
+	// Long paths and big sizes use pax extended headers, GNU long
+	// names are read as well. Links and special files are skipped
+	namespace tar
+	{
+		constexpr size_t block_size = 512;
+
+		// Biggest pax header read, they normally hold just few records
+		constexpr uint64_t max_extended_header_size = 1 << 20;
+
+		// Biggest extent made for content before its bytes are read, size
+		// of entry comes from archive, so it can't be trusted with memory
+		constexpr size_t max_read_chunk = 1 << 20;
+
+		struct header
+		{
+			char name[100];
+			char mode[8];
+			char uid[8];
+			char gid[8];
+			char size[12];
+			char mtime[12];
+			char checksum[8];
+			char typeflag;
+			char linkname[100];
+			char magic[6];
+			char version[2];
+			char uname[32];
+			char gname[32];
+			char devmajor[8];
+			char devminor[8];
+			char prefix[155];
+			char padding[12];
+		};
+
+		static_assert(sizeof(header) == block_size, "tar header must be one block");
+
+		namespace detail
+		{
+			inline size_t padding_of(uint64_t size)
+			{
+				return static_cast<size_t>((block_size - size % block_size) % block_size);
+			}
+
+			// Field up to first null character
+			inline std::string_view field(const char* chars, size_t size)
+			{
+				const void* end = memchr(chars, '\0', size);
+
+				return std::string_view(chars, end ? static_cast<const char*>(end) - chars : size);
+			}
+
+			// Octal number padded with spaces or nulls, or base-256 one
+			// with high bit of first byte set (GNU extension for big sizes)
+			inline bool parse_number(const char* chars, size_t size, uint64_t& out)
+			{
+				const unsigned char* bytes = reinterpret_cast<const unsigned char*>(chars);
+				uint64_t value = 0;
+
+				if (size != 0 && (bytes[0] & 0x80))
+				{
+					if (bytes[0] & 0x40) // negative
+					{
+						return false;
+					}
+
+					value = bytes[0] & 0x3F;
+
+					for (size_t i = 1; i < size; ++i)
+					{
+						if (value >> 56)
+						{
+							return false;
+						}
+
+						value = value << 8 | bytes[i];
+					}
+
+					out = value;
+					return true;
+				}
+
+				size_t i = 0;
+
+				while (i < size && chars[i] == ' ')
+				{
+					++i;
+				}
+
+				for (; i < size && chars[i] >= '0' && chars[i] <= '7'; ++i)
+				{
+					if (value >> 61)
+					{
+						return false;
+					}
+
+					value = value * 8 + static_cast<uint64_t>(chars[i] - '0');
+				}
+
+				for (; i < size; ++i)
+				{
+					if (chars[i] != ' ' && chars[i] != '\0')
+					{
+						return false;
+					}
+				}
+
+				out = value;
+				return true;
+			}
+
+			// Zero padded octal number ended with null, false if it doesn't fit
+			inline bool write_octal(char* chars, size_t size, uint64_t value)
+			{
+				chars[size - 1] = '\0';
+
+				for (size_t i = size - 1; i-- > 0;)
+				{
+					chars[i] = static_cast<char>('0' + (value & 7));
+					value >>= 3;
+				}
+
+				return value == 0;
+			}
+
+			// Sum of header bytes, where checksum field counts as spaces.
+			// Some old archivers summed signed chars
+			inline uint64_t checksum(const header& head, bool signed_chars = false)
+			{
+				const char* bytes = reinterpret_cast<const char*>(&head);
+				size_t field_start = offsetof(header, checksum);
+				uint64_t sum = 0;
+
+				for (size_t i = 0; i < block_size; ++i)
+				{
+					char ch = i >= field_start && i < field_start + sizeof(head.checksum) ? ' ' : bytes[i];
+
+					sum += signed_chars
+						? static_cast<uint64_t>(static_cast<int64_t>(static_cast<signed char>(ch)))
+						: static_cast<unsigned char>(ch);
+				}
+
+				return sum;
+			}
+
+			inline bool is_zero(const header& head)
+			{
+				const char* bytes = reinterpret_cast<const char*>(&head);
+
+				for (size_t i = 0; i < block_size; ++i)
+				{
+					if (bytes[i] != '\0')
+					{
+						return false;
+					}
+				}
+
+				return true;
+			}
+
+			// Read next header, false at end of stream
+			inline bool read_header(std::istream& in, header& head)
+			{
+				in.read(reinterpret_cast<char*>(&head), block_size);
+				std::streamsize got = in.gcount();
+
+				if (got == 0)
+				{
+					return false;
+				}
+
+				if (got != static_cast<std::streamsize>(block_size))
+				{
+					throw invalid_archive_error("tar archive is truncated");
+				}
+
+				return true;
+			}
+
+			inline void skip(std::istream& in, uint64_t count)
+			{
+				while (count != 0)
+				{
+					std::streamsize part = static_cast<std::streamsize>(count < (1u << 30) ? count : (1u << 30));
+					in.ignore(part);
+
+					if (in.gcount() != part)
+					{
+						throw invalid_archive_error("tar archive is truncated");
+					}
+
+					count -= static_cast<uint64_t>(part);
+				}
+			}
+
+			// Content of extended header, followed by its padding
+			inline std::string read_extended(std::istream& in, uint64_t size)
+			{
+				if (size > max_extended_header_size)
+				{
+					throw invalid_archive_error("tar extended header is too big");
+				}
+
+				std::string data(static_cast<size_t>(size), '\0');
+				in.read(&data[0], static_cast<std::streamsize>(size));
+
+				if (in.gcount() != static_cast<std::streamsize>(size))
+				{
+					throw invalid_archive_error("tar archive is truncated");
+				}
+
+				skip(in, padding_of(size));
+
+				return data;
+			}
+
+			// Take path and size from pax records "<length> <key>=<value>\n"
+			inline void parse_pax(std::string_view records, std::string& path, uint64_t& size, bool& has_size)
+			{
+				while (!records.empty())
+				{
+					size_t space = records.find(' ');
+					uint64_t length = 0;
+
+					if (space == std::string_view::npos || space == 0)
+					{
+						throw invalid_archive_error("invalid pax record");
+					}
+
+					for (size_t i = 0; i < space; ++i)
+					{
+						if (records[i] < '0' || records[i] > '9' || length > records.size())
+						{
+							throw invalid_archive_error("invalid pax record");
+						}
+
+						length = length * 10 + static_cast<uint64_t>(records[i] - '0');
+					}
+
+					if (length <= space + 1 || length > records.size() || records[length - 1] != '\n')
+					{
+						throw invalid_archive_error("invalid pax record");
+					}
+
+					std::string_view record = records.substr(space + 1, length - space - 2);
+					size_t equals = record.find('=');
+
+					if (equals == std::string_view::npos)
+					{
+						throw invalid_archive_error("invalid pax record");
+					}
+
+					std::string_view key = record.substr(0, equals);
+					std::string_view value = record.substr(equals + 1);
+
+					if (key == "path")
+					{
+						path = value;
+					}
+					else if (key == "size")
+					{
+						size = 0;
+
+						for (char ch : value)
+						{
+							if (ch < '0' || ch > '9' || size > (~uint64_t{ 0 } - 9) / 10)
+							{
+								throw invalid_archive_error("invalid pax size");
+							}
+
+							size = size * 10 + static_cast<uint64_t>(ch - '0');
+						}
+
+						has_size = !value.empty();
+					}
+
+					records.remove_prefix(static_cast<size_t>(length));
+				}
+			}
+
+			// Path of entry relative to imported folder, without leading "./"
+			// and "/" and trailing "/". Entries can't point out of the folder
+			inline std::string_view relative_path(std::string_view path)
+			{
+				while (!path.empty() && (path[0] == '/' || path.substr(0, 2) == "./"))
+				{
+					path.remove_prefix(path[0] == '/' ? 1 : 2);
+				}
+
+				while (!path.empty() && path.back() == '/')
+				{
+					path.remove_suffix(1);
+				}
+
+				if (path == ".")
+				{
+					return std::string_view();
+				}
+
+				for (std::string_view part : path_view(path))
+				{
+					if (part == "..")
+					{
+						throw invalid_archive_error("tar entry path is out of folder");
+					}
+				}
+
+				return path;
+			}
+
+			// Folder of last added entry. Archives list entries of a folder
+			// together, so most of them are added without walking the path
+			class folder_cache
+			{
+			protected:
+				folder_t& root;
+				std::string path;
+				folder_t* folder;
+
+			public:
+				explicit folder_cache(folder_t& root)
+					: root(root), folder(&root)
+				{
+				}
+
+				// Folder which contains entry at path, it and its parents
+				// are created if needed. Name is set to last part of path
+				folder_t& parent_of(std::string_view entry_path, std::string_view& name)
+				{
+					size_t separator = entry_path.find_last_of("/\\");
+					std::string_view folder_path;
+
+					if (separator == std::string_view::npos)
+					{
+						name = entry_path;
+					}
+					else
+					{
+						folder_path = entry_path.substr(0, separator);
+						name = entry_path.substr(separator + 1);
+					}
+
+					if (folder_path != path)
+					{
+						std::string_view last;
+						folder = &root._Approach(folder_path, last, true)->_getOrCreateFolder(last);
+						path = folder_path;
+					}
+
+					return *folder;
+				}
+
+				void set(std::string_view folder_path, folder_t& new_folder)
+				{
+					path = folder_path;
+					folder = &new_folder;
+				}
+			};
+
+			// Stream count bytes of archive into file as its new content
+			inline void read_content(std::istream& in, file_t& file, uint64_t count)
+			{
+				file.writeWith([&](file_content& content)
+				{
+					uint64_t left = count;
+
+					while (left != 0)
+					{
+						size_t available;
+						size_t expected = left < max_read_chunk ? static_cast<size_t>(left) : max_read_chunk;
+						char* space = content.append_space(1, expected, available);
+
+						std::streamsize part = static_cast<std::streamsize>(left < available ? left : available);
+						in.read(space, part);
+						content.commit_append(static_cast<size_t>(in.gcount()));
+
+						if (in.gcount() != part)
+						{
+							throw invalid_archive_error("tar archive is truncated");
+						}
+
+						left -= static_cast<uint64_t>(part);
+					}
+
+					return true;
+				});
+			}
+
+			inline void check_stream(std::ostream& out)
+			{
+				if (!out)
+				{
+					throw filesystem_exception(EIO, std::generic_category(), "tar archive write failed");
+				}
+			}
+
+			// Pax record with its length, which counts digits of itself
+			inline void add_pax_record(std::string& records, std::string_view key, std::string_view value)
+			{
+				size_t length = key.size() + value.size() + 3; // space, '=' and '\n'
+				size_t digits = 1;
+
+				while (std::to_string(length + digits).size() != digits)
+				{
+					++digits;
+				}
+
+				records += std::to_string(length + digits);
+				records += ' ';
+				records += key;
+				records += '=';
+				records += value;
+				records += '\n';
+			}
+
+			// Put path to name and prefix fields, false if it doesn't fit
+			inline bool split_path(std::string_view path, header& head)
+			{
+				if (path.size() <= sizeof(head.name))
+				{
+					path.copy(head.name, path.size());
+					return true;
+				}
+
+				// Shortest name that fits, so prefix is as short as possible
+				size_t separator = path.find('/', path.size() - sizeof(head.name) - 1);
+
+				if (separator == std::string_view::npos || separator > sizeof(head.prefix)
+					|| separator + 1 == path.size())
+				{
+					return false;
+				}
+
+				path.copy(head.prefix, separator);
+				path.copy(head.name, path.size() - separator - 1, separator + 1);
+
+				return true;
+			}
+
+			inline void write_block(std::ostream& out, header& head)
+			{
+				memcpy(head.magic, "ustar", 6);
+				memcpy(head.version, "00", 2);
+				write_octal(head.uid, sizeof(head.uid), 0);
+				write_octal(head.gid, sizeof(head.gid), 0);
+				write_octal(head.mtime, sizeof(head.mtime), 0);
+
+				write_octal(head.checksum, sizeof(head.checksum) - 1, checksum(head));
+				head.checksum[sizeof(head.checksum) - 1] = ' ';
+
+				out.write(reinterpret_cast<const char*>(&head), block_size);
+			}
+
+			inline void write_padding(std::ostream& out, uint64_t size)
+			{
+				static const char zeros[block_size]{};
+
+				out.write(zeros, static_cast<std::streamsize>(padding_of(size)));
+			}
+
+			// Header of entry, preceded by pax header if path or size don't fit
+			inline void write_header(std::ostream& out, std::string_view path, char type, uint64_t size)
+			{
+				header head{};
+				std::string records;
+
+				if (!split_path(path, head))
+				{
+					add_pax_record(records, "path", path);
+					memset(head.prefix, 0, sizeof(head.prefix));
+					path.copy(head.name, sizeof(head.name));
+				}
+
+				if (!write_octal(head.size, sizeof(head.size), size))
+				{
+					add_pax_record(records, "size", std::to_string(size));
+					write_octal(head.size, sizeof(head.size), 0);
+				}
+
+				if (!records.empty())
+				{
+					header extended{};
+					memcpy(extended.name, "././@PaxHeader", 14);
+					write_octal(extended.mode, sizeof(extended.mode), 0644);
+					write_octal(extended.size, sizeof(extended.size), records.size());
+					extended.typeflag = 'x';
+
+					write_block(out, extended);
+					out.write(records.data(), static_cast<std::streamsize>(records.size()));
+					write_padding(out, records.size());
+				}
+
+				write_octal(head.mode, sizeof(head.mode), type == '5' ? 0755 : 0644);
+				head.typeflag = type;
+
+				write_block(out, head);
+			}
+
+			// Write entries of folder and its subfolders, path is path of folder
+			// relative to exported one ended with "/", or empty for it
+			inline void export_folder(folder_t& folder, std::string& path, std::ostream& out)
+			{
+				size_t base_size = path.size();
+
+				for (base_entry* entry : folder.get_items())
+				{
+					path.resize(base_size);
+					path += entry->get_name();
+
+					if (entry->is_folder())
+					{
+						path += '/';
+						write_header(out, path, '5', 0);
+						export_folder(entry->as_folder(), path, out);
+					}
+					else
+					{
+						content_snapshot content = entry->as_file().snapshot();
+						write_header(out, path, '0', content.size());
+
+						for (size_t i = 0; i < content.get_extent_count(); ++i)
+						{
+							std::string_view extent = content.get_extent(i);
+							out.write(extent.data(), static_cast<std::streamsize>(extent.size()));
+						}
+
+						write_padding(out, content.size());
+					}
+
+					check_stream(out);
+				}
+
+				path.resize(base_size);
+			}
+		};
+	};
+
+	// Add entries of tar archive read from in to folder.
+	// Existing files are overwritten by archived ones with the same path
+	inline void import_tar(folder_t& folder, std::istream& in)
+	{
+		tar::header head;
+		tar::detail::folder_cache folders(folder);
+
+		// Set by extended headers for next entry
+		std::string long_path;
+		uint64_t long_size = 0;
+		bool has_long_size = false;
+
+		while (tar::detail::read_header(in, head))
+		{
+			if (tar::detail::is_zero(head)) // end of archive
+			{
+				break;
+			}
+
+			uint64_t checksum;
+
+			if (!tar::detail::parse_number(head.checksum, sizeof(head.checksum), checksum)
+				|| (checksum != tar::detail::checksum(head) && checksum != tar::detail::checksum(head, true)))
+			{
+				throw invalid_archive_error("tar header checksum mismatch");
+			}
+
+			uint64_t size;
+
+			if (!tar::detail::parse_number(head.size, sizeof(head.size), size))
+			{
+				throw invalid_archive_error("invalid tar entry size");
+			}
+
+			switch (head.typeflag)
+			{
+			case 'x': // pax header of next entry
+				tar::detail::parse_pax(tar::detail::read_extended(in, size), long_path, long_size, has_long_size);
+				continue;
+			case 'L': // GNU long name of next entry
+				long_path = tar::detail::read_extended(in, size);
+				long_path.resize(tar::detail::field(long_path.data(), long_path.size()).size());
+				continue;
+			case 'g': // pax global header
+			case 'K': // GNU long link name
+				tar::detail::skip(in, size + tar::detail::padding_of(size));
+				continue;
+			}
+
+			std::string full_path;
+
+			if (long_path.empty())
+			{
+				// Prefix field is used only by POSIX archives, GNU ones keep other data there
+				std::string_view prefix = memcmp(head.magic, "ustar", 6) == 0
+					? tar::detail::field(head.prefix, sizeof(head.prefix))
+					: std::string_view();
+
+				full_path.assign(prefix);
+
+				if (!prefix.empty())
+				{
+					full_path += '/';
+				}
+
+				full_path += tar::detail::field(head.name, sizeof(head.name));
+			}
+			else
+			{
+				full_path.swap(long_path);
+				long_path.clear();
+			}
+
+			if (has_long_size)
+			{
+				size = long_size;
+				has_long_size = false;
+			}
+
+			char type = head.typeflag;
+
+			// Old archives mark folders with "/" at the end of name
+			if ((type == '0' || type == '\0') && !full_path.empty() && full_path.back() == '/')
+			{
+				type = '5';
+			}
+
+			std::string_view path = tar::detail::relative_path(full_path);
+			std::string_view name;
+
+			switch (type)
+			{
+			case '0':
+			case '\0':
+			case '7': // contiguous file
+			{
+				if (path.empty())
+				{
+					throw invalid_archive_error("tar file entry has no name");
+				}
+
+				folder_t& parent = folders.parent_of(path, name);
+				file_t* file;
+
+				try
+				{
+					file = &parent._createFile(name);
+				}
+				catch (const file_exists_error&)
+				{
+					file = &parent.get_entry(name)->as_file();
+				}
+
+				tar::detail::read_content(in, *file, size);
+				tar::detail::skip(in, tar::detail::padding_of(size));
+				break;
+			}
+			case '5':
+				if (!path.empty())
+				{
+					folders.set(path, folders.parent_of(path, name)._getOrCreateFolder(name));
+				}
+
+				tar::detail::skip(in, size + tar::detail::padding_of(size));
+				break;
+			default: // links, devices and FIFOs have no place in virtual tree
+				tar::detail::skip(in, size + tar::detail::padding_of(size));
+				break;
+			}
+		}
+	}
+
+	// Write folder and its subfolders to out as tar archive.
+	// Folders must not be modified while they are exported
+	inline void export_tar(folder_t& folder, std::ostream& out)
+	{
+		std::string path;
+		tar::detail::export_folder(folder, path, out);
+
+		// End of archive
+		static const char zeros[2 * tar::block_size]{};
+		out.write(zeros, sizeof(zeros));
+
+		tar::detail::check_stream(out);
+	}
+};
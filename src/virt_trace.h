@@ -0,0 +1,394 @@
+#pragma once
+
+// Define VIRTFILES_TRACE before including library headers to time
+// opens, closes and syncs of streams, lookups, creation of entries
+// and writes to files. Without it trace points compile to nothing
+
+#ifdef VIRTFILES_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+namespace virtfiles
+{
+	// Traced operations
+	enum class trace_point : uint8_t
+	{
+		open,		   // basic_filebuf::open
+		close,		   // basic_filebuf::close
+		sync,		   // basic_filebuf::sync
+		lookup,		   // folder_t::lookup and acquire
+		create_file,   // folder_t::_createFile and others creating a file
+		create_folder, // folder_t::_createFolder and others creating a folder
+		write		   // file_t writes and appends
+	};
+
+	constexpr size_t trace_point_count = static_cast<size_t>(trace_point::write) + 1;
+
+	inline const char* trace_point_name(trace_point point)
+	{
+		static const char* const names[trace_point_count] = {
+			"open", "close", "sync", "lookup", "create_file", "create_folder", "write"
+		};
+
+		return names[static_cast<size_t>(point)];
+	}
+
+	// Latencies in nanoseconds, bucketed like in HDR histogram: values
+	// below 16 are kept exactly and each next power of two is split into
+	// 16 buckets, so any value is known within 1/16 of it
+	class latency_histogram
+	{
+	public:
+		static constexpr unsigned sub_bits = 4;
+		static constexpr size_t sub_count = size_t{ 1 } << sub_bits;
+		static constexpr size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+
+	protected:
+		uint64_t counts[bucket_count] = {};
+		uint64_t total = 0;
+		uint64_t sum = 0;
+		uint64_t min_value = 0;
+		uint64_t max_value = 0;
+
+		friend class tracer;
+
+	public:
+		static size_t bucket_of(uint64_t value)
+		{
+			if (value < sub_count)
+			{
+				return static_cast<size_t>(value);
+			}
+
+			unsigned exponent = _highest_bit(value);
+
+			return (exponent - sub_bits) * sub_count + static_cast<size_t>(value >> (exponent - sub_bits));
+		}
+
+		// Smallest value which falls into bucket
+		static uint64_t bucket_floor(size_t bucket)
+		{
+			if (bucket < sub_count)
+			{
+				return bucket;
+			}
+
+			unsigned exponent = static_cast<unsigned>(bucket / sub_count) + sub_bits - 1;
+
+			return static_cast<uint64_t>(bucket % sub_count + sub_count) << (exponent - sub_bits);
+		}
+
+		uint64_t count() const
+		{
+			return total;
+		}
+
+		uint64_t min() const
+		{
+			return min_value;
+		}
+
+		uint64_t max() const
+		{
+			return max_value;
+		}
+
+		double mean() const
+		{
+			return total ? double(sum) / total : 0;
+		}
+
+		// Highest value of bucket where percent of values are reached
+		uint64_t percentile(double percent) const
+		{
+			uint64_t rank = static_cast<uint64_t>(percent / 100 * total + 0.5);
+			uint64_t seen = 0;
+
+			for (size_t i = 0; i < bucket_count; ++i)
+			{
+				seen += counts[i];
+
+				if (seen != 0 && seen >= rank)
+				{
+					uint64_t highest = i + 1 < bucket_count ? bucket_floor(i + 1) - 1 : UINT64_MAX;
+
+					return highest < max_value ? highest : max_value;
+				}
+			}
+
+			return max_value;
+		}
+
+		// Count of values in bucket
+		uint64_t get_bucket(size_t bucket) const
+		{
+			return counts[bucket];
+		}
+
+	private:
+		static unsigned _highest_bit(uint64_t value)
+		{
+#if defined(_MSC_VER) && !defined(__clang__)
+			unsigned long index;
+			_BitScanReverse64(&index, value);
+			return index;
+#else
+			return 63 - __builtin_clzll(value);
+#endif
+		}
+	};
+
+	// Operation seen in capture window, times are in nanoseconds since tracing started
+	struct trace_event
+	{
+		trace_point point;
+		uint32_t thread;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	// Keeps histogram of latencies of each trace point. Between
+	// start_capture and stop_capture it also records every traced
+	// operation, which can be written as Chrome trace events
+	class tracer
+	{
+	protected:
+		struct point_state
+		{
+			std::atomic<uint64_t> counts[latency_histogram::bucket_count] = {};
+			std::atomic<uint64_t> sum{ 0 };
+			std::atomic<uint64_t> min_value{ UINT64_MAX };
+			std::atomic<uint64_t> max_value{ 0 };
+		};
+
+		struct state
+		{
+			const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+			point_state points[trace_point_count];
+
+			std::atomic<bool> capturing{ false };
+			std::atomic<uint32_t> threads{ 0 };
+
+			std::mutex mutex; // guards captured events
+			std::vector<trace_event> events;
+			size_t capacity = 0;
+			uint64_t dropped = 0;
+		};
+
+	public:
+		static constexpr size_t default_capacity = size_t{ 1 } << 20;
+
+		// Nanoseconds since tracing started
+		static uint64_t now()
+		{
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - _state().origin).count());
+		}
+
+		static void record(trace_point point, uint64_t start, uint64_t duration)
+		{
+			state& all = _state();
+			point_state& target = all.points[static_cast<size_t>(point)];
+
+			target.counts[latency_histogram::bucket_of(duration)].fetch_add(1, std::memory_order_relaxed);
+			target.sum.fetch_add(duration, std::memory_order_relaxed);
+
+			for (uint64_t min = target.min_value.load(std::memory_order_relaxed);
+				duration < min && !target.min_value.compare_exchange_weak(min, duration, std::memory_order_relaxed);)
+			{
+			}
+
+			for (uint64_t max = target.max_value.load(std::memory_order_relaxed);
+				duration > max && !target.max_value.compare_exchange_weak(max, duration, std::memory_order_relaxed);)
+			{
+			}
+
+			if (all.capturing.load(std::memory_order_relaxed))
+			{
+				std::lock_guard<std::mutex> lock(all.mutex);
+
+				if (!all.capturing.load(std::memory_order_relaxed))
+				{
+					return;
+				}
+
+				if (all.events.size() < all.capacity)
+				{
+					all.events.push_back(trace_event{ point, _thread_id(), start, duration });
+				}
+				else
+				{
+					++all.dropped;
+				}
+			}
+		}
+
+		// Latencies of point recorded since start or last reset
+		static latency_histogram histogram(trace_point point)
+		{
+			const point_state& source = _state().points[static_cast<size_t>(point)];
+			latency_histogram out;
+
+			for (size_t i = 0; i < latency_histogram::bucket_count; ++i)
+			{
+				out.counts[i] = source.counts[i].load(std::memory_order_relaxed);
+				out.total += out.counts[i];
+			}
+
+			out.sum = source.sum.load(std::memory_order_relaxed);
+			out.max_value = source.max_value.load(std::memory_order_relaxed);
+			out.min_value = out.total ? source.min_value.load(std::memory_order_relaxed) : 0;
+
+			return out;
+		}
+
+		// Clear histograms, operations running meanwhile may be partly counted
+		static void reset()
+		{
+			for (point_state& point : _state().points)
+			{
+				for (std::atomic<uint64_t>& count : point.counts)
+				{
+					count.store(0, std::memory_order_relaxed);
+				}
+
+				point.sum.store(0, std::memory_order_relaxed);
+				point.min_value.store(UINT64_MAX, std::memory_order_relaxed);
+				point.max_value.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		// Start recording operations which end from now on, events of previous
+		// window are discarded. Operations past capacity are only counted
+		static void start_capture(size_t capacity = default_capacity)
+		{
+			state& all = _state();
+			std::lock_guard<std::mutex> lock(all.mutex);
+
+			all.events.clear();
+			all.events.reserve(capacity);
+			all.capacity = capacity;
+			all.dropped = 0;
+			all.capturing.store(true, std::memory_order_relaxed);
+		}
+
+		static void stop_capture()
+		{
+			state& all = _state();
+			std::lock_guard<std::mutex> lock(all.mutex);
+
+			all.capturing.store(false, std::memory_order_relaxed);
+		}
+
+		// Operations of capture window
+		static std::vector<trace_event> get_events()
+		{
+			state& all = _state();
+			std::lock_guard<std::mutex> lock(all.mutex);
+
+			return all.events;
+		}
+
+		// Operations of capture window which didn't fit its capacity
+		static uint64_t get_dropped()
+		{
+			state& all = _state();
+			std::lock_guard<std::mutex> lock(all.mutex);
+
+			return all.dropped;
+		}
+
+		// Write operations of capture window in Chrome trace event format,
+		// which chrome://tracing and Perfetto open
+		static void write_chrome_trace(std::ostream& out)
+		{
+			std::vector<trace_event> events = get_events();
+
+			std::ios_base::fmtflags flags = out.flags();
+			std::streamsize precision = out.precision();
+
+			out.setf(std::ios_base::fixed, std::ios_base::floatfield);
+			out.precision(3);
+			out << "{\"traceEvents\":[";
+
+			for (size_t i = 0; i < events.size(); ++i)
+			{
+				const trace_event& event = events[i];
+
+				out << (i ? ",\n" : "\n")
+					<< "{\"name\":\"" << trace_point_name(event.point)
+					<< "\",\"cat\":\"virtfiles\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+					<< ",\"ts\":" << event.start / 1e3
+					<< ",\"dur\":" << event.duration / 1e3 << "}";
+			}
+
+			out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+			out.flags(flags);
+			out.precision(precision);
+		}
+
+	private:
+		// Never destroyed, so operations at exit can be traced
+		static state& _state()
+		{
+			static state* instance = new state;
+
+			return *instance;
+		}
+
+		// Small number of thread for trace events
+		static uint32_t _thread_id()
+		{
+			static thread_local uint32_t id = _state().threads.fetch_add(1, std::memory_order_relaxed) + 1;
+
+			return id;
+		}
+	};
+
+	// Records time from construction to destruction to trace point
+	class trace_scope
+	{
+	protected:
+		trace_point point;
+		uint64_t start;
+
+	public:
+		explicit trace_scope(trace_point point)
+			: point(point), start(tracer::now())
+		{
+		}
+
+		~trace_scope()
+		{
+			tracer::record(point, start, tracer::now() - start);
+		}
+
+		trace_scope(const trace_scope&) = delete;
+		trace_scope& operator=(const trace_scope&) = delete;
+	};
+};
+
+#define VIRTFILES_TRACE_JOIN_(a, b) a##b
+#define VIRTFILES_TRACE_JOIN(a, b) VIRTFILES_TRACE_JOIN_(a, b)
+
+// Time rest of enclosing scope as trace_point::point
+#define VIRTFILES_TRACE_SCOPE(point) \
+	::virtfiles::trace_scope VIRTFILES_TRACE_JOIN(_virtfiles_trace_, __LINE__)(::virtfiles::trace_point::point)
+
+#else
+
+#define VIRTFILES_TRACE_SCOPE(point)
+
+#endif
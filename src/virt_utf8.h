@@ -0,0 +1,534 @@
+#pragma once
+
+#include "virt_simd.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace virtfiles
+{
+	// UTF-8 <-> UTF-32 transcoder. Runs of ASCII are converted by blocks
+	// with SIMD instructions, other chars one by one. Only well-formed
+	// UTF-8 is accepted: no overlong forms, surrogates or chars past U+10FFFF.
+	// Char32 is 32-bit code unit type, like char32_t or wchar_t on Linux
+	namespace utf8
+	{
+		enum class status
+		{
+			ok,			 // all input converted
+			output_full, // next char doesn't fit to output
+			incomplete,	 // input ends in the middle of char
+			invalid		 // ill-formed input
+		};
+
+		// Result of conversion, read and written are counts of
+		// converted units, conversion stops before the char it failed on
+		struct result
+		{
+			status code;
+			size_t read;
+			size_t written;
+		};
+
+		namespace detail
+		{
+			inline bool is_continuation(unsigned char byte)
+			{
+				return (byte & 0xC0) == 0x80;
+			}
+
+			// Decode char at in[i], advancing i and o
+			template <class Char32>
+			status decode_char(const unsigned char* in, size_t in_size, size_t& i,
+				Char32* out, size_t out_size, size_t& o)
+			{
+				if (o == out_size)
+				{
+					return status::output_full;
+				}
+
+				unsigned char lead = in[i];
+
+				if (lead < 0x80)
+				{
+					out[o++] = static_cast<Char32>(lead);
+					++i;
+
+					return status::ok;
+				}
+
+				size_t length;
+				unsigned char min_second = 0x80;
+				unsigned char max_second = 0xBF;
+				uint32_t code;
+
+				if (lead < 0xC2) // continuation or overlong 2 byte form
+				{
+					return status::invalid;
+				}
+				else if (lead < 0xE0)
+				{
+					length = 2;
+					code = lead & 0x1F;
+				}
+				else if (lead < 0xF0)
+				{
+					length = 3;
+					code = lead & 0x0F;
+
+					if (lead == 0xE0) // overlong
+					{
+						min_second = 0xA0;
+					}
+					else if (lead == 0xED) // surrogates
+					{
+						max_second = 0x9F;
+					}
+				}
+				else if (lead < 0xF5)
+				{
+					length = 4;
+					code = lead & 0x07;
+
+					if (lead == 0xF0) // overlong
+					{
+						min_second = 0x90;
+					}
+					else if (lead == 0xF4) // past U+10FFFF
+					{
+						max_second = 0x8F;
+					}
+				}
+				else
+				{
+					return status::invalid;
+				}
+
+				size_t available = in_size - i;
+
+				for (size_t k = 1; k < length; ++k)
+				{
+					if (k == available)
+					{
+						return status::incomplete;
+					}
+
+					unsigned char byte = in[i + k];
+
+					if (k == 1 ? byte < min_second || byte > max_second : !is_continuation(byte))
+					{
+						return status::invalid;
+					}
+
+					code = (code << 6) | (byte & 0x3F);
+				}
+
+				out[o++] = static_cast<Char32>(code);
+				i += length;
+
+				return status::ok;
+			}
+
+			// Encode char in[i], advancing i and o
+			template <class Char32>
+			status encode_char(const Char32* in, size_t& i,
+				unsigned char* out, size_t out_size, size_t& o)
+			{
+				uint32_t code = static_cast<uint32_t>(in[i]);
+				size_t left = out_size - o;
+
+				if (code < 0x80)
+				{
+					if (left < 1)
+					{
+						return status::output_full;
+					}
+
+					out[o++] = static_cast<unsigned char>(code);
+				}
+				else if (code < 0x800)
+				{
+					if (left < 2)
+					{
+						return status::output_full;
+					}
+
+					out[o++] = static_cast<unsigned char>(0xC0 | (code >> 6));
+					out[o++] = static_cast<unsigned char>(0x80 | (code & 0x3F));
+				}
+				else if (code < 0x10000)
+				{
+					if (code >= 0xD800 && code <= 0xDFFF) // surrogates are not chars
+					{
+						return status::invalid;
+					}
+
+					if (left < 3)
+					{
+						return status::output_full;
+					}
+
+					out[o++] = static_cast<unsigned char>(0xE0 | (code >> 12));
+					out[o++] = static_cast<unsigned char>(0x80 | ((code >> 6) & 0x3F));
+					out[o++] = static_cast<unsigned char>(0x80 | (code & 0x3F));
+				}
+				else if (code <= 0x10FFFF)
+				{
+					if (left < 4)
+					{
+						return status::output_full;
+					}
+
+					out[o++] = static_cast<unsigned char>(0xF0 | (code >> 18));
+					out[o++] = static_cast<unsigned char>(0x80 | ((code >> 12) & 0x3F));
+					out[o++] = static_cast<unsigned char>(0x80 | ((code >> 6) & 0x3F));
+					out[o++] = static_cast<unsigned char>(0x80 | (code & 0x3F));
+				}
+				else
+				{
+					return status::invalid;
+				}
+
+				++i;
+
+				return status::ok;
+			}
+
+			template <class Char32>
+			result decode_scalar(const unsigned char* in, size_t in_size, size_t i,
+				Char32* out, size_t out_size, size_t o)
+			{
+				while (i < in_size)
+				{
+					// ASCII run, 8 bytes at a time
+					while (i + 8 <= in_size && o + 8 <= out_size)
+					{
+						uint64_t block;
+						memcpy(&block, in + i, sizeof(block));
+
+						if (block & 0x8080808080808080ull)
+						{
+							break;
+						}
+
+						for (size_t k = 0; k < 8; ++k)
+						{
+							out[o + k] = static_cast<Char32>(in[i + k]);
+						}
+
+						i += 8;
+						o += 8;
+					}
+
+					if (i == in_size)
+					{
+						break;
+					}
+
+					status code = decode_char(in, in_size, i, out, out_size, o);
+
+					if (code != status::ok)
+					{
+						return { code, i, o };
+					}
+				}
+
+				return { status::ok, i, o };
+			}
+
+			template <class Char32>
+			result encode_scalar(const Char32* in, size_t in_size, size_t i,
+				unsigned char* out, size_t out_size, size_t o)
+			{
+				while (i < in_size)
+				{
+					status code = encode_char(in, i, out, out_size, o);
+
+					if (code != status::ok)
+					{
+						return { code, i, o };
+					}
+				}
+
+				return { status::ok, i, o };
+			}
+
+#ifdef VIRTFILES_SIMD_X86
+			inline unsigned count_trailing_zeros(unsigned mask)
+			{
+#if defined(_MSC_VER) && !defined(__clang__)
+				unsigned long index;
+				_BitScanForward(&index, mask);
+				return index;
+#else
+				return __builtin_ctz(mask);
+#endif
+			}
+
+			// Bit per code unit of chars which is ASCII
+			inline unsigned ascii_mask(__m128i chars, __m128i non_ascii)
+			{
+				__m128i ascii = _mm_cmpeq_epi32(_mm_and_si128(chars, non_ascii), _mm_setzero_si128());
+
+				return static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(ascii)));
+			}
+
+			VIRTFILES_TARGET_AVX2 inline unsigned ascii_mask_avx2(__m256i chars, __m256i non_ascii)
+			{
+				__m256i ascii = _mm256_cmpeq_epi32(_mm256_and_si256(chars, non_ascii), _mm256_setzero_si256());
+
+				return static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(ascii)));
+			}
+
+			template <class Char32>
+			result decode_sse2(const unsigned char* in, size_t in_size, size_t i,
+				Char32* out, size_t out_size, size_t o)
+			{
+				const __m128i zero = _mm_setzero_si128();
+
+				while (i < in_size)
+				{
+					while (i + 16 <= in_size && o + 16 <= out_size)
+					{
+						__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+						unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(bytes));
+
+						// Widen all 16 bytes, only ASCII prefix of them is taken
+						__m128i low = _mm_unpacklo_epi8(bytes, zero);
+						__m128i high = _mm_unpackhi_epi8(bytes, zero);
+
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), _mm_unpacklo_epi16(low, zero));
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + o + 4), _mm_unpackhi_epi16(low, zero));
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + o + 8), _mm_unpacklo_epi16(high, zero));
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + o + 12), _mm_unpackhi_epi16(high, zero));
+
+						if (mask != 0)
+						{
+							unsigned ascii = count_trailing_zeros(mask);
+							i += ascii;
+							o += ascii;
+							break;
+						}
+
+						i += 16;
+						o += 16;
+					}
+
+					if (i + 16 > in_size || o + 16 > out_size)
+					{
+						return decode_scalar(in, in_size, i, out, out_size, o);
+					}
+
+					status code = decode_char(in, in_size, i, out, out_size, o);
+
+					if (code != status::ok)
+					{
+						return { code, i, o };
+					}
+				}
+
+				return { status::ok, i, o };
+			}
+
+			template <class Char32>
+			VIRTFILES_TARGET_AVX2 result decode_avx2(const unsigned char* in, size_t in_size, size_t i,
+				Char32* out, size_t out_size, size_t o)
+			{
+
+				while (i < in_size)
+				{
+					while (i + 32 <= in_size && o + 32 <= out_size)
+					{
+						__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+						unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(bytes));
+
+						// Widen all 32 bytes, only ASCII prefix of them is taken
+						for (size_t k = 0; k < 32; k += 8)
+						{
+							__m128i part = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + k));
+							_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o + k), _mm256_cvtepu8_epi32(part));
+						}
+
+						if (mask != 0)
+						{
+							unsigned ascii = count_trailing_zeros(mask);
+							i += ascii;
+							o += ascii;
+							break;
+						}
+
+						i += 32;
+						o += 32;
+					}
+
+					if (i + 32 > in_size || o + 32 > out_size)
+					{
+						return decode_sse2(in, in_size, i, out, out_size, o);
+					}
+
+					status code = decode_char(in, in_size, i, out, out_size, o);
+
+					if (code != status::ok)
+					{
+						return { code, i, o };
+					}
+				}
+
+				return { status::ok, i, o };
+			}
+
+			template <class Char32>
+			result encode_sse2(const Char32* in, size_t in_size, size_t i,
+				unsigned char* out, size_t out_size, size_t o)
+			{
+				const __m128i non_ascii = _mm_set1_epi32(~0x7F);
+
+				while (i < in_size)
+				{
+					while (i + 16 <= in_size && o + 16 <= out_size)
+					{
+						__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+						__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 4));
+						__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+						__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+
+						// Bit per ASCII char
+						unsigned mask = ascii_mask(a, non_ascii)
+							| ascii_mask(b, non_ascii) << 4
+							| ascii_mask(c, non_ascii) << 8
+							| ascii_mask(d, non_ascii) << 12;
+
+						// Pack all 16 chars, only ASCII prefix of them is taken
+						__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), bytes);
+
+						if (mask != 0xFFFF)
+						{
+							unsigned ascii = count_trailing_zeros(~mask);
+							i += ascii;
+							o += ascii;
+							break;
+						}
+
+						i += 16;
+						o += 16;
+					}
+
+					if (i + 16 > in_size || o + 16 > out_size)
+					{
+						return encode_scalar(in, in_size, i, out, out_size, o);
+					}
+
+					status code = encode_char(in, i, out, out_size, o);
+
+					if (code != status::ok)
+					{
+						return { code, i, o };
+					}
+				}
+
+				return { status::ok, i, o };
+			}
+
+			template <class Char32>
+			VIRTFILES_TARGET_AVX2 result encode_avx2(const Char32* in, size_t in_size, size_t i,
+				unsigned char* out, size_t out_size, size_t o)
+			{
+				const __m256i non_ascii = _mm256_set1_epi32(~0x7F);
+				const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+				while (i < in_size)
+				{
+					while (i + 32 <= in_size && o + 32 <= out_size)
+					{
+						__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+						__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 8));
+						__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 16));
+						__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 24));
+
+						// Bit per ASCII char
+						unsigned mask = ascii_mask_avx2(a, non_ascii)
+							| ascii_mask_avx2(b, non_ascii) << 8
+							| ascii_mask_avx2(c, non_ascii) << 16
+							| ascii_mask_avx2(d, non_ascii) << 24;
+
+						// Pack all 32 chars, only ASCII prefix of them is taken.
+						// Packing works within 128-bit lanes, so dwords are reordered after it
+						__m256i words = _mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_packus_epi32(c, d));
+						_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o), _mm256_permutevar8x32_epi32(words, order));
+
+						if (mask != 0xFFFFFFFFu)
+						{
+							unsigned ascii = count_trailing_zeros(~mask);
+							i += ascii;
+							o += ascii;
+							break;
+						}
+
+						i += 32;
+						o += 32;
+					}
+
+					if (i + 32 > in_size || o + 32 > out_size)
+					{
+						return encode_sse2(in, in_size, i, out, out_size, o);
+					}
+
+					status code = encode_char(in, i, out, out_size, o);
+
+					if (code != status::ok)
+					{
+						return { code, i, o };
+					}
+				}
+
+				return { status::ok, i, o };
+			}
+#endif
+		};
+
+		// Convert UTF-8 bytes to UTF-32 code units
+		template <class Char32>
+		result decode(const char* in, size_t in_size, Char32* out, size_t out_size)
+		{
+			static_assert(sizeof(Char32) == 4, "UTF-32 code unit must be 4 bytes");
+
+			const unsigned char* bytes = reinterpret_cast<const unsigned char*>(in);
+
+#ifdef VIRTFILES_SIMD_X86
+			switch (simd::supported())
+			{
+			case simd::level::avx2:
+				return detail::decode_avx2(bytes, in_size, 0, out, out_size, 0);
+			case simd::level::sse2:
+				return detail::decode_sse2(bytes, in_size, 0, out, out_size, 0);
+			default:
+				break;
+			}
+#endif
+			return detail::decode_scalar(bytes, in_size, 0, out, out_size, 0);
+		}
+
+		// Convert UTF-32 code units to UTF-8 bytes
+		template <class Char32>
+		result encode(const Char32* in, size_t in_size, char* out, size_t out_size)
+		{
+			static_assert(sizeof(Char32) == 4, "UTF-32 code unit must be 4 bytes");
+
+			unsigned char* bytes = reinterpret_cast<unsigned char*>(out);
+
+#ifdef VIRTFILES_SIMD_X86
+			switch (simd::supported())
+			{
+			case simd::level::avx2:
+				return detail::encode_avx2(in, in_size, 0, bytes, out_size, 0);
+			case simd::level::sse2:
+				return detail::encode_sse2(in, in_size, 0, bytes, out_size, 0);
+			default:
+				break;
+			}
+#endif
+			return detail::encode_scalar(in, in_size, 0, bytes, out_size, 0);
+		}
+	};
+};